@@ -0,0 +1,458 @@
+#pragma once
+
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "common.h"
+#include "scoped_locks.h"
+#include "critical_section.h"
+#include "fences.h"
+#include "wait_policy.h"
+#include "timeout.h"
+#include "thread_exit.h"
+
+/// This is UltraFutexReadWriteMutex with the reader registry turned inside out:
+/// instead of a vector of pointers to heap-allocated TlsData, every thread owns
+/// one byte (a "slot") in a dense, cache-line-aligned array of reading flags,
+/// and its TLS value points straight at that byte.
+/// - The writer checks 16 slots per SSE2 compare (32 with AVX2) for "anybody
+///   reading?", so an idle registry of N threads costs N/64 cache lines
+///   instead of N cache misses.  Only slots that are actually set get waited
+///   on individually.
+/// - Slots are bytes rather than bits on purpose.  With bits, eight threads
+///   would share each byte, so a reader could no longer publish its flag
+///   with a plain store: it would need an interlocked OR/AND on every lock
+///   and unlock, and the writer could not futex-wait on one reader's flag.
+///   Bits would check 128/256 slots per compare instead of 16/32, but the
+///   scan is already a few instructions per cache line of readers.
+/// - The writer only scans up to the high-water mark of slots ever handed out;
+///   slots of exited threads are recycled.
+/// - The price is on the reader side: up to 64 readers share each cache line of
+///   flags, so concurrent readers in the same line do contend with each other.
+///   This trades reader scalability for writer latency; see TestWriterLatency().
+/// - The capacity is fixed at construction, since readers hold raw pointers
+///   into the array.  Threads that register once all slots are taken fall
+///   back to one shared counter, m_overflowReaders, for as long as they live:
+///   correct, but every such reader contends on the same cache line.
+/// - Read locks nest.  The slot's flag is shared with the writer, so the depth
+///   lives in a second TLS slot; only the outermost lock and unlock touch the
+///   flag.
+/// - A reader stores its flag and then loads m_writeRequested, and the writer
+///   does the reverse, so both sides need the store->load fence that TFence
+///   supplies, as in NumaReadWriteMutex.
+/// - Waits and wakes go through TWaitPolicy, as in UltraFutexReadWriteMutex.
+template <class TFence = SymmetricFence, class TMutex = CriticalSection, class TWaitPolicy = ParkWait>
+class BitmapReadWriteMutex
+{
+private: // types
+    // One per slot, so the slot can be returned when its thread exits.
+    struct SlotHook : public ThreadExitHook
+    {
+        BitmapReadWriteMutex* pOwner;
+        SlotHook* pNextExited;
+    };
+    typedef std::vector<SlotHook*> SlotHooks;
+    typedef TMutex Mutex_t;
+
+#if defined(__AVX2__)
+    enum { SLOTS_PER_VECTOR = 32 };
+#else
+    enum { SLOTS_PER_VECTOR = 16 };
+#endif
+
+private: // members
+    // treated as an atomic bool; also the futex that blocked readers sleep on
+    volatile long m_writeRequested;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+    // number of slotless readers currently reading; also the futex the writer
+    // waits for them on
+    volatile long m_overflowReaders;
+    volatile char pad1[CACHE_LINE_SIZE - 4];
+
+    DWORD m_tlsIndex;
+    // nesting depth of this thread's read locks
+    DWORD m_depthTlsIndex;
+
+    // m_capacity reading flags, one byte per slot
+    volatile char* m_pFlags;
+    SlotHook* m_pSlotHooks;
+    DWORD m_capacity;
+
+    // This critical section enforces the following
+    // - mutual exclusion of writers from each other
+    // - protects m_slotCount and m_freeSlots
+    Mutex_t m_cs;
+    // how waiters wait on the futex words
+    TWaitPolicy m_waitPolicy;
+    // slots [0, m_slotCount) have been handed out at some point
+    DWORD m_slotCount;
+    std::vector<DWORD> m_freeSlots;
+    // SlotHooks of exited threads, pushed lock-free by onThreadExit() and
+    // returned to m_freeSlots by reclaimSlots().
+    SlotHook* volatile m_pExitedSlots;
+
+private:
+    volatile char* initSlot()
+    {
+        DWORD slot = 0;
+        {
+            typename Mutex_t::ScopedWriteLock lk(m_cs);
+            reclaimSlots();
+            if (!m_freeSlots.empty())
+            {
+                slot = m_freeSlots.back();
+                m_freeSlots.pop_back();
+            }
+            else if (m_slotCount < m_capacity)
+            {
+                slot = m_slotCount++;
+            }
+            else
+            {
+                // too many threads; construct with a larger maxThreads to
+                // keep them off the shared counter
+                slot = m_capacity;
+            }
+        }
+        volatile char* pFlag = m_pFlags + slot;
+        TlsSetValue(m_tlsIndex, (void*)pFlag);
+        if (slot != m_capacity)
+        {
+            ThreadExitHooks::Register(&m_pSlotHooks[slot], &onThreadExit);
+        }
+        return pFlag;
+    }
+
+    volatile char* getFlag()
+    {
+        volatile char* pFlag = (volatile char*)InlineTlsGetValue(m_tlsIndex);
+        if (pFlag == NULL)
+        {
+            pFlag = initSlot();
+        }
+        return pFlag;
+    }
+
+    static void onThreadExit(ThreadExitHook* pHook)
+    {
+        // Runs on the exiting thread under the ThreadExitHooks lock, so it
+        // must not block; just hand the slot over to the next lock holder.
+        SlotHook* pSlotHook = static_cast<SlotHook*>(pHook);
+        BitmapReadWriteMutex* pOwner = pSlotHook->pOwner;
+        for (;;)
+        {
+            SlotHook* pHead = pOwner->m_pExitedSlots;
+            pSlotHook->pNextExited = pHead;
+            if (InterlockedCompareExchangePointer((PVOID volatile*)&pOwner->m_pExitedSlots, pSlotHook, pHead) == pHead)
+            {
+                break;
+            }
+        }
+    }
+
+    // Must be called with m_cs held.
+    void reclaimSlots()
+    {
+        if (m_pExitedSlots == NULL)
+        {
+            return;
+        }
+        SlotHook* pSlotHook = (SlotHook*)InterlockedExchangePointer((PVOID volatile*)&m_pExitedSlots, NULL);
+        while (pSlotHook)
+        {
+            m_freeSlots.push_back((DWORD)(pSlotHook - m_pSlotHooks));
+            pSlotHook = pSlotHook->pNextExited;
+        }
+    }
+
+    // Returns a bitmask of which of the SLOTS_PER_VECTOR flags at pFlags are set.
+    static unsigned int readingMask(volatile char const* pFlags)
+    {
+#if defined(__AVX2__)
+        const __m256i flags = _mm256_load_si256((__m256i const*)pFlags);
+        const __m256i idle = _mm256_cmpeq_epi8(flags, _mm256_setzero_si256());
+        return ~(unsigned int)_mm256_movemask_epi8(idle);
+#else
+        const __m128i flags = _mm_load_si128((__m128i const*)pFlags);
+        const __m128i idle = _mm_cmpeq_epi8(flags, _mm_setzero_si128());
+        return ~(unsigned int)_mm_movemask_epi8(idle) & 0xFFFF;
+#endif
+    }
+
+    // Slotless threads' TLS value: one past the last flag, never dereferenced.
+    bool isOverflow(volatile char* pFlag) const
+    {
+        return pFlag == m_pFlags + m_capacity;
+    }
+
+    // Like readLockFor(), for a thread that didn't get a slot.
+    bool overflowReadLockFor(const Timeout& timeout)
+    {
+        // the interlocked op orders the increment before the m_writeRequested load
+        _InterlockedIncrement(&m_overflowReaders);
+        while (m_writeRequested)
+        {
+            overflowReadUnlock();
+            if (!m_waitPolicy.WaitFor(&m_writeRequested, 1L, timeout.Remaining()) && m_writeRequested)
+            {
+                return false;
+            }
+            _InterlockedIncrement(&m_overflowReaders);
+        }
+        return true;
+    }
+
+    void overflowReadUnlock()
+    {
+        _InterlockedDecrement(&m_overflowReaders);
+        if (m_writeRequested)
+        {
+            m_waitPolicy.WakeOne(&m_overflowReaders);
+        }
+    }
+
+    // Bumps this thread's read nesting depth; returns the depth before.
+    long enterReadDepth()
+    {
+        const long depth = (long)(ULONG_PTR)InlineTlsGetValue(m_depthTlsIndex);
+        TlsSetValue(m_depthTlsIndex, (void*)(ULONG_PTR)(depth + 1));
+        return depth;
+    }
+
+    void readLock(volatile char* pFlag)
+    {
+        if (enterReadDepth() != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return;
+        }
+        if (isOverflow(pFlag))
+        {
+            overflowReadLockFor(Timeout(INFINITE));
+            return;
+        }
+        *pFlag = 1;
+        TFence::ReaderFence();
+        while (m_writeRequested)
+        {
+            *pFlag = 0;
+            m_waitPolicy.WakeOne(pFlag);
+            // wait until writer finishes
+            m_waitPolicy.Wait(&m_writeRequested, 1L);
+            *pFlag = 1;
+            TFence::ReaderFence();
+        }
+    }
+
+    bool readLockFor(volatile char* pFlag, DWORD milliseconds)
+    {
+        if (enterReadDepth() != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return true;
+        }
+        if (!readLockOutermostFor(pFlag, milliseconds))
+        {
+            TlsSetValue(m_depthTlsIndex, NULL);
+            return false;
+        }
+        return true;
+    }
+
+    bool readLockOutermostFor(volatile char* pFlag, DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (isOverflow(pFlag))
+        {
+            return overflowReadLockFor(timeout);
+        }
+        *pFlag = 1;
+        TFence::ReaderFence();
+        while (m_writeRequested)
+        {
+            *pFlag = 0;
+            m_waitPolicy.WakeOne(pFlag);
+            // wait until writer finishes, or give up
+            if (!m_waitPolicy.WaitFor(&m_writeRequested, 1L, timeout.Remaining()) && m_writeRequested)
+            {
+                return false;
+            }
+            *pFlag = 1;
+            TFence::ReaderFence();
+        }
+        return true;
+    }
+
+    void readUnlock(volatile char* pFlag)
+    {
+        const long depth = (long)(ULONG_PTR)InlineTlsGetValue(m_depthTlsIndex);
+        assert(depth > 0);
+        TlsSetValue(m_depthTlsIndex, (void*)(ULONG_PTR)(depth - 1));
+        if (depth != 1)
+        {
+            return;
+        }
+        if (isOverflow(pFlag))
+        {
+            overflowReadUnlock();
+            return;
+        }
+        *pFlag = 0;
+        if (m_writeRequested)
+        {
+            m_waitPolicy.WakeOne(pFlag);
+        }
+    }
+
+    // Waits for all reading flags to clear; m_cs must already be held.  If the
+    // timeout runs out first, releases the write lock and returns false.
+    bool bootReadersFor(const Timeout& timeout)
+    {
+        reclaimSlots();
+        m_writeRequested = 1;
+        TFence::WriterFence();
+        const DWORD slotEnd = m_slotCount;
+        for (DWORD base = 0; base < slotEnd; base += SLOTS_PER_VECTOR)
+        {
+            unsigned int mask = readingMask(m_pFlags + base);
+            while (mask)
+            {
+                unsigned long bit = 0;
+                _BitScanForward(&bit, mask);
+                mask &= mask - 1;
+                volatile char* pFlag = m_pFlags + base + bit;
+                while (*pFlag)
+                {
+                    if (!m_waitPolicy.WaitFor(pFlag, (char)1, timeout.Remaining()) && *pFlag)
+                    {
+                        WriteUnlock();
+                        return false;
+                    }
+                }
+            }
+        }
+        for (long overflowReaders = m_overflowReaders; overflowReaders != 0; overflowReaders = m_overflowReaders)
+        {
+            if (!m_waitPolicy.WaitFor(&m_overflowReaders, overflowReaders, timeout.Remaining()) &&
+                m_overflowReaders != 0)
+            {
+                WriteUnlock();
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    explicit BitmapReadWriteMutex(DWORD maxThreads = 4096)
+        : m_writeRequested(0)
+        , m_overflowReaders(0)
+        , m_tlsIndex(TLS_OUT_OF_INDEXES)
+        , m_depthTlsIndex(TLS_OUT_OF_INDEXES)
+        , m_pFlags(NULL)
+        , m_pSlotHooks(NULL)
+        , m_capacity(0)
+        , m_slotCount(0)
+        , m_pExitedSlots(NULL)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+        memset((void*)pad1, 0, sizeof(pad1));
+
+        // whole cache lines, so the writer never has to deal with a partial vector
+        m_capacity = (maxThreads + CACHE_LINE_SIZE - 1) & ~(DWORD)(CACHE_LINE_SIZE - 1);
+        m_pFlags = (volatile char*)_aligned_malloc(m_capacity, CACHE_LINE_SIZE);
+        assert(m_pFlags != NULL);
+        memset((void*)m_pFlags, 0, m_capacity);
+        m_pSlotHooks = new SlotHook[m_capacity];
+        for (DWORD slot = 0; slot < m_capacity; slot++)
+        {
+            m_pSlotHooks[slot].pOwner = this;
+            m_pSlotHooks[slot].pNextExited = NULL;
+        }
+
+        m_tlsIndex = TlsAlloc();
+        assert(m_tlsIndex != TLS_OUT_OF_INDEXES);
+        m_depthTlsIndex = TlsAlloc();
+        assert(m_depthTlsIndex != TLS_OUT_OF_INDEXES);
+    }
+    ~BitmapReadWriteMutex()
+    {
+        SlotHooks slotHooks;
+        for (DWORD slot = 0; slot < m_slotCount; slot++)
+        {
+            slotHooks.push_back(&m_pSlotHooks[slot]);
+        }
+        ThreadExitHooks::UnregisterAll(slotHooks);
+        delete[] m_pSlotHooks;
+        _aligned_free((void*)m_pFlags);
+        TlsFree(m_depthTlsIndex);
+        TlsFree(m_tlsIndex);
+    }
+
+    void WriteLock()
+    {
+        m_cs.WriteLock();
+        bootReadersFor(Timeout(INFINITE));
+    }
+    void WriteUnlock()
+    {
+        m_writeRequested = 0;
+        m_waitPolicy.WakeAll(&m_writeRequested);
+        m_cs.WriteUnlock();
+    }
+    void ReadLock()
+    {
+        volatile char* pFlag = getFlag();
+        readLock(pFlag);
+    }
+    void ReadUnlock()
+    {
+        volatile char* pFlag = getFlag();
+        readUnlock(pFlag);
+    }
+
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out lets back in the readers it had blocked.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_cs.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        return bootReadersFor(timeout);
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        volatile char* pFlag = getFlag();
+        return readLockFor(pFlag, milliseconds);
+    }
+
+    typedef ScopedWriteLock<BitmapReadWriteMutex<TFence, TMutex, TWaitPolicy> > ScopedWriteLock;
+
+    class ScopedReadLock
+    {
+        BitmapReadWriteMutex& m_mutex;
+        volatile char* m_pFlag;
+
+    public:
+        ScopedReadLock(BitmapReadWriteMutex& mutex)
+            : m_mutex(mutex)
+        {
+            m_pFlag = m_mutex.getFlag();
+            m_mutex.readLock(m_pFlag);
+        }
+        ~ScopedReadLock()
+        {
+            m_mutex.readUnlock(m_pFlag);
+        }
+    };
+};
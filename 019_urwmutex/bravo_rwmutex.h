@@ -0,0 +1,251 @@
+#pragma once
+
+#include "common.h"
+#include "scoped_locks.h"
+#include "timeout.h"
+
+/// The visible readers table shared by every BravoReadWriteMutex in the process.
+/// Each slot holds the address of the mutex that a fast-path reader is reading,
+/// or NULL.  Slots are not padded; see BravoReadWriteMutex.
+///
+/// It's a template only so that the table can live in this header.
+template <int TDummy>
+class BravoReaderTableT
+{
+public:
+    enum
+    {
+        SLOT_COUNT = 4096
+    };
+
+    static void* volatile s_slots[SLOT_COUNT];
+
+    /// Picks the slot for the calling thread reading pMutex.  Mixing in the
+    /// mutex spreads one thread's reads of different mutexes over the table.
+    static void* volatile* Slot(void* pMutex)
+    {
+        const ULONGLONG key = (ULONGLONG)(ULONG_PTR)pMutex ^ ((ULONGLONG)GetCurrentThreadId() << 20);
+        // Fibonacci hashing; the top 12 bits index the table
+        const ULONGLONG hash = key * 0x9E3779B97F4A7C15ull;
+        return &s_slots[(size_t)(hash >> 52)];
+    }
+};
+
+template <int TDummy>
+void* volatile BravoReaderTableT<TDummy>::s_slots[BravoReaderTableT<TDummy>::SLOT_COUNT];
+
+typedef BravoReaderTableT<0> BravoReaderTable;
+
+/// Biased-reader wrapper, after Dice & Kogan, "BRAVO -- Biased Locking for
+/// Reader-Writer Locks" (USENIX ATC 2019).  Puts a reader fast path in front of
+/// any zoo mutex TMutex.
+/// - While the mutex is reader-biased, a reader just claims its hashed slot in
+///   the process-wide BravoReaderTable with one CAS, and never touches TMutex.
+///   The slots are packed, eight to a cache line, as in the paper, so that a
+///   writer's scan of the table touches 512 lines rather than 4096.  So two
+///   readers only write the same line when their hashes land in the same
+///   group of eight slots, rather than always, as on TMutex's own reader count.
+/// - A writer takes TMutex, turns the bias off, and waits for every slot that
+///   points at this mutex to drain.  That scan is the price of the bias, so
+///   afterwards the bias stays off for INHIBIT_MULTIPLIER times as long as the
+///   scan took; readers go through TMutex meanwhile, and the first one to find
+///   the inhibit period over turns the bias back on.
+/// - Unlike the TLS-based mutexes, this adds no per-mutex TLS slot and no
+///   per-thread registration; the table's memory is shared by all instances.
+/// - A reader whose slot is taken (a hash collision) just takes the slow path.
+/// - The fast path needs to know, at unlock time, whether it was taken, so
+///   only ScopedReadLock uses it.  Plain ReadLock()/ReadUnlock() always go
+///   through TMutex (they can still turn the bias back on).
+template <class TMutex>
+class BravoReadWriteMutex
+{
+private: // types
+    enum
+    {
+        INHIBIT_MULTIPLIER = 9
+    };
+
+private: // members
+    // treated as an atomic bool; read by every reader
+    volatile long m_readerBias;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+    // QueryPerformanceCounter time until which the bias stays off
+    volatile __int64 m_inhibitUntil;
+    volatile char pad1[CACHE_LINE_SIZE - 8];
+
+    TMutex m_mutex;
+
+private: // methods
+    static __int64 now()
+    {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        return counter.QuadPart;
+    }
+
+    // Returns the claimed slot, or NULL if the reader must use m_mutex.
+    void* volatile* tryFastReadLock()
+    {
+        if (!m_readerBias)
+        {
+            return NULL;
+        }
+        void* volatile* pSlot = BravoReaderTable::Slot(this);
+        if (InterlockedCompareExchangePointer((PVOID volatile*)pSlot, this, NULL) != NULL)
+        {
+            return NULL;
+        }
+        // The CAS is a full barrier, so either a writer that's revoking the
+        // bias will see our slot, or we see the bias cleared.
+        if (m_readerBias)
+        {
+            return pSlot;
+        }
+        *pSlot = NULL;
+        return NULL;
+    }
+
+    void slowReadLock()
+    {
+        m_mutex.ReadLock();
+        if (!m_readerBias && now() >= m_inhibitUntil)
+        {
+            // Holding the read lock keeps writers out, so no revocation can
+            // be in progress.
+            m_readerBias = 1;
+        }
+    }
+
+    void* volatile* readLock()
+    {
+        void* volatile* pSlot = tryFastReadLock();
+        if (pSlot == NULL)
+        {
+            slowReadLock();
+        }
+        return pSlot;
+    }
+
+    void readUnlock(void* volatile* pSlot)
+    {
+        if (pSlot)
+        {
+            *pSlot = NULL;
+        }
+        else
+        {
+            m_mutex.ReadUnlock();
+        }
+    }
+
+    // Returns false, with the bias back on, if the timeout runs out before
+    // the fast-path readers drain.
+    bool revokeBias(const Timeout& timeout)
+    {
+        m_readerBias = 0;
+        MemoryBarrier();
+        const __int64 start = now();
+        for (long u = 0; u < BravoReaderTable::SLOT_COUNT; u++)
+        {
+            while (BravoReaderTable::s_slots[u] == this)
+            {
+                if (timeout.Expired())
+                {
+                    // we still hold m_mutex, so no reader can be setting it
+                    m_readerBias = 1;
+                    return false;
+                }
+                YieldProcessor();
+            }
+        }
+        const __int64 end = now();
+        m_inhibitUntil = end + (end - start) * INHIBIT_MULTIPLIER;
+        return true;
+    }
+
+public: // interface
+    BravoReadWriteMutex()
+        : m_readerBias(1)
+        , m_inhibitUntil(0)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+        memset((void*)pad1, 0, sizeof(pad1));
+    }
+
+    void WriteLock()
+    {
+        m_mutex.WriteLock();
+        if (m_readerBias)
+        {
+            revokeBias(Timeout(INFINITE));
+        }
+    }
+    void WriteUnlock()
+    {
+        m_mutex.WriteUnlock();
+    }
+    void ReadLock()
+    {
+        slowReadLock();
+    }
+    void ReadUnlock()
+    {
+        m_mutex.ReadUnlock();
+    }
+
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// Requires TMutex::WriteLockFor.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_mutex.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        if (m_readerBias && !revokeBias(timeout))
+        {
+            m_mutex.WriteUnlock();
+            return false;
+        }
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    /// Always takes the slow path, like ReadLock().
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        if (!m_mutex.ReadLockFor(milliseconds))
+        {
+            return false;
+        }
+        if (!m_readerBias && now() >= m_inhibitUntil)
+        {
+            m_readerBias = 1;
+        }
+        return true;
+    }
+
+    typedef ScopedWriteLock<BravoReadWriteMutex<TMutex> > ScopedWriteLock;
+
+    class ScopedReadLock
+    {
+        BravoReadWriteMutex& m_mutex;
+        void* volatile* m_pSlot;
+
+    public:
+        ScopedReadLock(BravoReadWriteMutex& mutex)
+            : m_mutex(mutex)
+        {
+            m_pSlot = m_mutex.readLock();
+        }
+        ~ScopedReadLock()
+        {
+            m_mutex.readUnlock(m_pSlot);
+        }
+    };
+};
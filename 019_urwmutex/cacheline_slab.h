@@ -0,0 +1,184 @@
+#pragma once
+
+#include <new>
+#include "common.h"
+#include "processor_topology.h"
+
+/// Spacing, in bytes, between per-thread reader records (TlsData).
+/// - CACHE_LINE_SIZE (the default) gives every record its own cache line, so
+///   one reader's isReading store never invalidates another reader's line.
+/// - 128 additionally keeps records out of each other's adjacent-line
+///   prefetch pair, which Intel parts fetch together.
+/// - 0 falls back to plain operator new, for before/after comparisons.
+#ifndef TLS_DATA_SPACING
+#define TLS_DATA_SPACING CACHE_LINE_SIZE
+#endif
+
+#if TLS_DATA_SPACING
+
+/// A process-wide slab of TLS_DATA_SPACING-aligned blocks.
+/// A general-purpose heap packs small allocations next to each other, so
+/// several threads' TlsData (and thus their isReading flags) end up sharing a
+/// cache line, undoing the care taken to pad m_writeRequested.
+/// Here every allocation starts on its own block boundary, and is rounded up to
+/// a whole number of blocks.
+/// - Blocks are carved out of chunks, and freed blocks go onto a free list per
+///   block count.  Chunks are never returned to the OS; like the TlsData they
+///   hold, they're expected to be few and long lived.
+/// - Chunks and free lists are per NUMA node, and an allocation is served from
+///   the calling thread's node.  TlsData is allocated by the thread that owns
+///   it, so its flags end up in memory local to the reader that writes them.
+///   Each chunk records its node in its first block, so Free() can return a
+///   block to the right list from any thread.
+/// - One lock for everything, since allocation only happens when a thread first
+///   touches a mutex.
+///
+/// It's a template only so that the statics can live in this header.
+template <int TDummy>
+class CacheLineSlabT
+{
+public:
+    enum
+    {
+        BLOCK_SIZE = TLS_DATA_SPACING,
+        MAX_BLOCKS = 8,
+        MAX_NODES = 64,
+        // the allocation granularity, which VirtualAlloc aligns chunks to
+        CHUNK_SIZE = 0x10000
+    };
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* pNext;
+    };
+    // occupies the first block of each chunk
+    struct ChunkHeader
+    {
+        DWORD node;
+    };
+
+    static SRWLOCK s_lock;
+    // indexed by [node][block count - 1]
+    static FreeBlock* s_freeLists[MAX_NODES][MAX_BLOCKS];
+    static char* s_pChunkCursor[MAX_NODES];
+    static char* s_pChunkEnd[MAX_NODES];
+
+private:
+    static size_t blockCount(size_t size)
+    {
+        const size_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        assert(blocks <= MAX_BLOCKS);
+        return blocks;
+    }
+
+    static DWORD currentNode()
+    {
+        const DWORD node = NumaNodeMap::CurrentNodeIndex();
+        return node < MAX_NODES ? node : 0;
+    }
+
+    static void pushFree(void* p, DWORD node, size_t blocks)
+    {
+        FreeBlock* pBlock = (FreeBlock*)p;
+        pBlock->pNext = s_freeLists[node][blocks - 1];
+        s_freeLists[node][blocks - 1] = pBlock;
+    }
+
+    // Returns false if the OS is out of memory.
+    static bool newChunk(DWORD node)
+    {
+        // don't waste the tail of the old chunk
+        for (; s_pChunkCursor[node] < s_pChunkEnd[node]; s_pChunkCursor[node] += BLOCK_SIZE)
+        {
+            pushFree(s_pChunkCursor[node], node, 1);
+        }
+        char* pChunk = (char*)VirtualAllocExNuma(GetCurrentProcess(), NULL, CHUNK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+        if (pChunk == NULL)
+        {
+            // e.g. a node with no memory left; the chunk still serves this
+            // node's free lists, just not from local memory
+            pChunk = (char*)VirtualAlloc(NULL, CHUNK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+            if (pChunk == NULL)
+            {
+                return false;
+            }
+        }
+        assert(((ULONG_PTR)pChunk & (CHUNK_SIZE - 1)) == 0);
+        ((ChunkHeader*)pChunk)->node = node;
+        s_pChunkCursor[node] = pChunk + BLOCK_SIZE;
+        s_pChunkEnd[node] = pChunk + CHUNK_SIZE;
+        return true;
+    }
+
+public:
+    static void* Allocate(size_t size)
+    {
+        const size_t blocks = blockCount(size);
+        const size_t bytes = blocks * BLOCK_SIZE;
+        const DWORD node = currentNode();
+        void* p = NULL;
+
+        AcquireSRWLockExclusive(&s_lock);
+        if (s_freeLists[node][blocks - 1])
+        {
+            p = s_freeLists[node][blocks - 1];
+            s_freeLists[node][blocks - 1] = s_freeLists[node][blocks - 1]->pNext;
+        }
+        else
+        {
+            if ((size_t)(s_pChunkEnd[node] - s_pChunkCursor[node]) < bytes && !newChunk(node))
+            {
+                ReleaseSRWLockExclusive(&s_lock);
+                // this backs operator new, which mustn't return NULL
+                throw std::bad_alloc();
+            }
+            p = s_pChunkCursor[node];
+            s_pChunkCursor[node] += bytes;
+        }
+        ReleaseSRWLockExclusive(&s_lock);
+
+        return p;
+    }
+
+    static void Free(void* p, size_t size)
+    {
+        if (p == NULL)
+        {
+            return;
+        }
+        const size_t blocks = blockCount(size);
+        const ChunkHeader* pHeader = (const ChunkHeader*)((ULONG_PTR)p & ~(ULONG_PTR)(CHUNK_SIZE - 1));
+        AcquireSRWLockExclusive(&s_lock);
+        pushFree(p, pHeader->node, blocks);
+        ReleaseSRWLockExclusive(&s_lock);
+    }
+};
+
+template <int TDummy>
+SRWLOCK CacheLineSlabT<TDummy>::s_lock = SRWLOCK_INIT;
+template <int TDummy>
+typename CacheLineSlabT<TDummy>::FreeBlock* CacheLineSlabT<TDummy>::s_freeLists[MAX_NODES][MAX_BLOCKS];
+template <int TDummy>
+char* CacheLineSlabT<TDummy>::s_pChunkCursor[MAX_NODES];
+template <int TDummy>
+char* CacheLineSlabT<TDummy>::s_pChunkEnd[MAX_NODES];
+
+typedef CacheLineSlabT<0> CacheLineSlab;
+
+#endif // TLS_DATA_SPACING
+
+/// Derive a per-thread record from this to allocate it from CacheLineSlab.
+struct CacheLineAllocated
+{
+#if TLS_DATA_SPACING
+    static void* operator new(size_t size)
+    {
+        return CacheLineSlab::Allocate(size);
+    }
+    static void operator delete(void* p, size_t size)
+    {
+        CacheLineSlab::Free(p, size);
+    }
+#endif
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include "common.h"
+#include "scoped_locks.h"
+#include "wait_policy.h"
+#include "timeout.h"
+#include "processor_topology.h"
+
+/// A NUMA-aware exclusive lock, after Dice, Marathe & Shavit, "Lock Cohorting:
+/// A General Technique for Designing NUMA Locks" (the C-TKT-TKT variant).
+/// - There is one ticket lock per NUMA node, plus one global ticket lock.
+///   A thread first takes its node's lock, then the global lock.
+/// - On release, if another thread on the same node is already queued on the
+///   node's lock, the global lock is handed over along with the node lock,
+///   without ever being released.  So a burst of acquisitions from one node
+///   keeps the global lock (and the data it protects) on that node, instead of
+///   bouncing both across the interconnect on every handoff.
+/// - MAX_BATCH bounds how many consecutive handoffs one node gets, so other
+///   nodes can't be starved.
+/// - Ticket locks are thread-oblivious (any thread can release them), which
+///   the global lock needs: it is released by whichever cohort member is last.
+/// - Waiters wait on the grant word via TWaitPolicy; by default they spin
+///   briefly, then sleep.
+///
+/// It's a template only so that the wait policy can be chosen;
+/// CohortLock is the default instantiation.
+template <class TWaitPolicy = SpinThenParkWait<> >
+class CohortLockT
+{
+private: // types
+    enum
+    {
+        MAX_BATCH = 64
+    };
+
+    struct TicketLock
+    {
+        volatile long request;
+        volatile char pad0[CACHE_LINE_SIZE - 4];
+        volatile long grant;
+        volatile char pad1[CACHE_LINE_SIZE - 4];
+    };
+
+    struct NodeLock : public TicketLock
+    {
+        // only accessed by the holder of this node lock:
+        // set when the previous holder handed over the global lock too
+        bool globalPassed;
+        long batchCount;
+        char pad2[CACHE_LINE_SIZE - sizeof(bool) - sizeof(long)];
+    };
+
+private: // members
+    TicketLock m_global;
+    NodeLock* m_pNodes;
+    DWORD m_nodeCount;
+    // the node lock that the current holder took; only accessed by the holder
+    DWORD m_ownerNode;
+    TWaitPolicy m_waitPolicy;
+
+private: // methods
+    void acquire(TicketLock& lock)
+    {
+        const long ticket = _InterlockedExchangeAdd(&lock.request, 1);
+        for (;;)
+        {
+            const long grant = lock.grant;
+            if (grant == ticket)
+            {
+                break;
+            }
+            m_waitPolicy.Wait(&lock.grant, grant);
+        }
+    }
+
+    // Takes a ticket only if it would be served at once; a ticket can't be
+    // given back once taken.
+    static bool tryAcquire(TicketLock& lock)
+    {
+        const long grant = lock.grant;
+        return _InterlockedCompareExchange(&lock.request, grant + 1, grant) == grant;
+    }
+
+    void release(TicketLock& lock)
+    {
+        // only the holder writes grant
+        lock.grant = lock.grant + 1;
+        m_waitPolicy.WakeAll(&lock.grant);
+    }
+
+    static bool hasWaiters(TicketLock const& lock)
+    {
+        // the holder's own ticket accounts for one
+        return lock.request - lock.grant > 1;
+    }
+
+    DWORD currentNode() const
+    {
+        const DWORD node = NumaNodeMap::CurrentNodeIndex();
+        return node < m_nodeCount ? node : 0;
+    }
+
+public: // interface
+    CohortLockT()
+        : m_pNodes(NULL)
+        , m_nodeCount(0)
+        , m_ownerNode(0)
+    {
+        memset(&m_global, 0, sizeof(m_global));
+
+        NumaNodeMap numa;
+        m_nodeCount = numa.NodeCount();
+        m_pNodes = (NodeLock*)_aligned_malloc(m_nodeCount * sizeof(NodeLock), CACHE_LINE_SIZE);
+        assert(m_pNodes != NULL);
+        memset(m_pNodes, 0, m_nodeCount * sizeof(NodeLock));
+    }
+    ~CohortLockT()
+    {
+        _aligned_free(m_pNodes);
+    }
+
+    void WriteLock()
+    {
+        const DWORD node = currentNode();
+        NodeLock& local = m_pNodes[node];
+        acquire(local);
+        if (local.globalPassed)
+        {
+            local.globalPassed = false;
+        }
+        else
+        {
+            acquire(m_global);
+        }
+        m_ownerNode = node;
+    }
+    void WriteUnlock()
+    {
+        NodeLock& local = m_pNodes[m_ownerNode];
+        if (hasWaiters(local) && local.batchCount < MAX_BATCH)
+        {
+            local.batchCount += 1;
+            local.globalPassed = true;
+            release(local);
+            return;
+        }
+        local.batchCount = 0;
+        release(m_global);
+        release(local);
+    }
+    void ReadLock()
+    {
+        WriteLock();
+    }
+    void ReadUnlock()
+    {
+        WriteUnlock();
+    }
+
+    bool TryWriteLock()
+    {
+        const DWORD node = currentNode();
+        NodeLock& local = m_pNodes[node];
+        if (!tryAcquire(local))
+        {
+            return false;
+        }
+        if (local.globalPassed)
+        {
+            local.globalPassed = false;
+        }
+        else if (!tryAcquire(m_global))
+        {
+            // a node-mate that queued meanwhile takes the global lock itself
+            release(local);
+            return false;
+        }
+        m_ownerNode = node;
+        return true;
+    }
+    /// Waiting in a ticket queue can't be abandoned, so this polls.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        for (long attempt = 0; !TryWriteLock(); attempt++)
+        {
+            if (timeout.Expired())
+            {
+                return false;
+            }
+            Sleep(attempt < 16 ? 0 : 1);
+        }
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return TryWriteLock();
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        return WriteLockFor(milliseconds);
+    }
+
+    typedef ScopedWriteLock<CohortLockT<TWaitPolicy> > ScopedWriteLock;
+    typedef ScopedReadLock<CohortLockT<TWaitPolicy> > ScopedReadLock;
+};
+
+typedef CohortLockT<> CohortLock;
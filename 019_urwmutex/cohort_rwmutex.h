@@ -2,21 +2,37 @@
 
 #include "common.h"
 #include "scoped_locks.h"
-#include "critical_section.h"
+#include "cohort_lock.h"
+#include "timeout.h"
+#include "wait_policy.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
 
 /// This mutex is OK in terms of reader speed, but writer speed is still lacking.
-template <class TSema>
+/// Writers (and the first reader of each reader cohort) serialize on a
+/// CohortLock, so under writer-heavy load the writer lock is handed around
+/// within a NUMA node before it moves to another one.
+/// A timed reader never joins a cohort, whose count the first reader has
+/// already acted on; it waits on m_writeRequested until no writer is present
+/// instead.
+/// The writer and the cohort's first reader spin on the word their event
+/// stands for, as TWaitPolicy's Spin() decides, before they wait on the event;
+/// the default goes straight to the event.  Cohort members wait on TSema.
+template <class TSema, class TMutex = CohortLock, class TWaitPolicy = ParkWait>
 class CohortReadWriteMutex
 {
 private: // types
-    struct TlsData
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
     {
         volatile DWORD isReading;
+        // nesting depth of this thread's read locks; only touched by the owning thread
+        long readDepth;
         long readerOrder;
         HANDLE readerDoneEvent;
 
         TlsData()
             : isReading(false)
+            , readDepth(0)
             , readerOrder(0)
             , readerDoneEvent(NULL)
         {
@@ -29,9 +45,10 @@ private: // types
         }
     };
     typedef std::vector<TlsData*> ThreadStates;
-    typedef CriticalSection Mutex_t;
+    typedef TMutex Mutex_t;
 
 private: // members
+    // treated as an atomic bool; also the futex that timed readers wait on
     volatile long m_writeRequested;
     volatile char pad0[CACHE_LINE_SIZE - 4];
     volatile long m_readerCount;
@@ -42,9 +59,9 @@ private: // members
     DWORD m_tlsIndex;
 
     // Writer mutex, to mutually exclude writers from each other and from all-consecutive-readers.
-    // Also protects m_threadStates when new readers arrive.
+    // Also protects m_registry when new readers arrive.
     Mutex_t m_csWriter;
-    ThreadStates m_threadStates;
+    ThreadRegistry<TlsData> m_registry;
 
     // ManualRE Signaled when the current cohort of readers gets signaled.
     TSema m_cohortReadySema;
@@ -53,17 +70,20 @@ private: // members
     // exits the mutex, so that the first locked reader may release m_csWriter.
     HANDLE m_cohortDoneEvent;
 
+    // how waiters wait on m_writeRequested, and spin before the events
+    TWaitPolicy m_waitPolicy;
+
 private: // methods
     TlsData* initTlsData()
     {
-        TlsData* pTlsData = new TlsData();
-        TlsSetValue(m_tlsIndex, (void*)pTlsData);
-        DWORD threadId = GetCurrentThreadId();
-
+        TlsData* pTlsData = NULL;
         {
-            Mutex_t::ScopedWriteLock lk(m_csWriter);
-            m_threadStates.push_back(pTlsData);
+            typename Mutex_t::ScopedWriteLock lk(m_csWriter);
+            m_registry.Compact();
+            pTlsData = m_registry.Add();
         }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
         return pTlsData;
     }
 
@@ -79,6 +99,11 @@ private: // methods
 
     void readLock(TlsData* pTlsData)
     {
+        if (pTlsData->readDepth++ != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return;
+        }
         pTlsData->isReading = true;
         if (m_writeRequested)
         {
@@ -102,8 +127,38 @@ private: // methods
         }
     }
 
+    bool readLockFor(TlsData* pTlsData, DWORD milliseconds)
+    {
+        if (pTlsData->readDepth != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            pTlsData->readDepth++;
+            return true;
+        }
+        Timeout timeout(milliseconds);
+        pTlsData->isReading = true;
+        while (m_writeRequested)
+        {
+            pTlsData->isReading = false;
+            SetEvent(pTlsData->readerDoneEvent);
+            // wait until writer finishes, or give up
+            if (!m_waitPolicy.WaitFor(&m_writeRequested, 1L, timeout.Remaining()) && m_writeRequested)
+            {
+                return false;
+            }
+            pTlsData->isReading = true;
+        }
+        pTlsData->readDepth = 1;
+        return true;
+    }
+
     void readUnlock(TlsData* pTlsData)
     {
+        assert(pTlsData->readDepth > 0);
+        if (--pTlsData->readDepth != 0)
+        {
+            return;
+        }
         pTlsData->isReading = false;
         if (pTlsData->readerOrder)
         {
@@ -123,7 +178,15 @@ private: // methods
             {
                 if (pTlsData->readerOrder == 1)
                 {
-                    WaitForSingleObject(m_cohortDoneEvent, INFINITE);
+                    // wait for the rest of the cohort to leave; a spin that
+                    // sees them go can leave the event set, so re-check
+                    for (long cohortCount = m_cohortCount; cohortCount != 0; cohortCount = m_cohortCount)
+                    {
+                        if (!m_waitPolicy.Spin(&m_cohortCount, cohortCount, INFINITE))
+                        {
+                            WaitForSingleObject(m_cohortDoneEvent, INFINITE);
+                        }
+                    }
                     m_csWriter.WriteUnlock();
                 }
             }
@@ -135,6 +198,32 @@ private: // methods
         }
     }
 
+    // Waits for all readers to leave; m_csWriter must already be held.  If the
+    // timeout runs out first, releases the write lock and returns false.
+    bool bootReadersFor(const Timeout& timeout)
+    {
+        m_registry.Compact();
+        m_writeRequested = true;
+        for (typename ThreadStates::const_iterator iter = m_registry.Threads().begin(),
+                                                    end = m_registry.Threads().end();
+             iter != end;
+             ++iter)
+        {
+            TlsData* pTlsData = *iter;
+            while (pTlsData->isReading)
+            {
+                if (!m_waitPolicy.Spin(&pTlsData->isReading, (DWORD)true, timeout.Remaining()) &&
+                    WaitForSingleObject(pTlsData->readerDoneEvent, timeout.Remaining()) == WAIT_TIMEOUT &&
+                    pTlsData->isReading)
+                {
+                    WriteUnlock();
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
 public: // interface
     CohortReadWriteMutex()
         : m_tlsIndex(TLS_OUT_OF_INDEXES)
@@ -156,36 +245,18 @@ public: // interface
     ~CohortReadWriteMutex()
     {
         CloseHandle(m_cohortDoneEvent);
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            delete pTlsData;
-        }
         TlsFree(m_tlsIndex);
     }
 
     void WriteLock()
     {
         m_csWriter.WriteLock();
-        m_writeRequested = true;
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            while (pTlsData->isReading)
-            {
-                WaitForSingleObject(pTlsData->readerDoneEvent, INFINITE);
-            }
-        }
+        bootReadersFor(Timeout(INFINITE));
     }
     void WriteUnlock()
     {
         m_writeRequested = false;
+        m_waitPolicy.WakeAll(&m_writeRequested);
         m_csWriter.WriteUnlock();
     }
     void ReadLock()
@@ -199,7 +270,31 @@ public: // interface
         readUnlock(pTlsData);
     }
 
-    typedef ScopedWriteLock<CohortReadWriteMutex> ScopedWriteLock;
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out lets back in the readers it had blocked.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_csWriter.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        return bootReadersFor(timeout);
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        TlsData* pTlsData = getTlsData();
+        return readLockFor(pTlsData, milliseconds);
+    }
+
+    typedef ScopedWriteLock<CohortReadWriteMutex<TSema, TMutex, TWaitPolicy> > ScopedWriteLock;
 
     class ScopedReadLock
     {
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "scoped_locks.h"
+#include "timeout.h"
 
 class CriticalSection
 {
@@ -34,6 +35,33 @@ public:
         WriteUnlock();
     }
 
+    bool TryWriteLock()
+    {
+        return TryEnterCriticalSection(&m_cs) != FALSE;
+    }
+    /// CRITICAL_SECTION has no timed wait, so this polls.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        for (long attempt = 0; !TryWriteLock(); attempt++)
+        {
+            if (timeout.Expired())
+            {
+                return false;
+            }
+            Sleep(attempt < 16 ? 0 : 1);
+        }
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return TryWriteLock();
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        return WriteLockFor(milliseconds);
+    }
+
     typedef ScopedWriteLock<CriticalSection> ScopedWriteLock;
     typedef ScopedReadLock<CriticalSection> ScopedReadLock;
 };
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "critical_section.h"
+#include "timeout.h"
 
 /// This semaphore class is built on a atomics + events + critical section.
 /// It's the same fundamental design as FastStSemaphore, just using CS instead of event for waiter arbitration.
@@ -45,6 +46,46 @@ public:
         }
     }
 
+    bool TryP()
+    {
+        return PFor(0);
+    }
+
+    bool PFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_cs.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+
+        bool acquired = true;
+        long newSemaCount = _InterlockedExchangeAdd(&m_semaCount, -1) - 1;
+        if (newSemaCount < 0)
+        {
+            if (WaitForSingleObject(m_semaEvent, timeout.Remaining()) == WAIT_TIMEOUT)
+            {
+                // Back out our decrement.  m_cs makes us the only waiter, so
+                // the count is still negative unless a V() has granted us.
+                long prevSemaCount = _InterlockedExchangeAdd(&m_semaCount, 1);
+                if (prevSemaCount < 0)
+                {
+                    acquired = false;
+                }
+                else
+                {
+                    // Too late: that V() has set (or is about to set) the
+                    // event for us, so take the count back and consume it.
+                    _InterlockedExchangeAdd(&m_semaCount, -1);
+                    WaitForSingleObject(m_semaEvent, INFINITE);
+                }
+            }
+        }
+
+        m_cs.WriteUnlock();
+        return acquired;
+    }
+
     void V(long delta)
     {
         assert(delta > 0);
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "critical_section.h"
+#include "timeout.h"
 
 /// This semaphore class is built on a critical section + event.
 class CsevSemaphore
@@ -53,6 +54,40 @@ public:
         }
     }
 
+    bool TryP()
+    {
+        return PFor(0);
+    }
+
+    /// A timed-out waiter hasn't consumed the event, so there's nothing to undo.
+    bool PFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        long count;
+        for (;;)
+        {
+            {
+                CriticalSection::ScopedWriteLock lk(m_cs);
+                long oldCount = m_count;
+                if (oldCount > 0)
+                {
+                    count = oldCount - 1;
+                    m_count = count;
+                    break;
+                }
+            }
+            if (WaitForSingleObject(m_event, timeout.Remaining()) == WAIT_TIMEOUT)
+            {
+                return false;
+            }
+        }
+        if (count > 0)
+        {
+            SetEvent(m_event);
+        }
+        return true;
+    }
+
     void V(long delta)
     {
         assert(delta > 0);
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "scoped_locks.h"
+#include "timeout.h"
 
 /// Originally inspired by http://vorlon.case.edu/~jrh23/338/HW3.pdf
 template <class TSemaphore>
@@ -52,6 +53,46 @@ public:
         }
     }
 
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_queueSema.PFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        const bool locked = m_writerSema.PFor(timeout.Remaining());
+        m_queueSema.V();
+        return locked;
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_queueSema.PFor(timeout.Remaining()))
+        {
+            return false;
+        }
+
+        bool locked = true;
+        long count = _InterlockedIncrement(&m_readerCount);
+        if (count == 1 && !m_writerSema.PFor(timeout.Remaining()))
+        {
+            // m_queueSema keeps other readers from having counted themselves in
+            _InterlockedDecrement(&m_readerCount);
+            locked = false;
+        }
+
+        m_queueSema.V();
+        return locked;
+    }
+
     typedef ScopedWriteLock<FairReadWriteMutex<TSemaphore> > ScopedWriteLock;
     typedef ScopedReadLock<FairReadWriteMutex<TSemaphore> > ScopedReadLock;
 };
\ No newline at end of file
@@ -4,22 +4,36 @@
 #include "common.h"
 #include "scoped_locks.h"
 #include "critical_section.h"
+#include "timeout.h"
+#include "wait_policy.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
 
 /// This mutex is OK in terms of reader speed, but writer speed is still lacking.
+/// UpgradeLock() is a read lock that can be upgraded to the write lock without
+/// releasing it.  It admits readers, but excludes writers and other upgraders
+/// via m_csUpgrade, which writers therefore also have to take.
+/// Before waiting for the other locked readers to leave, the first locked
+/// reader spins on m_readerCount, as TWaitPolicy's Spin() decides; the default
+/// goes straight to m_lastLockedReaderEvent.
+template <class TMutex = CriticalSection, class TWaitPolicy = ParkWait>
 class FairCsReadWriteMutex
 {
 private: // types
-    struct TlsData
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
     {
         bool isFirstReader;
+        // nesting depth of this thread's read locks; only touched by the owning thread
+        long readDepth;
 
         TlsData()
             : isFirstReader(false)
+            , readDepth(0)
         {
         }
     };
     typedef std::vector<TlsData*> ThreadStates;
-    typedef CriticalSection Mutex_t;
+    typedef TMutex Mutex_t;
 
 private: // members
     volatile long m_readerCount;
@@ -27,29 +41,33 @@ private: // members
 
     DWORD m_tlsIndex;
 
+    // Upgrade mutex, to mutually exclude upgraders from each other and from writers.
+    Mutex_t m_csUpgrade;
     // Queue mutex, to enforce fair ordering between readers and writers.
     Mutex_t m_csQueue;
     // Writer mutex, to mutually exclude writers from each other and from all-consecutive-readers.
-    // Also protects m_threadStates when new readers arrive.
+    // Also protects m_registry when new readers arrive.
     Mutex_t m_csWriter;
-    ThreadStates m_threadStates;
+    ThreadRegistry<TlsData> m_registry;
 
     // This gets signaled when the last locked reader exits the mutex,
     // so that the first locked reader may release m_csWriter.
     HANDLE m_lastLockedReaderEvent;
+    // how long waiters spin before they wait on the events
+    TWaitPolicy m_waitPolicy;
 
 private: // methods
     TlsData* initTlsData()
     {
-        TlsData* pTlsData = new TlsData();
-        TlsSetValue(m_tlsIndex, (void*)pTlsData);
-        DWORD threadId = GetCurrentThreadId();
-
+        TlsData* pTlsData = NULL;
         {
-            Mutex_t::ScopedWriteLock queueLk(m_csQueue);
-            Mutex_t::ScopedWriteLock lk(m_csWriter);
-            m_threadStates.push_back(pTlsData);
+            typename Mutex_t::ScopedWriteLock queueLk(m_csQueue);
+            typename Mutex_t::ScopedWriteLock lk(m_csWriter);
+            m_registry.Compact();
+            pTlsData = m_registry.Add();
         }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
         return pTlsData;
     }
 
@@ -65,6 +83,11 @@ private: // methods
 
     void readLock(TlsData* pTlsData)
     {
+        if (pTlsData->readDepth++ != 0)
+        {
+            // nested; queueing again could wait on a writer that waits on us
+            return;
+        }
         m_csQueue.WriteLock();
         long readerCount = _InterlockedIncrement(&m_readerCount);
         if (readerCount == 1)
@@ -75,8 +98,56 @@ private: // methods
         m_csQueue.WriteUnlock();
     }
 
+    bool readLockFor(TlsData* pTlsData, DWORD milliseconds)
+    {
+        if (pTlsData->readDepth != 0)
+        {
+            // nested; queueing again could wait on a writer that waits on us
+            pTlsData->readDepth++;
+            return true;
+        }
+        Timeout timeout(milliseconds);
+        if (!m_csQueue.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        long readerCount = _InterlockedIncrement(&m_readerCount);
+        if (readerCount == 1)
+        {
+            if (!m_csWriter.WriteLockFor(timeout.Remaining()))
+            {
+                // m_csQueue keeps other readers from having counted themselves in
+                _InterlockedDecrement(&m_readerCount);
+                m_csQueue.WriteUnlock();
+                return false;
+            }
+            pTlsData->isFirstReader = true;
+        }
+        m_csQueue.WriteUnlock();
+        pTlsData->readDepth = 1;
+        return true;
+    }
+
+    // Called by the first locked reader when it leaves before the others:
+    // spins while they finish, as TWaitPolicy's Spin() decides, then collects
+    // the signal that the last of them leaves on m_lastLockedReaderEvent.
+    void waitForLastLockedReader()
+    {
+        for (long readerCount = m_readerCount;
+             readerCount != 0 && m_waitPolicy.Spin(&m_readerCount, readerCount, INFINITE);
+             readerCount = m_readerCount)
+        {
+        }
+        WaitForSingleObject(m_lastLockedReaderEvent, INFINITE);
+    }
+
     void readUnlock(TlsData* pTlsData)
     {
+        assert(pTlsData->readDepth > 0);
+        if (--pTlsData->readDepth != 0)
+        {
+            return;
+        }
         long readerCount = _InterlockedDecrement(&m_readerCount);
         if (readerCount == 0)
         {
@@ -94,13 +165,43 @@ private: // methods
         {
             if (pTlsData->isFirstReader)
             {
-                WaitForSingleObject(m_lastLockedReaderEvent, INFINITE);
+                waitForLastLockedReader();
                 m_csWriter.WriteUnlock();
                 pTlsData->isFirstReader = false;
             }
         }
     }
 
+    // Takes the writer mutex; m_csUpgrade must already be held.
+    void writeLock()
+    {
+        m_csQueue.WriteLock();
+        m_csWriter.WriteLock();
+        m_registry.Compact();
+        m_csQueue.WriteUnlock();
+    }
+
+    bool writeLockFor(const Timeout& timeout)
+    {
+        if (!m_csQueue.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        if (!m_csWriter.WriteLockFor(timeout.Remaining()))
+        {
+            m_csQueue.WriteUnlock();
+            return false;
+        }
+        m_registry.Compact();
+        m_csQueue.WriteUnlock();
+        return true;
+    }
+
+    void writeUnlock()
+    {
+        m_csWriter.WriteUnlock();
+    }
+
 public: // interface
     FairCsReadWriteMutex()
         : m_tlsIndex(TLS_OUT_OF_INDEXES)
@@ -115,26 +216,18 @@ public: // interface
     ~FairCsReadWriteMutex()
     {
         CloseHandle(m_lastLockedReaderEvent);
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            delete pTlsData;
-        }
         TlsFree(m_tlsIndex);
     }
 
     void WriteLock()
     {
-        m_csQueue.WriteLock();
-        m_csWriter.WriteLock();
-        m_csQueue.WriteUnlock();
+        m_csUpgrade.WriteLock();
+        writeLock();
     }
     void WriteUnlock()
     {
-        m_csWriter.WriteUnlock();
+        writeUnlock();
+        m_csUpgrade.WriteUnlock();
     }
     void ReadLock()
     {
@@ -147,7 +240,57 @@ public: // interface
         readUnlock(pTlsData);
     }
 
-    typedef ScopedWriteLock<FairCsReadWriteMutex> ScopedWriteLock;
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_csUpgrade.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        if (!writeLockFor(timeout))
+        {
+            m_csUpgrade.WriteUnlock();
+            return false;
+        }
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        TlsData* pTlsData = getTlsData();
+        return readLockFor(pTlsData, milliseconds);
+    }
+
+    /// Takes the upgrade lock, which admits readers but excludes writers and
+    /// other upgraders.
+    void UpgradeLock()
+    {
+        m_csUpgrade.WriteLock();
+    }
+    void UpgradeUnlock()
+    {
+        m_csUpgrade.WriteUnlock();
+    }
+    /// Turns the upgrade lock into the write lock, waiting for readers to leave.
+    void Upgrade()
+    {
+        writeLock();
+    }
+    /// Turns the write lock back into the upgrade lock.
+    void Downgrade()
+    {
+        writeUnlock();
+    }
+
+    typedef ScopedWriteLock<FairCsReadWriteMutex<TMutex, TWaitPolicy> > ScopedWriteLock;
+    typedef ScopedUpgradeLock<FairCsReadWriteMutex<TMutex, TWaitPolicy> > ScopedUpgradeLock;
 
     class ScopedReadLock
     {
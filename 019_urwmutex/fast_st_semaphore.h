@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "critical_section.h"
+#include "timeout.h"
 
 /// This semaphore class is built on a atomics + events.
 /// It has fast single-threaded performance, but perf falls sharply under contention.
@@ -62,6 +63,58 @@ public:
         }
     }
 
+    bool TryP()
+    {
+        return PFor(0);
+    }
+
+    /// The waiter queue (m_waitEvent) can't be left once joined, so a timed
+    /// waiter polls for the queue to be empty and takes the head position with
+    /// a CAS instead.  So timed waiters yield to blocking ones.
+    bool PFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        for (long attempt = 0; _InterlockedCompareExchange(&m_waitCount, 1, 0) != 0; attempt++)
+        {
+            if (timeout.Expired())
+            {
+                return false;
+            }
+            Sleep(attempt < 16 ? 0 : 1);
+        }
+
+        bool acquired = true;
+        long newSemaCount = _InterlockedExchangeAdd(&m_semaCount, -1) - 1;
+        if (newSemaCount < 0)
+        {
+            if (WaitForSingleObject(m_semaEvent, timeout.Remaining()) == WAIT_TIMEOUT)
+            {
+                // Back out our decrement.  Being at the head of the queue makes
+                // us the only waiter, so the count is still negative unless a
+                // V() has granted us.
+                long prevSemaCount = _InterlockedExchangeAdd(&m_semaCount, 1);
+                if (prevSemaCount < 0)
+                {
+                    acquired = false;
+                }
+                else
+                {
+                    // Too late: that V() has set (or is about to set) the
+                    // event for us, so take the count back and consume it.
+                    _InterlockedExchangeAdd(&m_semaCount, -1);
+                    WaitForSingleObject(m_semaEvent, INFINITE);
+                }
+            }
+        }
+
+        long newWaitCount = _InterlockedExchangeAdd(&m_waitCount, -1) - 1;
+        if (newWaitCount > 0)
+        {
+            SetEvent(m_waitEvent);
+        }
+        return acquired;
+    }
+
     void V(long delta)
     {
         assert(delta > 0);
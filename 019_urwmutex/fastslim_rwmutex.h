@@ -4,20 +4,31 @@
 #include "common.h"
 #include "scoped_locks.h"
 #include "slim_rwlock.h"
+#include "timeout.h"
+#include "wait_policy.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
 
 /// This mutex is OK in terms of reader speed, but writer speed is still lacking.
+/// The writer spins on each reader's isReading, as TWaitPolicy's Spin()
+/// decides, before it waits on that reader's event; the default goes straight
+/// to the event.  Blocked readers wait on m_cs.
+template <class TMutex = SlimReadWriteLock, class TWaitPolicy = ParkWait>
 class FastSlimReadWriteMutex
 {
 private: // types
-    struct TlsData
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
     {
         volatile bool isReading;
+        // nesting depth of this thread's read locks; only touched by the owning thread
+        long readDepth;
         bool isLocked;
         DWORD threadId;
         HANDLE readerDoneEvent;
 
         TlsData()
             : isReading(false)
+            , readDepth(0)
             , isLocked(false)
             , threadId(0)
             , readerDoneEvent(NULL)
@@ -31,7 +42,7 @@ private: // types
         }
     };
     typedef std::vector<TlsData*> ThreadStates;
-    typedef SlimReadWriteLock Mutex_t;
+    typedef TMutex Mutex_t;
 
 private: // members
     volatile long m_writeRequested;
@@ -40,19 +51,22 @@ private: // members
     DWORD m_tlsIndex;
 
     Mutex_t m_cs;
-    ThreadStates m_threadStates;
+    // how long the writer spins before it waits on a reader's event
+    TWaitPolicy m_waitPolicy;
+    ThreadRegistry<TlsData> m_registry;
 
 private: // methods
     TlsData* initTlsData()
     {
-        TlsData* pTlsData = new TlsData();
-        TlsSetValue(m_tlsIndex, (void*)pTlsData);
-        pTlsData->threadId = GetCurrentThreadId();
-
+        TlsData* pTlsData = NULL;
         {
-            Mutex_t::ScopedWriteLock lk(m_cs);
-            m_threadStates.push_back(pTlsData);
+            typename Mutex_t::ScopedWriteLock lk(m_cs);
+            m_registry.Compact();
+            pTlsData = m_registry.Add();
+            pTlsData->threadId = GetCurrentThreadId();
         }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
         return pTlsData;
     }
 
@@ -68,6 +82,11 @@ private: // methods
 
     void readLock(TlsData* pTlsData)
     {
+        if (pTlsData->readDepth++ != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return;
+        }
         pTlsData->isReading = true;
         if (m_writeRequested)
         {
@@ -80,8 +99,36 @@ private: // methods
         }
     }
 
+    bool readLockFor(TlsData* pTlsData, DWORD milliseconds)
+    {
+        if (pTlsData->readDepth != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            pTlsData->readDepth++;
+            return true;
+        }
+        pTlsData->isReading = true;
+        if (m_writeRequested)
+        {
+            pTlsData->isReading = false;
+            SetEvent(pTlsData->readerDoneEvent);
+            if (!m_cs.ReadLockFor(milliseconds))
+            {
+                return false;
+            }
+            pTlsData->isReading = true;
+            pTlsData->isLocked = true;
+        }
+        pTlsData->readDepth = 1;
+        return true;
+    }
     void readUnlock(TlsData* pTlsData)
     {
+        assert(pTlsData->readDepth > 0);
+        if (--pTlsData->readDepth != 0)
+        {
+            return;
+        }
         pTlsData->isReading = false;
         if (pTlsData->isLocked)
         {
@@ -94,6 +141,33 @@ private: // methods
         }
     }
 
+    // Waits for all readers to leave; m_cs must already be held.  If the
+    // timeout runs out first, releases the write lock and returns false.
+    bool bootReadersFor(const Timeout& timeout)
+    {
+        m_registry.Compact();
+        m_writeRequested = true;
+        for (typename ThreadStates::const_iterator iter = m_registry.Threads().begin(),
+                                                    end = m_registry.Threads().end();
+             iter != end;
+             ++iter)
+        {
+            TlsData* pTlsData = *iter;
+            while (pTlsData->isReading)
+            {
+                if (!m_waitPolicy.Spin(&pTlsData->isReading, true, timeout.Remaining()) &&
+                    WaitForSingleObject(pTlsData->readerDoneEvent, timeout.Remaining()) == WAIT_TIMEOUT &&
+                    pTlsData->isReading)
+                {
+                    // the readers we blocked are waiting on m_cs
+                    WriteUnlock();
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
 public: // interface
     FastSlimReadWriteMutex()
         : m_tlsIndex(TLS_OUT_OF_INDEXES)
@@ -106,32 +180,13 @@ public: // interface
     }
     ~FastSlimReadWriteMutex()
     {
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            delete pTlsData;
-        }
         TlsFree(m_tlsIndex);
     }
 
     void WriteLock()
     {
         m_cs.WriteLock();
-        m_writeRequested = true;
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            while (pTlsData->isReading)
-            {
-                WaitForSingleObject(pTlsData->readerDoneEvent, INFINITE);
-            }
-        }
+        bootReadersFor(Timeout(INFINITE));
     }
     void WriteUnlock()
     {
@@ -149,7 +204,31 @@ public: // interface
         readUnlock(pTlsData);
     }
 
-    typedef ScopedWriteLock<FastSlimReadWriteMutex> ScopedWriteLock;
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out lets back in the readers it had blocked.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_cs.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        return bootReadersFor(timeout);
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        TlsData* pTlsData = getTlsData();
+        return readLockFor(pTlsData, milliseconds);
+    }
+
+    typedef ScopedWriteLock<FastSlimReadWriteMutex<TMutex, TWaitPolicy> > ScopedWriteLock;
 
     class ScopedReadLock
     {
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+
+/// Fence policies for Dekker-style reader/writer handshakes, where a reader
+/// stores its own flag and then loads the writer's flag (and vice versa).
+/// On x86 that store->load ordering is the one thing the hardware does not
+/// guarantee, so somebody has to pay for a full fence.
+
+/// Both sides pay: every read acquisition executes a full fence.
+struct SymmetricFence
+{
+    static void ReaderFence()
+    {
+        MemoryBarrier();
+    }
+    static void WriterFence()
+    {
+        MemoryBarrier();
+    }
+};
+
+/// Readers only get a compiler barrier.  The writer makes up for it with
+/// FlushProcessWriteBuffers(), which IPIs every processor running a thread of
+/// this process and drains its store buffer.  It is the Win32 equivalent of
+/// membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED), and costs the writer
+/// microseconds instead of costing each reader tens of cycles.
+struct AsymmetricFence
+{
+    static void ReaderFence()
+    {
+        _ReadWriteBarrier();
+    }
+    static void WriterFence()
+    {
+        FlushProcessWriteBuffers();
+    }
+};
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "common.h"
+#include "scoped_locks.h"
+#include "futex.h"
+
+/// A write operation for FlatCombiningReadWriteMutex::SubmitWrite().
+/// Derive from it and put the write in Execute(); it runs with the write lock
+/// held, possibly on another thread, so it must not touch the submitter's
+/// thread-local state or take the mutex itself.
+class CombinedWrite
+{
+    template <class TMutex> friend class FlatCombiningReadWriteMutex;
+
+private:
+    CombinedWrite* m_pNext;
+    // set by the combiner once Execute() has returned
+    volatile long m_done;
+
+public:
+    CombinedWrite()
+        : m_pNext(NULL)
+        , m_done(0)
+    {
+    }
+    virtual ~CombinedWrite()
+    {
+    }
+
+    virtual void Execute() = 0;
+};
+
+/// Flat-combining writer path, after Hendler, Incze, Shavit & Tzafrir,
+/// "Flat Combining and the Synchronization-Parallelism Tradeoff" (SPAA 2010),
+/// in front of any zoo mutex TMutex.
+/// - SubmitWrite() publishes a CombinedWrite on a lock-free list.  Whichever
+///   submitter wins m_combining becomes the combiner: it takes TMutex's write
+///   lock once, and executes every published write, its own and the others',
+///   before releasing it.  The others just wait for their m_done.
+/// - So a burst of N writers pays for one reader drain (one TlsData scan, for
+///   UltraFast) instead of N, and the protected data stays in the combiner's
+///   cache instead of bouncing between writers.
+/// - Waiting submitters spin on their m_done briefly, then sleep on
+///   m_combining; the combiner wakes them all when it's finished.  Those whose
+///   writes have run return, and the rest compete to combine next.  So a
+///   write published after the combiner's last pass over the list is never
+///   stranded.
+/// - The combiner stops after MAX_COMBINE_PASSES passes over the list, so it
+///   can't be kept busy forever.
+/// - Writes run in FIFO order within a pass.
+/// - Readers, and WriteLock()/WriteUnlock(), go straight to TMutex.
+template <class TMutex>
+class FlatCombiningReadWriteMutex
+{
+private: // types
+    enum
+    {
+        MAX_COMBINE_PASSES = 8,
+        SPIN_COUNT = 100
+    };
+
+private: // members
+    // published, not yet executed writes, most recent first
+    CombinedWrite* volatile m_pPending;
+    volatile char pad0[CACHE_LINE_SIZE - sizeof(void*)];
+    // treated as an atomic bool; set while a combiner is running
+    volatile long m_combining;
+    volatile char pad1[CACHE_LINE_SIZE - 4];
+
+    TMutex m_mutex;
+
+private: // methods
+    void publish(CombinedWrite* pWrite)
+    {
+        for (;;)
+        {
+            CombinedWrite* pHead = m_pPending;
+            pWrite->m_pNext = pHead;
+            if (InterlockedCompareExchangePointer((PVOID volatile*)&m_pPending, pWrite, pHead) == pHead)
+            {
+                break;
+            }
+        }
+    }
+
+    // Must be called with m_combining set.
+    void combine()
+    {
+        m_mutex.WriteLock();
+        for (long pass = 0; pass < MAX_COMBINE_PASSES; pass++)
+        {
+            CombinedWrite* pHead = (CombinedWrite*)InterlockedExchangePointer((PVOID volatile*)&m_pPending, NULL);
+            if (pHead == NULL)
+            {
+                break;
+            }
+            // reverse into arrival order
+            CombinedWrite* pFifo = NULL;
+            while (pHead)
+            {
+                CombinedWrite* pNext = pHead->m_pNext;
+                pHead->m_pNext = pFifo;
+                pFifo = pHead;
+                pHead = pNext;
+            }
+            while (pFifo)
+            {
+                // the submitter may return as soon as m_done is set
+                CombinedWrite* pNext = pFifo->m_pNext;
+                pFifo->Execute();
+                pFifo->m_done = 1;
+                pFifo = pNext;
+            }
+        }
+        m_mutex.WriteUnlock();
+    }
+
+public: // interface
+    FlatCombiningReadWriteMutex()
+        : m_pPending(NULL)
+        , m_combining(0)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+        memset((void*)pad1, 0, sizeof(pad1));
+    }
+
+    /// Executes write under the write lock, either on this thread or on
+    /// whichever thread is combining, and returns once it has run.
+    void SubmitWrite(CombinedWrite& write)
+    {
+        write.m_done = 0;
+        publish(&write);
+        for (;;)
+        {
+            if (write.m_done)
+            {
+                return;
+            }
+            if (_InterlockedCompareExchange(&m_combining, 1, 0) == 0)
+            {
+                combine();
+                _InterlockedExchange(&m_combining, 0);
+                // wakes both the submitters whose writes we ran, and those
+                // whose writes came too late and must combine themselves
+                FutexWakeAll(&m_combining);
+                continue;
+            }
+            for (long spin = 0; spin < SPIN_COUNT && !write.m_done && m_combining; spin++)
+            {
+                YieldProcessor();
+            }
+            if (!write.m_done)
+            {
+                FutexWait(&m_combining, 1);
+            }
+        }
+    }
+
+    void WriteLock()
+    {
+        m_mutex.WriteLock();
+    }
+    void WriteUnlock()
+    {
+        m_mutex.WriteUnlock();
+    }
+    void ReadLock()
+    {
+        m_mutex.ReadLock();
+    }
+    void ReadUnlock()
+    {
+        m_mutex.ReadUnlock();
+    }
+
+    typedef ScopedWriteLock<FlatCombiningReadWriteMutex<TMutex> > ScopedWriteLock;
+    typedef ScopedReadLock<FlatCombiningReadWriteMutex<TMutex> > ScopedReadLock;
+};
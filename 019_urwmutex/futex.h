@@ -0,0 +1,88 @@
+#pragma once
+
+#include "common.h"
+
+#pragma comment(lib, "Synchronization.lib")
+
+/// Thin wrappers over WaitOnAddress (Windows 8+), which is the Win32 equivalent
+/// of a Linux futex: a thread sleeps directly on a word in memory, and
+/// wait-queue state only exists while somebody is actually blocked.
+/// Compared to an event per waiter, this needs no kernel object per thread, and
+/// the wake side stays in usermode when nobody is waiting on the address.
+///
+/// Porting note: on Linux these map 1:1 onto syscall(SYS_futex, ...) with
+/// FUTEX_WAIT_PRIVATE / FUTEX_WAKE_PRIVATE.
+
+/// Blocks while *pAddr == undesired.  May return spuriously; callers must re-check.
+inline void FutexWait(volatile long* pAddr, long undesired)
+{
+    WaitOnAddress(pAddr, &undesired, sizeof(undesired), INFINITE);
+}
+
+/// Like FutexWait(), but gives up after the timeout.  Returns false if it timed
+/// out; true if it was woken (or returned spuriously).
+inline bool FutexWaitFor(volatile long* pAddr, long undesired, DWORD milliseconds)
+{
+    return WaitOnAddress(pAddr, &undesired, sizeof(undesired), milliseconds) != FALSE
+        || GetLastError() != ERROR_TIMEOUT;
+}
+
+inline void FutexWakeOne(volatile long* pAddr)
+{
+    WakeByAddressSingle((PVOID)pAddr);
+}
+
+inline void FutexWakeAll(volatile long* pAddr)
+{
+    WakeByAddressAll((PVOID)pAddr);
+}
+
+/// Wakes up to count waiters.  Linux does this in one FUTEX_WAKE with count as
+/// its argument; WaitOnAddress has no such call, so it's count single wakes.
+inline void FutexWake(volatile long* pAddr, long count)
+{
+    for (long i = 0; i < count; i++)
+    {
+        WakeByAddressSingle((PVOID)pAddr);
+    }
+}
+
+/// Byte-sized variants, for flags packed densely into an array.
+inline void FutexWait(volatile char* pAddr, char undesired)
+{
+    WaitOnAddress(pAddr, &undesired, sizeof(undesired), INFINITE);
+}
+
+inline bool FutexWaitFor(volatile char* pAddr, char undesired, DWORD milliseconds)
+{
+    return WaitOnAddress(pAddr, &undesired, sizeof(undesired), milliseconds) != FALSE
+        || GetLastError() != ERROR_TIMEOUT;
+}
+
+inline void FutexWakeOne(volatile char* pAddr)
+{
+    WakeByAddressSingle((PVOID)pAddr);
+}
+
+/// Pointer-sized variants, for a word that is published once, such as a
+/// lazily created handle.
+inline void FutexWait(void* volatile* pAddr, void* undesired)
+{
+    WaitOnAddress(pAddr, &undesired, sizeof(undesired), INFINITE);
+}
+
+inline bool FutexWaitFor(void* volatile* pAddr, void* undesired, DWORD milliseconds)
+{
+    return WaitOnAddress(pAddr, &undesired, sizeof(undesired), milliseconds) != FALSE
+        || GetLastError() != ERROR_TIMEOUT;
+}
+
+inline void FutexWakeOne(void* volatile* pAddr)
+{
+    WakeByAddressSingle((PVOID)pAddr);
+}
+
+inline void FutexWakeAll(void* volatile* pAddr)
+{
+    WakeByAddressAll((PVOID)pAddr);
+}
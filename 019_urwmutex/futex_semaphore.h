@@ -0,0 +1,175 @@
+#pragma once
+
+#include "common.h"
+#include "futex.h"
+#include "timeout.h"
+
+/// Counting semaphore built on a futex, instead of events.
+/// - m_count is the number of available units, and never goes negative, so a
+///   unit is never granted to a particular waiter.  P(n) takes n units with one
+///   CAS, or none; waiters sleep on m_count itself, and a timed-out PFor() just
+///   leaves, with nothing to back out.
+/// - P() spins for SPIN_COUNT tries before it registers in m_waiters and
+///   sleeps, so a V() that follows shortly costs the waiter no kernel trip.
+/// - V(n) adds n units with one interlocked op, and only goes to the kernel
+///   when m_waiters says someone may be asleep.  It then wakes at most n
+///   waiters, in one FutexWake(); no waiter is woken one SetEvent at a time,
+///   and none waits behind a critical section.
+/// - A P(n) with n > 1 can be woken by a V() that isn't enough for it, and
+///   go back to sleep, having swallowed a wakeup that a P(1) could have used.
+///   So while any bulk P(n) is asleep, V() wakes all waiters instead.
+/// - maxCount is only checked, by an assert in V(); unlike ReleaseSemaphore(),
+///   an overflowing V() still adds its units.
+class FutexSemaphore
+{
+private:
+    enum
+    {
+        SPIN_COUNT = 100
+    };
+
+    volatile long m_count;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+    // threads that are, or are about to be, asleep on m_count
+    volatile long m_waiters;
+    // those of them that want more than one unit
+    volatile long m_bulkWaiters;
+    volatile char pad1[CACHE_LINE_SIZE - 8];
+    long m_maxCount;
+
+private:
+    bool tryAcquire(long count)
+    {
+        for (;;)
+        {
+            const long available = m_count;
+            if (available < count)
+            {
+                return false;
+            }
+            if (_InterlockedCompareExchange(&m_count, available - count, available) == available)
+            {
+                return true;
+            }
+        }
+    }
+
+    bool spinAcquire(long count)
+    {
+        for (long spin = 0; spin < SPIN_COUNT; spin++)
+        {
+            if (tryAcquire(count))
+            {
+                return true;
+            }
+            YieldProcessor();
+        }
+        return false;
+    }
+
+public:
+    FutexSemaphore(long initialCount = 0, long maxCount = 0x7fffffff)
+        : m_count(initialCount)
+        , m_waiters(0)
+        , m_bulkWaiters(0)
+        , m_maxCount(maxCount)
+    {
+        assert(initialCount >= 0 && initialCount <= maxCount);
+        memset((void*)pad0, 0, sizeof(pad0));
+        memset((void*)pad1, 0, sizeof(pad1));
+    }
+
+    /// Takes count units at once.
+    void P(long count)
+    {
+        PFor(count, INFINITE);
+    }
+
+    void P()
+    {
+        P(1);
+    }
+
+    bool TryP()
+    {
+        return tryAcquire(1);
+    }
+
+    bool PFor(DWORD milliseconds)
+    {
+        return PFor(1, milliseconds);
+    }
+
+    bool PFor(long count, DWORD milliseconds)
+    {
+        assert(count > 0);
+        if (spinAcquire(count))
+        {
+            return true;
+        }
+
+        Timeout timeout(milliseconds);
+        // the interlocked ops order our registration before the m_count loads
+        _InterlockedIncrement(&m_waiters);
+        if (count > 1)
+        {
+            _InterlockedIncrement(&m_bulkWaiters);
+        }
+        bool acquired = true;
+        for (;;)
+        {
+            const long available = m_count;
+            if (available >= count)
+            {
+                if (_InterlockedCompareExchange(&m_count, available - count, available) == available)
+                {
+                    break;
+                }
+                continue;
+            }
+            if (!FutexWaitFor(&m_count, available, timeout.Remaining()))
+            {
+                // timed out, unless the units came in just now
+                acquired = tryAcquire(count);
+                break;
+            }
+        }
+        if (count > 1)
+        {
+            _InterlockedDecrement(&m_bulkWaiters);
+        }
+        _InterlockedDecrement(&m_waiters);
+        return acquired;
+    }
+
+    void V(long delta)
+    {
+        assert(delta >= 0);
+        if (delta == 0)
+        {
+            return;
+        }
+
+        const long prevCount = _InterlockedExchangeAdd(&m_count, delta);
+        assert(prevCount <= m_maxCount - delta);
+        // the interlocked op orders the m_count update before these loads
+        const long waiters = m_waiters;
+        if (waiters == 0)
+        {
+            return;
+        }
+        if (m_bulkWaiters)
+        {
+            FutexWakeAll(&m_count);
+        }
+        else
+        {
+            FutexWake(&m_count, delta < waiters ? delta : waiters);
+        }
+    }
+
+    void V()
+    {
+        V(1);
+    }
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "common.h"
+#include "critical_section.h"
+#include "fences.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
+
+/// Left-Right, after Ramalhete & Correia, "Left-Right: A Concurrency Control
+/// Technique with Wait-Free Population Oblivious Reads" (2015).
+/// - Keeps two instances of T.  Readers read the one m_leftRight points at,
+///   while the writer mutates the other, so readers never wait, not even
+///   behind a writer.  Their only loop is TlsData registration.
+/// - The read indicators are the zoo's per-thread reader flags: each thread's
+///   TlsData has one arrived flag per version index, set on the version index
+///   that was current when its read started.
+/// - Write() applies the mutation to the instance readers aren't using,
+///   switches readers over to it, waits until no reader can still be on the
+///   old instance, and applies the same mutation there.  So every mutation runs
+///   twice, and must be deterministic; writers are serialized by m_cs.
+/// - New readers register under m_registryCs, not m_cs, so a thread's first
+///   read never waits for a writer's drain.  Write() only holds m_registryCs
+///   to compact the registry and copy it, and then waits on the copy.
+/// - Toggling m_versionIndex between the two waits is what keeps a steady
+///   stream of new readers from starving the writer: each wait only covers
+///   readers that arrived on one version index, which new readers have left.
+/// - The reader's arrived store must be visible before it loads m_leftRight,
+///   the same store->load handshake as UltraSpinFenced; TFence supplies it.
+/// - Read sections don't nest.
+///
+/// A mutation is a functor with `void operator()(T&) const`:
+///     struct Insert
+///     {
+///         long key, value;
+///         void operator()(std::map<long, long>& index) const { index[key] = value; }
+///     };
+///     leftRight.Write(insert);
+///
+///     LeftRight<std::map<long, long> >::ScopedReadLock lk(leftRight);
+///     lk->find(key);
+template <class T, class TFence = AsymmetricFence, class TMutex = CriticalSection>
+class LeftRight
+{
+private: // types
+    enum
+    {
+        SPIN_COUNT = 100
+    };
+
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
+    {
+        // read indicator for each version index
+        volatile long arrived[2];
+        // version index the current read arrived on; only touched by the owning thread
+        long readVersionIndex;
+
+        TlsData()
+            : readVersionIndex(-1)
+        {
+            arrived[0] = 0;
+            arrived[1] = 0;
+        }
+    };
+    typedef std::vector<TlsData*> ThreadStates;
+    typedef TMutex Mutex_t;
+
+private: // members
+    // index of the instance readers read
+    volatile long m_leftRight;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+    // index of the read indicator new readers arrive on
+    volatile long m_versionIndex;
+    volatile char pad1[CACHE_LINE_SIZE - 4];
+
+    T m_instances[2];
+
+    DWORD m_tlsIndex;
+
+    // mutual exclusion of writers from each other; also protects m_snapshot
+    Mutex_t m_cs;
+    // protects m_registry; never held across a wait
+    CriticalSection m_registryCs;
+    ThreadRegistry<TlsData> m_registry;
+    // the readers the current Write() waits for.  Records in it can't be
+    // recycled mid-wait, since only Write() compacts the registry.
+    ThreadStates m_snapshot;
+
+private: // methods
+    TlsData* initTlsData()
+    {
+        TlsData* pTlsData = NULL;
+        {
+            CriticalSection::ScopedWriteLock lk(m_registryCs);
+            pTlsData = m_registry.Add();
+        }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
+        return pTlsData;
+    }
+
+    TlsData* getTlsData()
+    {
+        TlsData* pTlsData = (TlsData*)InlineTlsGetValue(m_tlsIndex);
+        if (pTlsData == NULL)
+        {
+            pTlsData = initTlsData();
+        }
+        return pTlsData;
+    }
+
+    const T& readLock(TlsData* pTlsData)
+    {
+        assert(pTlsData->readVersionIndex == -1);
+        const long versionIndex = m_versionIndex;
+        pTlsData->readVersionIndex = versionIndex;
+        pTlsData->arrived[versionIndex] = 1;
+        TFence::ReaderFence();
+        return m_instances[m_leftRight];
+    }
+
+    void readUnlock(TlsData* pTlsData)
+    {
+        assert(pTlsData->readVersionIndex != -1);
+        // x86 doesn't move stores above earlier loads; keep the compiler
+        // from doing so either
+        _ReadWriteBarrier();
+        pTlsData->arrived[pTlsData->readVersionIndex] = 0;
+        pTlsData->readVersionIndex = -1;
+    }
+
+    // Copies the registry into m_snapshot, for waitForReaders().
+    // Must be called with m_cs held.
+    void snapshotReaders()
+    {
+        CriticalSection::ScopedWriteLock lk(m_registryCs);
+        m_registry.Compact();
+        m_snapshot = m_registry.Threads();
+    }
+
+    // Waits until no reader in m_snapshot is arrived on versionIndex.
+    // Must be called with m_cs held.
+    void waitForReaders(long versionIndex)
+    {
+        for (typename ThreadStates::const_iterator iter = m_snapshot.begin(),
+                                                    end = m_snapshot.end();
+             iter != end;
+             ++iter)
+        {
+            TlsData* pTlsData = *iter;
+            for (long spin = 0; pTlsData->arrived[versionIndex]; spin++)
+            {
+                if (spin < SPIN_COUNT)
+                {
+                    YieldProcessor();
+                }
+                else
+                {
+                    Sleep(spin < 2 * SPIN_COUNT ? 0 : 1);
+                }
+            }
+        }
+    }
+
+public: // interface
+    LeftRight()
+        : m_leftRight(0)
+        , m_versionIndex(0)
+        , m_tlsIndex(TLS_OUT_OF_INDEXES)
+    {
+        init();
+    }
+    explicit LeftRight(const T& initial)
+        : m_leftRight(0)
+        , m_versionIndex(0)
+        , m_tlsIndex(TLS_OUT_OF_INDEXES)
+    {
+        m_instances[0] = initial;
+        m_instances[1] = initial;
+        init();
+    }
+    ~LeftRight()
+    {
+        TlsFree(m_tlsIndex);
+    }
+
+    /// Applies mutation to both instances, without ever blocking readers.
+    template <class TMutation>
+    void Write(const TMutation& mutation)
+    {
+        typename Mutex_t::ScopedWriteLock lk(m_cs);
+
+        const long leftRight = m_leftRight;
+        mutation(m_instances[1 - leftRight]);
+        // x86 doesn't reorder stores with other stores
+        _WriteBarrier();
+        m_leftRight = 1 - leftRight;
+
+        const long prevVersionIndex = m_versionIndex;
+        const long nextVersionIndex = 1 - prevVersionIndex;
+        TFence::WriterFence();
+        // A reader that registers after this copy loads m_leftRight after it,
+        // so it can only be on the new instance.
+        snapshotReaders();
+        waitForReaders(nextVersionIndex);
+        m_versionIndex = nextVersionIndex;
+        TFence::WriterFence();
+        waitForReaders(prevVersionIndex);
+
+        mutation(m_instances[leftRight]);
+    }
+
+    const T& ReadLock()
+    {
+        TlsData* pTlsData = getTlsData();
+        return readLock(pTlsData);
+    }
+    void ReadUnlock()
+    {
+        TlsData* pTlsData = getTlsData();
+        readUnlock(pTlsData);
+    }
+
+    class ScopedReadLock
+    {
+        LeftRight& m_leftRight;
+        TlsData* m_pTlsData;
+        const T* m_pInstance;
+
+    public:
+        ScopedReadLock(LeftRight& leftRight)
+            : m_leftRight(leftRight)
+        {
+            m_pTlsData = m_leftRight.getTlsData();
+            m_pInstance = &m_leftRight.readLock(m_pTlsData);
+        }
+        ~ScopedReadLock()
+        {
+            m_leftRight.readUnlock(m_pTlsData);
+        }
+
+        const T& Get() const
+        {
+            return *m_pInstance;
+        }
+        const T* operator->() const
+        {
+            return m_pInstance;
+        }
+    };
+
+private:
+    void init()
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+        memset((void*)pad1, 0, sizeof(pad1));
+
+        m_tlsIndex = TlsAlloc();
+        assert(m_tlsIndex != TLS_OUT_OF_INDEXES);
+    }
+};
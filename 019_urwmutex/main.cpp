@@ -1,28 +1,47 @@
 #include <stdio.h>
 #include <vector>
+#include <map>
 #include "semaphore.h"
 #include "unslow_semaphore.h"
 #include "csev_semaphore.h"
 #include "fast_st_semaphore.h"
 #include "csev2_semaphore.h"
+#include "futex_semaphore.h"
 #include "mutex.h"
 #include "sema_mutex.h"
 #include "critical_section.h"
+#include "cohort_lock.h"
+#include "queue_lock.h"
 #include "slim_rwlock.h"
 #include "ultraspin_rwmutex.h"
+#include "ultraspin_fenced_rwmutex.h"
 #include "ultrafast_rwmutex.h"
+#include "ultrafutex_rwmutex.h"
 #include "ultralight_rwmutex.h"
+#include "percpu_rwmutex.h"
+#include "bitmap_rwmutex.h"
+#include "numa_rwmutex.h"
 #include "fair_rwmutex.h"
 #include "ticketed_rwmutex.h"
 #include "faircs_rwmutex.h"
+#include "phasefair_rwmutex.h"
 #include "qt_rwmutex.h"
+#include "qt_counting_rwmutex.h"
 #include "cohort_rwmutex.h"
+#include "bravo_rwmutex.h"
+#include "seq_rwmutex.h"
+#include "snzi_rwmutex.h"
+#include "flatcombining_rwmutex.h"
+#include "rcu.h"
+#include "left_right.h"
 #include "fastslim_rwmutex.h"
 // single reader, multiple writer -- these are just to get upper bounds on perf
 #include "ultraspin_single_rwmutex.h"
 #include "ultrasync_single_rwmutex.h"
 #include "win_futex_rec_ev.h"
 #include "win_futex_rec.h"
+#include "win_futex_rw.h"
+#include "parking_lot_rwmutex.h"
 
 
 //#define READER_LOOP_NL_SLEEP Sleep(0)
@@ -50,6 +69,8 @@ struct Stats
     double r1TotalPerSecond;
     double r1ReadRatio;
     double r1WriteRatio;
+    // reads that saw inconsistent data; only set by the tests that check for it
+    long errorCount;
 };
 
 
@@ -211,6 +232,184 @@ private:
 };
 
 
+// The thread scaffolding of the harnesses below, which need more than
+// Test's fixed reader and writer loops.  Each thread runs its own copy of a
+// body functor, `void operator()()`, or a member function of the harness.
+// - Start() threads wait until Release(), so that they all begin together.
+//   StartUngated() threads run at once, e.g. to register with a mutex first,
+//   and can then call WaitForRelease() themselves.
+// - Bodies loop until Done(), then fold their counts into the harness with
+//   Add() or Merge(), which serialize them.
+// - Run() is the usual timed phase: Release(), sleep, Stop(), Join().
+class ThreadRunner
+{
+public:
+    enum
+    {
+        DURATION_MILLISECONDS = 700,
+        STACK_SIZE = 0x10000
+    };
+
+private:
+    template <class TBody>
+    struct ThreadStart
+    {
+        ThreadRunner* pRunner;
+        TBody body;
+        bool gated;
+
+        ThreadStart(ThreadRunner* runner, const TBody& threadBody, bool isGated)
+            : pRunner(runner)
+            , body(threadBody)
+            , gated(isGated)
+        {
+        }
+    };
+
+    template <class TObject>
+    class MemberBody
+    {
+        TObject* m_pObject;
+        void (TObject::*m_pfnBody)();
+
+    public:
+        MemberBody(TObject* pObject, void (TObject::*pfnBody)())
+            : m_pObject(pObject)
+            , m_pfnBody(pfnBody)
+        {
+        }
+        void operator()()
+        {
+            (m_pObject->*m_pfnBody)();
+        }
+    };
+
+    template <class TBody>
+    static DWORD WINAPI threadProc(void* p)
+    {
+        ThreadStart<TBody>* pStart = (ThreadStart<TBody>*)p;
+        if (pStart->gated)
+        {
+            pStart->pRunner->WaitForRelease();
+        }
+        pStart->body();
+        delete pStart;
+        return 0;
+    }
+
+    template <class TBody>
+    void start(long count, const TBody& body, bool gated, SIZE_T stackSize)
+    {
+        for (long i = 0; i < count; i++)
+        {
+            ThreadStart<TBody>* pStart = new ThreadStart<TBody>(this, body, gated);
+            HANDLE hThread = CreateThread(NULL, stackSize, &threadProc<TBody>, pStart, 0, NULL);
+            assert(hThread != NULL);
+            m_threadHandles.push_back(hThread);
+        }
+    }
+
+public:
+    ThreadRunner()
+        : m_done(0)
+    {
+        // Manual-reset-event that gates the execution of the test threads.
+        m_hStartEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        assert(m_hStartEvent != NULL);
+    }
+    ~ThreadRunner()
+    {
+        // the harness must have joined its threads before its members go away
+        assert(m_threadHandles.empty());
+        CloseHandle(m_hStartEvent);
+    }
+
+    /// Starts count threads that each run a copy of body after Release().
+    template <class TBody>
+    void Start(long count, const TBody& body, SIZE_T stackSize = STACK_SIZE)
+    {
+        start(count, body, true, stackSize);
+    }
+    /// Starts count threads that each call (pObject->*pfnBody)() after Release().
+    template <class TObject>
+    void Start(long count, TObject* pObject, void (TObject::*pfnBody)(), SIZE_T stackSize = STACK_SIZE)
+    {
+        start(count, MemberBody<TObject>(pObject, pfnBody), true, stackSize);
+    }
+    /// Like Start(), but the threads run body at once.
+    template <class TBody>
+    void StartUngated(long count, const TBody& body, SIZE_T stackSize = STACK_SIZE)
+    {
+        start(count, body, false, stackSize);
+    }
+    template <class TObject>
+    void StartUngated(long count, TObject* pObject, void (TObject::*pfnBody)(), SIZE_T stackSize = STACK_SIZE)
+    {
+        start(count, MemberBody<TObject>(pObject, pfnBody), false, stackSize);
+    }
+
+    void WaitForRelease()
+    {
+        WaitForSingleObject(m_hStartEvent, INFINITE);
+    }
+    void Release()
+    {
+        SetEvent(m_hStartEvent);
+    }
+    void Stop()
+    {
+        m_done = 1;
+    }
+    bool Done() const
+    {
+        return m_done != 0;
+    }
+    /// Waits for all threads to complete.  If they don't, we probably have a deadlock.
+    void Join()
+    {
+        for (size_t u = 0; u < m_threadHandles.size(); u++)
+        {
+            HANDLE hThread = m_threadHandles[u];
+            WaitForSingleObject(hThread, INFINITE);
+            CloseHandle(hThread);
+        }
+        m_threadHandles.clear();
+    }
+
+    /// Runs the threads for durationMilliseconds and joins them; returns the
+    /// duration in seconds.
+    double Run(DWORD durationMilliseconds = DURATION_MILLISECONDS)
+    {
+        Release();
+        Sleep(durationMilliseconds);
+        Stop();
+        Join();
+        return durationMilliseconds / 1000.0;
+    }
+
+    /// total += part, serialized with the other threads' Add() and Merge().
+    template <class T>
+    void Add(T& total, const T& part)
+    {
+        CriticalSection::ScopedWriteLock lk(m_resultsCs);
+        total += part;
+    }
+    /// total.Merge(part), e.g. for a LatencyHistogram.
+    template <class T>
+    void Merge(T& total, const T& part)
+    {
+        CriticalSection::ScopedWriteLock lk(m_resultsCs);
+        total.Merge(part);
+    }
+
+private:
+    HANDLE m_hStartEvent;
+    volatile long m_done;
+    std::vector<HANDLE> m_threadHandles;
+    CriticalSection m_resultsCs;
+};
+
+
 void DoTests(
     const long numReaders,
     const long numWriters,
@@ -280,6 +479,15 @@ void DoTests(
     }
 #endif
 
+#if 0
+    {
+        pName = "SemaMutex<FutexSemaphore>";
+        Test<SemaMutex<FutexSemaphore> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
 #if 0
     // NOTE: is kind of fair
     pName = "CriticalSection";
@@ -288,6 +496,36 @@ void DoTests(
     statss.push_back(stats);
 #endif
 
+#if 0
+    {
+        // NOTE: NUMA-aware exclusive lock; fair across nodes up to its handoff bound
+        pName = "CohortLock";
+        Test<CohortLock> test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: strictly FIFO; each waiter sleeps on its own node
+        pName = "McsLock";
+        Test<McsLock> test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: strictly FIFO; each waiter sleeps on its predecessor's node
+        pName = "ClhLock";
+        Test<ClhLock> test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
 #if 0
     {
         // NOTE: is not fair
@@ -302,7 +540,16 @@ void DoTests(
     {
         // NOTE: is kind of fair
         pName = "UltraSpinReadWriteMutex";
-        Test<UltraSpinReadWriteMutex> test(numReaders, numWriters, pName);
+        Test<UltraSpinReadWriteMutex<> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        pName = "UltraSpinFencedReadWriteMutex<AsymmetricFence>";
+        Test<UltraSpinFencedReadWriteMutex<AsymmetricFence> > test(numReaders, numWriters, pName);
         stats = test.Execute();
         statss.push_back(stats);
     }
@@ -312,7 +559,37 @@ void DoTests(
     {
         // NOTE: is kind of fair
         pName = "UltraFastReadWriteMutex";
-        Test<UltraFastReadWriteMutex> test(numReaders, numWriters, pName);
+        Test<UltraFastReadWriteMutex<> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: writers queue on an MCS lock instead of a CRITICAL_SECTION
+        pName = "UltraFastReadWriteMutex<McsLock>";
+        Test<UltraFastReadWriteMutex<McsLock> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: same algorithm as UltraFast, but futex handshakes instead of per-thread events
+        pName = "UltraFutexReadWriteMutex";
+        Test<UltraFutexReadWriteMutex<> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: UltraFutex whose waiters spin for a learned budget before sleeping
+        pName = "UltraFutexReadWriteMutex<CriticalSection, AdaptiveWait>";
+        Test<UltraFutexReadWriteMutex<CriticalSection, AdaptiveWait> > test(numReaders, numWriters, pName);
         stats = test.Execute();
         statss.push_back(stats);
     }
@@ -322,7 +599,37 @@ void DoTests(
     {
         // NOTE: is kind of fair
         pName = "UltraLightReadWriteMutex";
-        Test<UltraLightReadWriteMutex> test(numReaders, numWriters, pName);
+        Test<UltraLightReadWriteMutex<> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: writer cost is bounded by the processor count, not the thread count
+        pName = "PerCpuReadWriteMutex";
+        Test<PerCpuReadWriteMutex<> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: UltraFutex with a packed array of reader flags that the writer scans with SSE2/AVX2
+        pName = "BitmapReadWriteMutex";
+        Test<BitmapReadWriteMutex<> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: UltraFutex with a per-NUMA-node registry; writers skip nodes with no readers
+        pName = "NumaReadWriteMutex";
+        Test<NumaReadWriteMutex<> > test(numReaders, numWriters, pName);
         stats = test.Execute();
         statss.push_back(stats);
     }
@@ -341,7 +648,27 @@ void DoTests(
 #if 0
     {
         pName = "FairCsReadWriteMutex";
-        Test<FairCsReadWriteMutex> test(numReaders, numWriters, pName);
+        Test<FairCsReadWriteMutex<> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: is phase-fair; readers and writers each wait at most one phase of the other
+        pName = "PhaseFairReadWriteMutex";
+        Test<PhaseFairReadWriteMutex<> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: pessimistic readers are exclusive; see TestPayloadCopy() for the optimistic ones
+        pName = "SeqReadWriteMutex";
+        Test<SeqReadWriteMutex<> > test(numReaders, numWriters, pName);
         stats = test.Execute();
         statss.push_back(stats);
     }
@@ -359,7 +686,76 @@ void DoTests(
 #if 0
     {
         pName = "FastSlimReadWriteMutex";
-        Test<FastSlimReadWriteMutex> test(numReaders, numWriters, pName);
+        Test<FastSlimReadWriteMutex<> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: is not fair; at most 16 concurrent readers
+        pName = "QtReadWriteMutex";
+        Test<QtReadWriteMutex<CriticalSection, Semaphore, 16> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: is not fair; at most 16 concurrent readers
+        pName = "QtCountingReadWriteMutex";
+        Test<QtCountingReadWriteMutex<CriticalSection, 16> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: reader-biased SlimReadWriteLock
+        pName = "BravoReadWriteMutex<SlimReadWriteLock>";
+        Test<BravoReadWriteMutex<SlimReadWriteLock> > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: reader-biased FairCsReadWriteMutex
+        pName = "BravoReadWriteMutex<FairCsReadWriteMutex>";
+        Test<BravoReadWriteMutex<FairCsReadWriteMutex<> > > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: reader-biased QtReadWriteMutex
+        pName = "BravoReadWriteMutex<QtReadWriteMutex>";
+        Test<BravoReadWriteMutex<QtReadWriteMutex<CriticalSection, Semaphore, 16> > > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        // NOTE: reader-biased PhaseFairReadWriteMutex
+        pName = "BravoReadWriteMutex<PhaseFairReadWriteMutex<> >";
+        Test<BravoReadWriteMutex<PhaseFairReadWriteMutex<> > > test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+
+#if 0
+    {
+        pName = "SnziReadWriteMutex<>";
+        Test<SnziReadWriteMutex<> > test(numReaders, numWriters, pName);
         stats = test.Execute();
         statss.push_back(stats);
     }
@@ -381,6 +777,22 @@ void DoTests(
         statss.push_back(stats);
     }
 #endif
+#if 0
+    {
+        pName = "WinFutexRwC";
+        Test<WinFutexRwC> test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
+#if 0
+    {
+        pName = "ParkingLotReadWriteMutex";
+        Test<ParkingLotReadWriteMutex> test(numReaders, numWriters, pName);
+        stats = test.Execute();
+        statss.push_back(stats);
+    }
+#endif
 }
 
 void TestUltraSingleReadWriteMutex()
@@ -413,15 +825,2011 @@ void TestUltraSingleReadWriteMutex()
     stats = test_UltraSyncSingleReadWriteMutex11.Execute();
 }
 
-int main()
+// Compares reads/sec of a full fence per read acquisition against the
+// FlushProcessWriteBuffers-on-the-writer variant, for 1-64 reader threads.
+void TestAsymmetricFence(const long numWriters)
 {
+    std::vector<Stats> fenced;
+    std::vector<Stats> asym;
+    for (long numReaders = 1; numReaders <= 64; numReaders *= 2)
     {
-        const char* pName = "warmup";
-        Test<UltraSpinReadWriteMutex> test_warmup(1, 0, pName);
-        test_warmup.Execute();
+        {
+            Test<UltraSpinFencedReadWriteMutex<SymmetricFence> > test(numReaders, numWriters, "UltraSpinFenced<SymmetricFence>");
+            fenced.push_back(test.Execute());
+        }
+        {
+            Test<UltraSpinFencedReadWriteMutex<AsymmetricFence> > test(numReaders, numWriters, "UltraSpinFenced<AsymmetricFence>");
+            asym.push_back(test.Execute());
+        }
     }
 
-    //TestUltraSingleReadWriteMutex();
+    printf("\nasymmetric fence, numWriters = %d\n", numWriters);
+    printf("numReaders,    fenced rps,      asym rps, asym/fenced\n");
+    for (size_t u = 0; u < fenced.size(); u++)
+    {
+        printf("%10d,%14.1f,%14.1f,%12.3f\n",
+            fenced[u].numThreads - numWriters,
+            fenced[u].readsPerSecond,
+            asym[u].readsPerSecond,
+            asym[u].readsPerSecond / fenced[u].readsPerSecond);
+    }
+    printf("\n");
+}
+
+// Reads/sec of the TLS-based mutexes for 1-64 reader threads.  Build once
+// with the default TLS_DATA_SPACING and once with /DTLS_DATA_SPACING=0 (plain
+// operator new) to see what false sharing between TlsData records costs.
+void TestReaderScaling(const long numWriters)
+{
+    std::vector<Stats> ultraSpin;
+    std::vector<Stats> ultraFast;
+    std::vector<Stats> ultraFutex;
+    for (long numReaders = 1; numReaders <= 64; numReaders *= 2)
+    {
+        {
+            Test<UltraSpinReadWriteMutex<> > test(numReaders, numWriters, "UltraSpinReadWriteMutex");
+            ultraSpin.push_back(test.Execute());
+        }
+        {
+            Test<UltraFastReadWriteMutex<> > test(numReaders, numWriters, "UltraFastReadWriteMutex");
+            ultraFast.push_back(test.Execute());
+        }
+        {
+            Test<UltraFutexReadWriteMutex<> > test(numReaders, numWriters, "UltraFutexReadWriteMutex");
+            ultraFutex.push_back(test.Execute());
+        }
+    }
+
+    printf("\nreader scaling, TLS_DATA_SPACING = %d, numWriters = %d\n", TLS_DATA_SPACING, numWriters);
+    printf("numReaders, UltraSpin rps, UltraFast rps, UltraFutex rps\n");
+    for (size_t u = 0; u < ultraSpin.size(); u++)
+    {
+        printf("%10d,%14.1f,%14.1f,%15.1f\n",
+            ultraSpin[u].numThreads - numWriters,
+            ultraSpin[u].readsPerSecond,
+            ultraFast[u].readsPerSecond,
+            ultraFutex[u].readsPerSecond);
+    }
+    printf("\n");
+}
+
+// Reads/sec of the zero-initializable locks, which can be function-statics,
+// for 1-16 reader threads: WinFutexRec serializes readers, WinFutexRw doesn't.
+void TestWinFutexRw(const long numWriters)
+{
+    std::vector<Stats> rec;
+    std::vector<Stats> rw;
+    std::vector<Stats> srw;
+    for (long numReaders = 1; numReaders <= 16; numReaders *= 2)
+    {
+        {
+            Test<WinFutexRecC> test(numReaders, numWriters, "WinFutexRecC");
+            rec.push_back(test.Execute());
+        }
+        {
+            Test<WinFutexRwC> test(numReaders, numWriters, "WinFutexRwC");
+            rw.push_back(test.Execute());
+        }
+        {
+            Test<SlimReadWriteLock> test(numReaders, numWriters, "SlimReadWriteLock");
+            srw.push_back(test.Execute());
+        }
+    }
+
+    printf("\nstatic-initializable locks, numWriters = %d\n", numWriters);
+    printf("numReaders,  WinFutexRec rps,   WinFutexRw rps,          SRW rps\n");
+    for (size_t u = 0; u < rec.size(); u++)
+    {
+        printf("%10d,%17.1f,%17.1f,%17.1f\n",
+            rec[u].numThreads - numWriters,
+            rec[u].readsPerSecond,
+            rw[u].readsPerSecond,
+            srw[u].readsPerSecond);
+    }
+    printf("\n");
+}
+
+// Reads/sec of the mutexes that count readers in one shared word, against
+// SnziReadWriteMutex's counter tree, for 1-64 reader threads.
+void TestReaderCounter(const long numWriters)
+{
+    std::vector<Stats> fairCs;
+    std::vector<Stats> ticketed;
+    std::vector<Stats> snzi;
+    for (long numReaders = 1; numReaders <= 64; numReaders *= 2)
+    {
+        {
+            Test<FairCsReadWriteMutex<> > test(numReaders, numWriters, "FairCsReadWriteMutex");
+            fairCs.push_back(test.Execute());
+        }
+        {
+            Test<TicketedReadWriteMutex<> > test(numReaders, numWriters, "TicketedReadWriteMutex");
+            ticketed.push_back(test.Execute());
+        }
+        {
+            Test<SnziReadWriteMutex<> > test(numReaders, numWriters, "SnziReadWriteMutex");
+            snzi.push_back(test.Execute());
+        }
+    }
+
+    printf("\nreader counter, numWriters = %d\n", numWriters);
+    printf("numReaders,    FairCs rps,  Ticketed rps,      Snzi rps\n");
+    for (size_t u = 0; u < fairCs.size(); u++)
+    {
+        printf("%10d,%14.1f,%14.1f,%14.1f\n",
+            fairCs[u].numThreads - numWriters,
+            fairCs[u].readsPerSecond,
+            ticketed[u].readsPerSecond,
+            snzi[u].readsPerSecond);
+    }
+    printf("\n");
+}
+
+// Total acquisitions/sec of PhaseFairReadWriteMutex under each wait policy,
+// for 1-64 reader threads.  Once the thread count passes the core count, the
+// spinning policies start burning the time slices that lock holders need.
+void TestWaitPolicy(const long numWriters)
+{
+    std::vector<Stats> park;
+    std::vector<Stats> spin;
+    std::vector<Stats> backoff;
+    std::vector<Stats> spinThenPark;
+    std::vector<Stats> adaptive;
+    for (long numReaders = 1; numReaders <= 64; numReaders *= 2)
+    {
+        {
+            Test<PhaseFairReadWriteMutex<ParkWait> > test(numReaders, numWriters, "PhaseFair<ParkWait>");
+            park.push_back(test.Execute());
+        }
+        {
+            Test<PhaseFairReadWriteMutex<SpinWait> > test(numReaders, numWriters, "PhaseFair<SpinWait>");
+            spin.push_back(test.Execute());
+        }
+        {
+            Test<PhaseFairReadWriteMutex<BackoffWait> > test(numReaders, numWriters, "PhaseFair<BackoffWait>");
+            backoff.push_back(test.Execute());
+        }
+        {
+            Test<PhaseFairReadWriteMutex<SpinThenParkWait<> > > test(numReaders, numWriters, "PhaseFair<SpinThenParkWait<> >");
+            spinThenPark.push_back(test.Execute());
+        }
+        {
+            Test<PhaseFairReadWriteMutex<AdaptiveWait> > test(numReaders, numWriters, "PhaseFair<AdaptiveWait>");
+            adaptive.push_back(test.Execute());
+        }
+    }
+
+    ProcessorIndexMap processors;
+    printf("\nwait policy, numWriters = %d, processors = %d\n", numWriters, processors.ProcessorCount());
+    printf("numThreads,      park tps,      spin tps,   backoff tps, spin+park tps,  adaptive tps\n");
+    for (size_t u = 0; u < park.size(); u++)
+    {
+        printf("%10d,%14.1f,%14.1f,%14.1f,%14.1f,%14.1f\n",
+            park[u].numThreads,
+            park[u].totalPerSecond,
+            spin[u].totalPerSecond,
+            backoff[u].totalPerSecond,
+            spinThenPark[u].totalPerSecond,
+            adaptive[u].totalPerSecond);
+    }
+    printf("\n");
+}
+
+// Parks numThreads threads that have each taken the read lock once, so that
+// they are all registered with the mutex, and times uncontended
+// WriteLock()/WriteUnlock() pairs.  This isolates the writer's cost of
+// scanning the reader registry.
+template <class TMutex>
+class WriterLatencyTest
+{
+public:
+    WriterLatencyTest(long numThreads)
+    {
+        m_registeredCount = 0;
+        m_numThreads = numThreads;
+    }
+
+    // Returns microseconds per write acquisition.
+    double Execute()
+    {
+        m_runner.StartUngated(m_numThreads, this, &WriterLatencyTest::IdleThread);
+        while (m_registeredCount < m_numThreads)
+        {
+            Sleep(1);
+        }
+
+        const long iterations = 1000;
+        {
+            TMutex::ScopedWriteLock lk(m_mutex);
+        }
+        LARGE_INTEGER frequency, start, end;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+        for (long i = 0; i < iterations; i++)
+        {
+            TMutex::ScopedWriteLock lk(m_mutex);
+        }
+        QueryPerformanceCounter(&end);
+
+        m_runner.Release();
+        m_runner.Join();
+
+        return (end.QuadPart - start.QuadPart) * 1000000.0 / frequency.QuadPart / iterations;
+    }
+
+private:
+    void IdleThread()
+    {
+        {
+            TMutex::ScopedReadLock lk(m_mutex);
+        }
+        _InterlockedIncrement(&m_registeredCount);
+        m_runner.WaitForRelease();
+    }
+
+private:
+    TMutex m_mutex;
+    ThreadRunner m_runner;
+    volatile long m_registeredCount;
+    long m_numThreads;
+};
+
+// Writer acquisition latency against the number of registered (idle) reader
+// threads: pointer-chasing registry vs packed flag array.
+void TestWriterLatency()
+{
+    printf("\nwriter latency\n");
+    printf("numThreads,  UltraFast us,     Bitmap us\n");
+    for (long numThreads = 1; numThreads <= 4096; numThreads *= 2)
+    {
+        WriterLatencyTest<UltraFastReadWriteMutex<> > ultraFast(numThreads);
+        const double ultraFastMicroseconds = ultraFast.Execute();
+        WriterLatencyTest<BitmapReadWriteMutex<> > bitmap(numThreads);
+        const double bitmapMicroseconds = bitmap.Execute();
+        printf("%10d,%14.3f,%14.3f\n", numThreads, ultraFastMicroseconds, bitmapMicroseconds);
+    }
+    printf("\n");
+}
+
+struct QtCountingRow
+{
+    long maxReaders;
+    double qtMicroseconds;
+    double countingMicroseconds;
+    Stats qt;
+    Stats counting;
+};
+
+// One row of TestQtCounting(): uncontended write latency, with one idle
+// reader, and throughput with numReaders readers and one writer, for both Qt
+// mutexes capped at TMaxConcurrentReaders readers.
+template <long TMaxConcurrentReaders>
+QtCountingRow TestQtCountingCap(const long numReaders)
+{
+    typedef QtReadWriteMutex<CriticalSection, Semaphore, TMaxConcurrentReaders> Qt_t;
+    typedef QtCountingReadWriteMutex<CriticalSection, TMaxConcurrentReaders> QtCounting_t;
+
+    QtCountingRow row;
+    row.maxReaders = TMaxConcurrentReaders;
+    row.qtMicroseconds = WriterLatencyTest<Qt_t>(1).Execute();
+    row.countingMicroseconds = WriterLatencyTest<QtCounting_t>(1).Execute();
+    row.qt = Test<Qt_t>(numReaders, 1, "QtReadWriteMutex").Execute();
+    row.counting = Test<QtCounting_t>(numReaders, 1, "QtCountingReadWriteMutex").Execute();
+    return row;
+}
+
+// QtReadWriteMutex's writer does one P() per reader slot, while
+// QtCountingReadWriteMutex's takes them all with one interlocked op; sweeps
+// the reader cap from 1 to 4096.
+void TestQtCounting(const long numReaders)
+{
+    std::vector<QtCountingRow> rows;
+    rows.push_back(TestQtCountingCap<1>(numReaders));
+    rows.push_back(TestQtCountingCap<4>(numReaders));
+    rows.push_back(TestQtCountingCap<16>(numReaders));
+    rows.push_back(TestQtCountingCap<64>(numReaders));
+    rows.push_back(TestQtCountingCap<256>(numReaders));
+    rows.push_back(TestQtCountingCap<1024>(numReaders));
+    rows.push_back(TestQtCountingCap<4096>(numReaders));
+
+    printf("\nQt reader cap, numReaders = %d, 1 writer\n", numReaders);
+    printf("maxReaders,   Qt write us,   Counting us,        Qt tps,  Counting tps\n");
+    for (size_t u = 0; u < rows.size(); u++)
+    {
+        printf("%10d,%14.3f,%14.3f,%14.1f,%14.1f\n",
+            rows[u].maxReaders,
+            rows[u].qtMicroseconds,
+            rows[u].countingMicroseconds,
+            rows[u].qt.totalPerSecond,
+            rows[u].counting.totalPerSecond);
+    }
+    printf("\n");
+}
+
+// A small record, as a seqlock would protect.  Writers fill every value with
+// the same number, so a reader can tell if its copy is torn.
+struct Payload
+{
+    enum
+    {
+        VALUE_COUNT = 32
+    };
+    volatile long values[VALUE_COUNT];
+};
+
+// Copies the payload under a read lock; returns the number of retries (none).
+template <class TMutex>
+long ReadPayload(TMutex& mutex, const Payload& shared, long* pCopy)
+{
+    TMutex::ScopedReadLock lk(mutex);
+    for (long i = 0; i < Payload::VALUE_COUNT; i++)
+    {
+        pCopy[i] = shared.values[i];
+    }
+    return 0;
+}
+
+// Copies the payload optimistically; returns the number of retries.
+template <class TMutex>
+long ReadPayload(SeqReadWriteMutex<TMutex>& mutex, const Payload& shared, long* pCopy)
+{
+    typename SeqReadWriteMutex<TMutex>::ScopedOptimisticRead read(mutex);
+    do
+    {
+        for (long i = 0; i < Payload::VALUE_COUNT; i++)
+        {
+            pCopy[i] = shared.values[i];
+        }
+    } while (read.Retry());
+    return read.RetryCount();
+}
+
+// UltraFastReadWriteMutex, but PayloadCopyTest reads it optimistically.
+template <class TMutex = CriticalSection>
+class OptimisticUltraFastReadWriteMutex : public UltraFastReadWriteMutex<TMutex>
+{
+};
+
+// Copies the payload optimistically, falling back to the read lock if a
+// writer got in; returns 1 if it had to fall back.
+template <class TMutex>
+long ReadPayload(OptimisticUltraFastReadWriteMutex<TMutex>& mutex, const Payload& shared, long* pCopy)
+{
+    const long stamp = mutex.TryOptimisticRead();
+    if (stamp != 0)
+    {
+        for (long i = 0; i < Payload::VALUE_COUNT; i++)
+        {
+            pCopy[i] = shared.values[i];
+        }
+        if (mutex.Validate(stamp))
+        {
+            return 0;
+        }
+    }
+    typename UltraFastReadWriteMutex<TMutex>::ScopedReadLock lk(mutex);
+    for (long i = 0; i < Payload::VALUE_COUNT; i++)
+    {
+        pCopy[i] = shared.values[i];
+    }
+    return 1;
+}
+
+struct PayloadStats
+{
+    double readsPerSecond;
+    double writesPerSecond;
+    double retriesPerRead;
+    __int64 tornReads;
+};
+
+// Readers copy a Payload out of the critical section, writers overwrite it.
+// Counts retries (for optimistic readers) and torn copies (which must be 0).
+template <class TMutex>
+class PayloadCopyTest
+{
+public:
+    PayloadCopyTest(long readerThreadCount, long writerThreadCount)
+    {
+        m_readerThreadCount = readerThreadCount;
+        m_writerThreadCount = writerThreadCount;
+        m_readerLockCount = 0;
+        m_writerLockCount = 0;
+        m_retryCount = 0;
+        m_tornCount = 0;
+        memset((void*)&m_payload, 0, sizeof(m_payload));
+    }
+
+    PayloadStats Execute()
+    {
+        m_runner.Start(m_readerThreadCount, this, &PayloadCopyTest::ReaderThread);
+        m_runner.Start(m_writerThreadCount, this, &PayloadCopyTest::WriterThread);
+        const double durationSeconds = m_runner.Run();
+
+        PayloadStats stats;
+        stats.readsPerSecond = m_readerLockCount / durationSeconds;
+        stats.writesPerSecond = m_writerLockCount / durationSeconds;
+        stats.retriesPerRead = m_readerLockCount ? m_retryCount * 1.0 / m_readerLockCount : 0.0;
+        stats.tornReads = m_tornCount;
+        return stats;
+    }
+
+private:
+    void WriterThread()
+    {
+        __int64 count = 0;
+        while (!m_runner.Done())
+        {
+            TMutex::ScopedWriteLock lk(m_mutex);
+            count += 1;
+            for (long i = 0; i < Payload::VALUE_COUNT; i++)
+            {
+                m_payload.values[i] = (long)count;
+            }
+        }
+        m_runner.Add(m_writerLockCount, count);
+    }
+
+    void ReaderThread()
+    {
+        long copy[Payload::VALUE_COUNT];
+        __int64 count = 0;
+        __int64 retries = 0;
+        __int64 torn = 0;
+        while (!m_runner.Done())
+        {
+            retries += ReadPayload(m_mutex, m_payload, copy);
+            for (long i = 1; i < Payload::VALUE_COUNT; i++)
+            {
+                if (copy[i] != copy[0])
+                {
+                    torn += 1;
+                    break;
+                }
+            }
+            count += 1;
+        }
+        m_runner.Add(m_readerLockCount, count);
+        m_runner.Add(m_retryCount, retries);
+        m_runner.Add(m_tornCount, torn);
+    }
+
+private:
+    TMutex m_mutex;
+    Payload m_payload;
+    ThreadRunner m_runner;
+
+    long m_readerThreadCount;
+    long m_writerThreadCount;
+
+    __int64 m_readerLockCount;
+    __int64 m_writerLockCount;
+    __int64 m_retryCount;
+    __int64 m_tornCount;
+};
+
+// Read throughput and retry rate of the seqlock's optimistic readers against
+// UltraFast's locked readers, both copying a Payload.
+void TestPayloadCopy(const long numWriters)
+{
+    printf("\npayload copy, numWriters = %d\n", numWriters);
+    printf("numReaders, UltraFast rps,       Seq rps, Seq retries/read, torn\n");
+    for (long numReaders = 1; numReaders <= 16; numReaders *= 2)
+    {
+        PayloadCopyTest<UltraFastReadWriteMutex<> > ultraFast(numReaders, numWriters);
+        const PayloadStats ultraFastStats = ultraFast.Execute();
+        PayloadCopyTest<SeqReadWriteMutex<> > seq(numReaders, numWriters);
+        const PayloadStats seqStats = seq.Execute();
+        printf("%10d,%14.1f,%14.1f,%17.6f,%5d\n",
+            numReaders,
+            ultraFastStats.readsPerSecond,
+            seqStats.readsPerSecond,
+            seqStats.retriesPerRead,
+            (long)(ultraFastStats.tornReads + seqStats.tornReads));
+    }
+    printf("\n");
+}
+
+// Optimistic read success rate of UltraFast as writers are added, against
+// its locked readers.
+void TestOptimisticRead(const long numReaders)
+{
+    printf("\noptimistic read, numReaders = %d\n", numReaders);
+    printf("numWriters,    locked rps,optimistic rps, success rate, torn\n");
+    for (long numWriters = 0; numWriters <= 8; numWriters++)
+    {
+        PayloadCopyTest<UltraFastReadWriteMutex<> > locked(numReaders, numWriters);
+        const PayloadStats lockedStats = locked.Execute();
+        PayloadCopyTest<OptimisticUltraFastReadWriteMutex<> > optimistic(numReaders, numWriters);
+        const PayloadStats optimisticStats = optimistic.Execute();
+        printf("%10d,%14.1f,%14.1f,%13.6f,%5d\n",
+            numWriters,
+            lockedStats.readsPerSecond,
+            optimisticStats.readsPerSecond,
+            1.0 - optimisticStats.retriesPerRead,
+            (long)(lockedStats.tornReads + optimisticStats.tornReads));
+    }
+    printf("\n");
+}
+
+// Models cache-fill code: every thread keeps looking up keys, and missPercent
+// of the lookups miss and have to insert.  With useUpgrade, a lookup takes
+// the upgrade lock and upgrades on a miss; otherwise it takes the read lock,
+// and on a miss drops it, takes the write lock and looks up again.
+template <class TMutex>
+class CacheFillTest
+{
+public:
+    CacheFillTest(long numThreads, long missPercent, bool useUpgrade)
+    {
+        m_numThreads = numThreads;
+        m_missPercent = missPercent;
+        m_useUpgrade = useUpgrade;
+        m_lookupCount = 0;
+        memset((void*)m_table, 0, sizeof(m_table));
+    }
+
+    // Returns lookups per second.
+    double Execute()
+    {
+        m_runner.Start(m_numThreads, this, &CacheFillTest::Thread);
+        const double durationSeconds = m_runner.Run();
+        return m_lookupCount / durationSeconds;
+    }
+
+private:
+    enum
+    {
+        TABLE_SIZE = 64
+    };
+
+    // whether the key is absent; the table itself only provides memory traffic
+    bool lookup(unsigned long key, unsigned long random)
+    {
+        return m_table[key] < 0 || (long)(random % 100) < m_missPercent;
+    }
+
+    void insert(unsigned long key)
+    {
+        m_table[key] += 1;
+    }
+
+    void Thread()
+    {
+        unsigned long random = GetCurrentThreadId();
+        __int64 count = 0;
+        while (!m_runner.Done())
+        {
+            random = random * 1103515245 + 12345;
+            const unsigned long key = (random >> 16) % TABLE_SIZE;
+            if (m_useUpgrade)
+            {
+                TMutex::ScopedUpgradeLock lk(m_mutex);
+                if (lookup(key, random >> 8))
+                {
+                    lk.Upgrade();
+                    insert(key);
+                }
+            }
+            else
+            {
+                bool miss = false;
+                {
+                    TMutex::ScopedReadLock lk(m_mutex);
+                    miss = lookup(key, random >> 8);
+                }
+                if (miss)
+                {
+                    TMutex::ScopedWriteLock lk(m_mutex);
+                    // somebody else may have inserted it meanwhile
+                    if (lookup(key, random >> 8))
+                    {
+                        insert(key);
+                    }
+                }
+            }
+            count += 1;
+        }
+        m_runner.Add(m_lookupCount, count);
+    }
+
+private:
+    TMutex m_mutex;
+    volatile long m_table[TABLE_SIZE];
+    ThreadRunner m_runner;
+
+    long m_numThreads;
+    long m_missPercent;
+    bool m_useUpgrade;
+
+    __int64 m_lookupCount;
+};
+
+// Lookups/sec of drop-and-relock against upgrade, as the miss rate grows.
+void TestUpgrade(const long numThreads)
+{
+    static const long missPercents[] = { 0, 1, 5, 20, 50, 100 };
+
+    printf("\nupgrade, numThreads = %d\n", numThreads);
+    printf("  miss %%, UltraFast relock, UltraFast upgrade,    FairCs relock,   FairCs upgrade\n");
+    for (size_t u = 0; u < sizeof(missPercents) / sizeof(missPercents[0]); u++)
+    {
+        const long missPercent = missPercents[u];
+        CacheFillTest<UltraFastReadWriteMutex<> > ultraFastRelock(numThreads, missPercent, false);
+        const double ultraFastRelockLps = ultraFastRelock.Execute();
+        CacheFillTest<UltraFastReadWriteMutex<> > ultraFastUpgrade(numThreads, missPercent, true);
+        const double ultraFastUpgradeLps = ultraFastUpgrade.Execute();
+        CacheFillTest<FairCsReadWriteMutex<> > fairCsRelock(numThreads, missPercent, false);
+        const double fairCsRelockLps = fairCsRelock.Execute();
+        CacheFillTest<FairCsReadWriteMutex<> > fairCsUpgrade(numThreads, missPercent, true);
+        const double fairCsUpgradeLps = fairCsUpgrade.Execute();
+        printf("%8d,%17.1f,%18.1f,%17.1f,%17.1f\n",
+            missPercent,
+            ultraFastRelockLps,
+            ultraFastUpgradeLps,
+            fairCsRelockLps,
+            fairCsUpgradeLps);
+    }
+    printf("\n");
+}
+
+// Acquisition latency histogram: 1us buckets up to 1ms, then 1ms buckets up
+// to 1s, then one overflow bucket.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+        : m_buckets(BUCKET_COUNT, 0)
+        , m_count(0)
+        , m_maxMicroseconds(0)
+    {
+    }
+
+    void Add(double microseconds)
+    {
+        size_t bucket = BUCKET_COUNT - 1;
+        if (microseconds < 1000)
+        {
+            bucket = (size_t)microseconds;
+        }
+        else if (microseconds < 1000000)
+        {
+            bucket = 1000 + (size_t)(microseconds / 1000) - 1;
+        }
+        m_buckets[bucket] += 1;
+        m_count += 1;
+        if (microseconds > m_maxMicroseconds)
+        {
+            m_maxMicroseconds = microseconds;
+        }
+    }
+
+    void Merge(const LatencyHistogram& other)
+    {
+        for (size_t u = 0; u < BUCKET_COUNT; u++)
+        {
+            m_buckets[u] += other.m_buckets[u];
+        }
+        m_count += other.m_count;
+        if (other.m_maxMicroseconds > m_maxMicroseconds)
+        {
+            m_maxMicroseconds = other.m_maxMicroseconds;
+        }
+    }
+
+    __int64 Count() const
+    {
+        return m_count;
+    }
+
+    double MaxMicroseconds() const
+    {
+        return m_maxMicroseconds;
+    }
+
+    // Returns the upper bound of the bucket holding the given percentile,
+    // capped at the maximum.
+    double PercentileMicroseconds(double percentile) const
+    {
+        const __int64 rank = (__int64)(m_count * percentile / 100);
+        __int64 seen = 0;
+        for (size_t u = 0; u < BUCKET_COUNT - 1; u++)
+        {
+            seen += m_buckets[u];
+            if (seen > rank)
+            {
+                const double upperBound = u < 1000 ? u + 1.0 : (u - 1000 + 2) * 1000.0;
+                return upperBound < m_maxMicroseconds ? upperBound : m_maxMicroseconds;
+            }
+        }
+        return m_maxMicroseconds;
+    }
+
+private:
+    enum
+    {
+        BUCKET_COUNT = 1000 + 999 + 1
+    };
+
+    std::vector<__int64> m_buckets;
+    __int64 m_count;
+    double m_maxMicroseconds;
+};
+
+// Load shedding under a long writer: one writer keeps taking the write lock
+// and holding it for holdMilliseconds, while the readers and one more writer
+// use ReadLockFor()/WriteLockFor() and give up after timeoutMilliseconds.
+// Measures how often the timed acquisitions gave up, and their tail latency,
+// successful or not.
+template <class TMutex>
+class TimedLockTest
+{
+public:
+    TimedLockTest(long numReaders, DWORD timeoutMilliseconds, DWORD holdMilliseconds)
+    {
+        m_numReaders = numReaders;
+        m_timeoutMilliseconds = timeoutMilliseconds;
+        m_holdMilliseconds = holdMilliseconds;
+        m_readTimeouts = 0;
+        m_writeTimeouts = 0;
+        QueryPerformanceFrequency(&m_frequency);
+    }
+
+    void Execute(const char* pName)
+    {
+        m_runner.Start(1, this, &TimedLockTest::BlockingWriterThread);
+        m_runner.Start(1, this, &TimedLockTest::TimedWriterThread);
+        m_runner.Start(m_numReaders, this, &TimedLockTest::ReaderThread);
+        m_runner.Run();
+
+        printf("%-20s,%10.0f,%8.2f,%8.0f,%8.0f,%8.0f,%8.0f,%8.0f,%8.2f,%8.0f,%8.0f,%8.0f\n",
+            pName,
+            (double)m_readLatency.Count(),
+            timeoutPercent(m_readTimeouts, m_readLatency),
+            m_readLatency.PercentileMicroseconds(50),
+            m_readLatency.PercentileMicroseconds(99),
+            m_readLatency.PercentileMicroseconds(99.9),
+            m_readLatency.MaxMicroseconds(),
+            (double)m_writeLatency.Count(),
+            timeoutPercent(m_writeTimeouts, m_writeLatency),
+            m_writeLatency.PercentileMicroseconds(50),
+            m_writeLatency.PercentileMicroseconds(99),
+            m_writeLatency.MaxMicroseconds());
+    }
+
+private:
+    static double timeoutPercent(__int64 timeouts, const LatencyHistogram& latency)
+    {
+        return latency.Count() ? timeouts * 100.0 / latency.Count() : 0;
+    }
+
+    double microsecondsSince(const LARGE_INTEGER& start)
+    {
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&end);
+        return (end.QuadPart - start.QuadPart) * 1000000.0 / m_frequency.QuadPart;
+    }
+
+    void BlockingWriterThread()
+    {
+        while (!m_runner.Done())
+        {
+            {
+                TMutex::ScopedWriteLock lk(m_mutex);
+                Sleep(m_holdMilliseconds);
+            }
+            // let the timed threads in between the long writes
+            Sleep(m_holdMilliseconds);
+        }
+    }
+
+    void TimedWriterThread()
+    {
+        LatencyHistogram latency;
+        __int64 timeouts = 0;
+        while (!m_runner.Done())
+        {
+            LARGE_INTEGER start;
+            QueryPerformanceCounter(&start);
+            const bool locked = m_mutex.WriteLockFor(m_timeoutMilliseconds);
+            latency.Add(microsecondsSince(start));
+            if (locked)
+            {
+                m_mutex.WriteUnlock();
+            }
+            else
+            {
+                timeouts += 1;
+            }
+            Sleep(0);
+        }
+        m_runner.Merge(m_writeLatency, latency);
+        m_runner.Add(m_writeTimeouts, timeouts);
+    }
+
+    void ReaderThread()
+    {
+        LatencyHistogram latency;
+        __int64 timeouts = 0;
+        while (!m_runner.Done())
+        {
+            LARGE_INTEGER start;
+            QueryPerformanceCounter(&start);
+            const bool locked = m_mutex.ReadLockFor(m_timeoutMilliseconds);
+            latency.Add(microsecondsSince(start));
+            if (locked)
+            {
+                m_mutex.ReadUnlock();
+            }
+            else
+            {
+                timeouts += 1;
+            }
+        }
+        m_runner.Merge(m_readLatency, latency);
+        m_runner.Add(m_readTimeouts, timeouts);
+    }
+
+private:
+    TMutex m_mutex;
+    ThreadRunner m_runner;
+
+    long m_numReaders;
+    DWORD m_timeoutMilliseconds;
+    DWORD m_holdMilliseconds;
+    LARGE_INTEGER m_frequency;
+
+    LatencyHistogram m_readLatency;
+    LatencyHistogram m_writeLatency;
+    __int64 m_readTimeouts;
+    __int64 m_writeTimeouts;
+};
+
+// Takes count units, one P() at a time, from the semaphores without a bulk P(n).
+// Takers go through takersLock one at a time: two takers that each got part of
+// what they need could otherwise wait for each other's units for good.
+template <class TSema>
+void TakeUnits(TSema& sema, CriticalSection& takersLock, long count)
+{
+    CriticalSection::ScopedWriteLock lk(takersLock);
+    for (long i = 0; i < count; i++)
+    {
+        sema.P();
+    }
+}
+
+void TakeUnits(FutexSemaphore& sema, CriticalSection&, long count)
+{
+    sema.P(count);
+}
+
+// A bounded buffer of CAPACITY units, guarded by a pair of semaphores:
+// producers take BATCH_SIZE units of space and post BATCH_SIZE units of data,
+// consumers the other way around.  Counts units handed over per second.
+template <class TSema>
+class BulkHandoffTest
+{
+private:
+    enum
+    {
+        BATCH_SIZE = 16,
+        CAPACITY = 4 * BATCH_SIZE
+    };
+
+public:
+    // The maximum counts leave room for the units that Execute() posts to both
+    // semaphores at the end to unblock every thread, since the threads' last
+    // handoffs may move all of them into one semaphore.
+    BulkHandoffTest(long numPairs)
+        : m_spaceSema(CAPACITY, CAPACITY + 2 * numPairs * BATCH_SIZE)
+        , m_dataSema(0, CAPACITY + 2 * numPairs * BATCH_SIZE)
+    {
+        m_numPairs = numPairs;
+        m_unitCount = 0;
+    }
+
+    double Execute()
+    {
+        m_runner.Start(m_numPairs, this, &BulkHandoffTest::ProducerThread);
+        m_runner.Start(m_numPairs, this, &BulkHandoffTest::ConsumerThread);
+        m_runner.Release();
+        Sleep(ThreadRunner::DURATION_MILLISECONDS);
+        m_runner.Stop();
+
+        // every producer and consumer may be blocked; unblock them for good
+        for (long i = 0; i < m_numPairs; i++)
+        {
+            m_spaceSema.V(BATCH_SIZE);
+            m_dataSema.V(BATCH_SIZE);
+        }
+        m_runner.Join();
+
+        return m_unitCount / (ThreadRunner::DURATION_MILLISECONDS / 1000.0);
+    }
+
+private:
+    void ProducerThread()
+    {
+        while (!m_runner.Done())
+        {
+            TakeUnits(m_spaceSema, m_spaceTakers, BATCH_SIZE);
+            m_dataSema.V(BATCH_SIZE);
+        }
+    }
+
+    void ConsumerThread()
+    {
+        __int64 count = 0;
+        while (!m_runner.Done())
+        {
+            TakeUnits(m_dataSema, m_dataTakers, BATCH_SIZE);
+            m_spaceSema.V(BATCH_SIZE);
+            count += BATCH_SIZE;
+        }
+        m_runner.Add(m_unitCount, count);
+    }
+
+private:
+    TSema m_spaceSema;
+    TSema m_dataSema;
+    // serialize the piecewise takers; see TakeUnits()
+    CriticalSection m_spaceTakers;
+    CriticalSection m_dataTakers;
+    ThreadRunner m_runner;
+
+    long m_numPairs;
+
+    __int64 m_unitCount;
+};
+
+// FutexSemaphore against the event-based semaphores, as the TSema of the
+// semaphore-based locks, and in a bulk producer/consumer handoff.
+void TestFutexSemaphore(const long numReaders)
+{
+    const Stats semaMutex[] = {
+        Test<SemaMutex<Semaphore> >(numReaders, 1, "SemaMutex<Semaphore>").Execute(),
+        Test<SemaMutex<Csev2Semaphore> >(numReaders, 1, "SemaMutex<Csev2Semaphore>").Execute(),
+        Test<SemaMutex<FutexSemaphore> >(numReaders, 1, "SemaMutex<FutexSemaphore>").Execute()
+    };
+    const Stats fair[] = {
+        Test<FairReadWriteMutex<Semaphore> >(numReaders, 1, "FairReadWriteMutex<Semaphore>").Execute(),
+        Test<FairReadWriteMutex<Csev2Semaphore> >(numReaders, 1, "FairReadWriteMutex<Csev2Semaphore>").Execute(),
+        Test<FairReadWriteMutex<FutexSemaphore> >(numReaders, 1, "FairReadWriteMutex<FutexSemaphore>").Execute()
+    };
+    const Stats cohort[] = {
+        Test<CohortReadWriteMutex<Semaphore> >(numReaders, 1, "CohortReadWriteMutex<Semaphore>").Execute(),
+        Test<CohortReadWriteMutex<Csev2Semaphore> >(numReaders, 1, "CohortReadWriteMutex<Csev2Semaphore>").Execute(),
+        Test<CohortReadWriteMutex<FutexSemaphore> >(numReaders, 1, "CohortReadWriteMutex<FutexSemaphore>").Execute()
+    };
+    const double handoff[] = {
+        BulkHandoffTest<Semaphore>(numReaders).Execute(),
+        BulkHandoffTest<Csev2Semaphore>(numReaders).Execute(),
+        BulkHandoffTest<FutexSemaphore>(numReaders).Execute()
+    };
+
+    printf("\nsemaphores, numReaders = %d, 1 writer\n", numReaders);
+    printf("name                ,     Semaphore,Csev2Semaphore,FutexSemaphore\n");
+    printf("%-20s,%14.1f,%14.1f,%14.1f\n", "SemaMutex ops/s",
+        semaMutex[0].totalPerSecond, semaMutex[1].totalPerSecond, semaMutex[2].totalPerSecond);
+    printf("%-20s,%14.1f,%14.1f,%14.1f\n", "Fair ops/s",
+        fair[0].totalPerSecond, fair[1].totalPerSecond, fair[2].totalPerSecond);
+    printf("%-20s,%14.1f,%14.1f,%14.1f\n", "Cohort ops/s",
+        cohort[0].totalPerSecond, cohort[1].totalPerSecond, cohort[2].totalPerSecond);
+    printf("%-20s,%14.1f,%14.1f,%14.1f\n", "handoff units/s",
+        handoff[0], handoff[1], handoff[2]);
+    printf("\n");
+}
+
+// Timeout rate and tail latency of timed acquisitions, against a writer that
+// holds the lock for longer than the timeout.
+void TestTimedLock(const long numReaders)
+{
+    const DWORD timeoutMilliseconds = 5;
+    const DWORD holdMilliseconds = 20;
+
+    printf("\ntimed lock, numReaders = %d, timeout = %d ms, hold = %d ms\n", numReaders, timeoutMilliseconds, holdMilliseconds);
+    printf("name                ,     reads, read%%TO,  p50 us,  p99 us, p999 us,  max us,  writes,write%%TO,  p50 us,  p99 us,  max us\n");
+    TimedLockTest<UltraFastReadWriteMutex<> >(numReaders, timeoutMilliseconds, holdMilliseconds).Execute("UltraFast");
+    TimedLockTest<UltraFastReadWriteMutex<McsLock> >(numReaders, timeoutMilliseconds, holdMilliseconds).Execute("UltraFast<McsLock>");
+    TimedLockTest<UltraFutexReadWriteMutex<> >(numReaders, timeoutMilliseconds, holdMilliseconds).Execute("UltraFutex");
+    TimedLockTest<FairCsReadWriteMutex<> >(numReaders, timeoutMilliseconds, holdMilliseconds).Execute("FairCs");
+    TimedLockTest<FastSlimReadWriteMutex<> >(numReaders, timeoutMilliseconds, holdMilliseconds).Execute("FastSlim");
+    TimedLockTest<SlimReadWriteLock>(numReaders, timeoutMilliseconds, holdMilliseconds).Execute("SlimReadWriteLock");
+    TimedLockTest<QtReadWriteMutex<CriticalSection, Semaphore, 16> >(numReaders, timeoutMilliseconds, holdMilliseconds).Execute("Qt");
+    TimedLockTest<PhaseFairReadWriteMutex<> >(numReaders, timeoutMilliseconds, holdMilliseconds).Execute("PhaseFair");
+    TimedLockTest<CohortReadWriteMutex<Semaphore> >(numReaders, timeoutMilliseconds, holdMilliseconds).Execute("Cohort<Semaphore>");
+    printf("\n");
+}
+
+// Readers make API calls that nest NEST_DEPTH deep, each level taking the
+// read lock again, as an instrumented API layer does.  A writer keeps booting
+// them out to bump a counter.  The innermost call reads the counter twice; if
+// a nested unlock had let the writer in while the outer levels still held the
+// lock, the two reads would differ.
+template <class TMutex>
+class NestedReadTest
+{
+private:
+    enum
+    {
+        NEST_DEPTH = 4
+    };
+
+public:
+    NestedReadTest(long numReaders)
+    {
+        m_numReaders = numReaders;
+        m_value = 0;
+        m_callCount = 0;
+        m_writeCount = 0;
+        m_errorCount = 0;
+    }
+
+    Stats Execute()
+    {
+        m_runner.Start(m_numReaders, this, &NestedReadTest::ReaderThread);
+        m_runner.Start(1, this, &NestedReadTest::WriterThread);
+
+        Stats stats;
+        stats.durationSeconds = m_runner.Run();
+        stats.readsPerSecond = m_callCount / stats.durationSeconds;
+        stats.writesPerSecond = m_writeCount / stats.durationSeconds;
+        stats.totalPerSecond = stats.readsPerSecond + stats.writesPerSecond;
+        stats.numThreads = m_numReaders + 1;
+        stats.errorCount = m_errorCount;
+        return stats;
+    }
+
+private:
+    // Returns whether the counter stayed put while the read lock was held.
+    bool nestedCall(long depth)
+    {
+        TMutex::ScopedReadLock lk(m_mutex);
+        if (depth > 1)
+        {
+            return nestedCall(depth - 1);
+        }
+        const __int64 value = m_value;
+        YieldProcessor();
+        return m_value == value;
+    }
+
+    void WriterThread()
+    {
+        __int64 count = 0;
+        while (!m_runner.Done())
+        {
+            {
+                TMutex::ScopedWriteLock lk(m_mutex);
+                m_value += 1;
+            }
+            count += 1;
+            // API-trace writers are rare
+            Sleep(0);
+        }
+        m_runner.Add(m_writeCount, count);
+    }
+
+    void ReaderThread()
+    {
+        __int64 count = 0;
+        long errors = 0;
+        while (!m_runner.Done())
+        {
+            if (!nestedCall(NEST_DEPTH))
+            {
+                errors += 1;
+            }
+            count += 1;
+        }
+        m_runner.Add(m_callCount, count);
+        m_runner.Add(m_errorCount, errors);
+    }
+
+private:
+    TMutex m_mutex;
+    volatile char pad0[CACHE_LINE_SIZE];
+    volatile __int64 m_value;
+    volatile char pad1[CACHE_LINE_SIZE - 8];
+
+    ThreadRunner m_runner;
+
+    long m_numReaders;
+
+    __int64 m_callCount;
+    __int64 m_writeCount;
+    long m_errorCount;
+};
+
+// Outer API calls/sec with nested read locks, for the TLS-based mutexes
+// against the recursive CriticalSection they used to need wrapping in.
+void TestNestedRead(const long numReaders)
+{
+    printf("\nnested reads, numReaders = %d, 1 writer\n", numReaders);
+    printf("name                ,       calls/s,      writes/s,  errors\n");
+    const char* names[] = { "CriticalSection", "UltraFast", "UltraFutex", "UltraSpinFenced", "Ticketed", "Cohort<Semaphore>",
+        "PerCpu", "Bitmap", "FairCs" };
+    Stats stats[9];
+    stats[0] = NestedReadTest<CriticalSection>(numReaders).Execute();
+    stats[1] = NestedReadTest<UltraFastReadWriteMutex<> >(numReaders).Execute();
+    stats[2] = NestedReadTest<UltraFutexReadWriteMutex<> >(numReaders).Execute();
+    stats[3] = NestedReadTest<UltraSpinFencedReadWriteMutex<AsymmetricFence> >(numReaders).Execute();
+    stats[4] = NestedReadTest<TicketedReadWriteMutex<> >(numReaders).Execute();
+    stats[5] = NestedReadTest<CohortReadWriteMutex<Semaphore> >(numReaders).Execute();
+    stats[6] = NestedReadTest<PerCpuReadWriteMutex<> >(numReaders).Execute();
+    stats[7] = NestedReadTest<BitmapReadWriteMutex<> >(numReaders).Execute();
+    stats[8] = NestedReadTest<FairCsReadWriteMutex<> >(numReaders).Execute();
+    for (size_t u = 0; u < sizeof(names) / sizeof(names[0]); u++)
+    {
+        printf("%-20s,%14.1f,%14.1f,%8d\n", names[u], stats[u].readsPerSecond, stats[u].writesPerSecond, stats[u].errorCount);
+    }
+    printf("\n");
+    for (size_t u = 0; u < sizeof(names) / sizeof(names[0]); u++)
+    {
+        // a write inside a nested read section is a broken mutex, not noise
+        assert(stats[u].errorCount == 0);
+    }
+}
+
+// Writers increment a shared counter, either each under its own write lock
+// (ScopedWriteLock) or as closures handed to SubmitWrite(), so that a burst of
+// them shares one write acquisition.  Readers keep reading the counter.
+template <class TMutex>
+class CombiningTest
+{
+public:
+    CombiningTest(long numReaders, long numWriters, bool useClosures)
+    {
+        m_numReaders = numReaders;
+        m_numWriters = numWriters;
+        m_useClosures = useClosures;
+        m_value = 0;
+        m_readCount = 0;
+        m_writeCount = 0;
+        m_readSum = 0;
+    }
+
+    Stats Execute()
+    {
+        m_runner.Start(m_numReaders, this, &CombiningTest::ReaderThread);
+        m_runner.Start(m_numWriters, this, &CombiningTest::WriterThread);
+
+        Stats stats;
+        stats.durationSeconds = m_runner.Run();
+
+        // every write must have run exactly once
+        assert(m_value == m_writeCount);
+
+        stats.readsPerSecond = m_readCount / stats.durationSeconds;
+        stats.writesPerSecond = m_writeCount / stats.durationSeconds;
+        stats.totalPerSecond = stats.readsPerSecond + stats.writesPerSecond;
+        stats.numThreads = m_numReaders + m_numWriters;
+        return stats;
+    }
+
+private:
+    class IncrementWrite : public CombinedWrite
+    {
+        volatile __int64& m_value;
+
+    public:
+        IncrementWrite(volatile __int64& value)
+            : m_value(value)
+        {
+        }
+        virtual void Execute()
+        {
+            m_value += 1;
+        }
+    };
+
+    void WriterThread()
+    {
+        __int64 count = 0;
+        while (!m_runner.Done())
+        {
+            if (m_useClosures)
+            {
+                IncrementWrite write(m_value);
+                m_mutex.SubmitWrite(write);
+            }
+            else
+            {
+                TMutex::ScopedWriteLock lk(m_mutex);
+                m_value += 1;
+            }
+            count += 1;
+        }
+        m_runner.Add(m_writeCount, count);
+    }
+
+    void ReaderThread()
+    {
+        __int64 count = 0;
+        __int64 sum = 0;
+        while (!m_runner.Done())
+        {
+            TMutex::ScopedReadLock lk(m_mutex);
+            sum += m_value;
+            count += 1;
+        }
+        m_runner.Add(m_readCount, count);
+        // keep the reads from being optimized away
+        m_runner.Add(m_readSum, sum);
+    }
+
+private:
+    TMutex m_mutex;
+    volatile char pad0[CACHE_LINE_SIZE];
+    volatile __int64 m_value;
+    volatile char pad1[CACHE_LINE_SIZE - 8];
+
+    ThreadRunner m_runner;
+
+    long m_numReaders;
+    long m_numWriters;
+    bool m_useClosures;
+
+    __int64 m_readCount;
+    __int64 m_writeCount;
+    __int64 m_readSum;
+};
+
+// Writes/sec of one write lock per write against flat-combined closures, over
+// UltraFastReadWriteMutex, as the number of writers grows.
+void TestFlatCombining(const long numReaders)
+{
+    static const long writerCounts[] = { 1, 2, 4, 8, 12 };
+
+    printf("\nflat combining, numReaders = %d\n", numReaders);
+    printf("numWriters,  lock wps, closure wps,  lock rps, closure rps\n");
+    for (size_t u = 0; u < sizeof(writerCounts) / sizeof(writerCounts[0]); u++)
+    {
+        const long numWriters = writerCounts[u];
+        CombiningTest<FlatCombiningReadWriteMutex<UltraFastReadWriteMutex<> > > lock(numReaders, numWriters, false);
+        const Stats lockStats = lock.Execute();
+        CombiningTest<FlatCombiningReadWriteMutex<UltraFastReadWriteMutex<> > > closure(numReaders, numWriters, true);
+        const Stats closureStats = closure.Execute();
+        printf("%10d,%10.1f,%12.1f,%10.1f,%12.1f\n",
+            numWriters,
+            lockStats.writesPerSecond,
+            closureStats.writesPerSecond,
+            lockStats.readsPerSecond,
+            closureStats.readsPerSecond);
+    }
+    printf("\n");
+}
+
+// A read-mostly routing table: readers keep looking up routes while one
+// writer keeps replacing the whole table.  Every route in a table holds the
+// table's version, so a reader that sees mixed versions saw a torn update, and
+// one that sees RETIRED_VERSION used a table after it was freed.
+// - ROUTING_RWMUTEX updates the table in place under UltraFast's write lock.
+// - ROUTING_SYNCHRONIZE publishes a copy, then waits out a grace period with
+//   Rcu::Synchronize() before deleting the old table.
+// - ROUTING_CALL_RCU publishes a copy and hands the old table to CallRcu().
+enum RoutingMode
+{
+    ROUTING_RWMUTEX,
+    ROUTING_SYNCHRONIZE,
+    ROUTING_CALL_RCU
+};
+
+class RoutingTableTest
+{
+private:
+    enum
+    {
+        ROUTE_COUNT = 256,
+        RETIRED_VERSION = -1
+    };
+
+    struct RouteTable
+    {
+        long version;
+        long routes[ROUTE_COUNT];
+    };
+
+public:
+    RoutingTableTest(long numReaders, RoutingMode mode)
+    {
+        m_numReaders = numReaders;
+        m_mode = mode;
+        m_pTable = new RouteTable;
+        fill(m_pTable, 0);
+        m_lookupCount = 0;
+        m_updateCount = 0;
+        m_errorCount = 0;
+    }
+    ~RoutingTableTest()
+    {
+        // readers are gone, and Barrier() freed the retired tables
+        delete m_pTable;
+    }
+
+    Stats Execute()
+    {
+        m_runner.Start(m_numReaders, this, &RoutingTableTest::ReaderThread);
+        m_runner.Start(1, this, &RoutingTableTest::WriterThread);
+
+        Stats stats;
+        stats.durationSeconds = m_runner.Run();
+        m_rcu.Barrier();
+
+        stats.readsPerSecond = m_lookupCount / stats.durationSeconds;
+        stats.writesPerSecond = m_updateCount / stats.durationSeconds;
+        stats.totalPerSecond = stats.readsPerSecond + stats.writesPerSecond;
+        stats.numThreads = m_numReaders + 1;
+        stats.errorCount = m_errorCount;
+        return stats;
+    }
+
+private:
+    static void fill(RouteTable* pTable, long version)
+    {
+        pTable->version = version;
+        for (long i = 0; i < ROUTE_COUNT; i++)
+        {
+            pTable->routes[i] = version;
+        }
+    }
+
+    static void deleteTable(void* pContext)
+    {
+        RouteTable* pTable = (RouteTable*)pContext;
+        fill(pTable, RETIRED_VERSION);
+        delete pTable;
+    }
+
+    void WriterThread()
+    {
+        __int64 count = 0;
+        long version = 0;
+        while (!m_runner.Done())
+        {
+            version += 1;
+            if (m_mode == ROUTING_RWMUTEX)
+            {
+                UltraFastReadWriteMutex<>::ScopedWriteLock lk(m_mutex);
+                fill(m_pTable, version);
+            }
+            else
+            {
+                RouteTable* pOld = m_pTable;
+                RouteTable* pNew = new RouteTable;
+                fill(pNew, version);
+                Rcu<>::AssignPointer(&m_pTable, pNew);
+                if (m_mode == ROUTING_SYNCHRONIZE)
+                {
+                    m_rcu.Synchronize();
+                    deleteTable(pOld);
+                }
+                else
+                {
+                    m_rcu.CallRcu(&deleteTable, pOld);
+                }
+            }
+            count += 1;
+        }
+        m_runner.Add(m_updateCount, count);
+    }
+
+    // Returns whether the route for key was consistent with its table.
+    static bool lookup(const RouteTable* pTable, long key)
+    {
+        const long version = pTable->version;
+        return version != RETIRED_VERSION
+            && pTable->routes[key % ROUTE_COUNT] == version
+            && pTable->routes[ROUTE_COUNT - 1] == version;
+    }
+
+    void ReaderThread()
+    {
+        __int64 count = 0;
+        long errors = 0;
+        for (long key = 0; !m_runner.Done(); key++)
+        {
+            bool ok;
+            if (m_mode == ROUTING_RWMUTEX)
+            {
+                UltraFastReadWriteMutex<>::ScopedReadLock lk(m_mutex);
+                ok = lookup(m_pTable, key);
+            }
+            else
+            {
+                Rcu<>::ScopedReadLock lk(m_rcu);
+                ok = lookup(Rcu<>::Dereference(&m_pTable), key);
+            }
+            if (!ok)
+            {
+                errors += 1;
+            }
+            count += 1;
+        }
+        m_runner.Add(m_lookupCount, count);
+        m_runner.Add(m_errorCount, errors);
+    }
+
+private:
+    Rcu<> m_rcu;
+    UltraFastReadWriteMutex<> m_mutex;
+    RouteTable* volatile m_pTable;
+    volatile char pad0[CACHE_LINE_SIZE - sizeof(void*)];
+
+    ThreadRunner m_runner;
+
+    long m_numReaders;
+    RoutingMode m_mode;
+
+    __int64 m_lookupCount;
+    __int64 m_updateCount;
+    long m_errorCount;
+};
+
+// Lookups/sec and updates/sec of a routing table guarded by UltraFast's read
+// lock, against RCU with a grace period per update, and RCU with batched
+// CallRcu() reclamation, as the number of readers grows.
+void TestRcu(const long maxReaders)
+{
+    printf("\nrouting table, 1 writer\n");
+    printf("numReaders, rwmutex lps, sync lps, callrcu lps, rwmutex ups, sync ups, callrcu ups,  errors\n");
+    for (long numReaders = 1; numReaders <= maxReaders; numReaders++)
+    {
+        const Stats rwmutex = RoutingTableTest(numReaders, ROUTING_RWMUTEX).Execute();
+        const Stats sync = RoutingTableTest(numReaders, ROUTING_SYNCHRONIZE).Execute();
+        const Stats callRcu = RoutingTableTest(numReaders, ROUTING_CALL_RCU).Execute();
+        const long errorCount = rwmutex.errorCount + sync.errorCount + callRcu.errorCount;
+        printf("%10d,%12.1f,%9.1f,%12.1f,%12.1f,%9.1f,%12.1f,%8d\n",
+            numReaders,
+            rwmutex.readsPerSecond,
+            sync.readsPerSecond,
+            callRcu.readsPerSecond,
+            rwmutex.writesPerSecond,
+            sync.writesPerSecond,
+            callRcu.writesPerSecond,
+            errorCount);
+        // a torn table or a freed one still being read
+        assert(errorCount == 0);
+    }
+    printf("\n");
+}
+
+// An in-memory index, std::map from key to value, behind a read/write mutex.
+template <class TMutex>
+class LockedIndex
+{
+public:
+    bool Lookup(long key, long& value)
+    {
+        TMutex::ScopedReadLock lk(m_mutex);
+        std::map<long, long>::const_iterator iter = m_map.find(key);
+        if (iter == m_map.end())
+        {
+            return false;
+        }
+        value = iter->second;
+        return true;
+    }
+    void Update(long key, long value)
+    {
+        TMutex::ScopedWriteLock lk(m_mutex);
+        m_map[key] = value;
+    }
+
+private:
+    TMutex m_mutex;
+    std::map<long, long> m_map;
+};
+
+// The same index behind LeftRight.
+class LeftRightIndex
+{
+private:
+    typedef std::map<long, long> Map;
+
+    struct SetValue
+    {
+        long key;
+        long value;
+        void operator()(Map& map) const
+        {
+            map[key] = value;
+        }
+    };
+
+public:
+    bool Lookup(long key, long& value)
+    {
+        LeftRight<Map>::ScopedReadLock lk(m_leftRight);
+        Map::const_iterator iter = lk->find(key);
+        if (iter == lk->end())
+        {
+            return false;
+        }
+        value = iter->second;
+        return true;
+    }
+    void Update(long key, long value)
+    {
+        SetValue setValue;
+        setValue.key = key;
+        setValue.value = value;
+        m_leftRight.Write(setValue);
+    }
+
+private:
+    LeftRight<Map> m_leftRight;
+};
+
+// Readers keep looking up keys, and sample how long a lookup takes; one writer
+// keeps overwriting values.  A value always equals its key modulo KEY_COUNT,
+// so a lookup that finds anything else saw a torn index.
+template <class TIndex>
+class IndexTest
+{
+private:
+    enum
+    {
+        KEY_COUNT = 4096,
+        // time one lookup in this many, so that QPC doesn't dominate
+        SAMPLE_INTERVAL = 16
+    };
+
+public:
+    IndexTest(long numReaders)
+    {
+        m_numReaders = numReaders;
+        m_lookupCount = 0;
+        m_updateCount = 0;
+        m_errorCount = 0;
+        QueryPerformanceFrequency(&m_frequency);
+        for (long key = 0; key < KEY_COUNT; key++)
+        {
+            m_index.Update(key, key);
+        }
+    }
+
+    void Execute(const char* pName)
+    {
+        m_runner.Start(m_numReaders, this, &IndexTest::ReaderThread);
+        m_runner.Start(1, this, &IndexTest::WriterThread);
+        const double durationSeconds = m_runner.Run();
+
+        printf("%-20s,%12.1f,%12.1f,%8.0f,%8.0f,%8.0f,%8d\n",
+            pName,
+            m_lookupCount / durationSeconds,
+            m_updateCount / durationSeconds,
+            m_lookupLatency.PercentileMicroseconds(99),
+            m_lookupLatency.PercentileMicroseconds(99.9),
+            m_lookupLatency.MaxMicroseconds(),
+            m_errorCount);
+        // a lookup that missed a key or saw a value written for another one
+        assert(m_errorCount == 0);
+    }
+
+private:
+    double microsecondsSince(const LARGE_INTEGER& start)
+    {
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&end);
+        return (end.QuadPart - start.QuadPart) * 1000000.0 / m_frequency.QuadPart;
+    }
+
+    void WriterThread()
+    {
+        __int64 count = 0;
+        for (long i = 0; !m_runner.Done(); i++)
+        {
+            const long key = (i * 7) % KEY_COUNT;
+            m_index.Update(key, key + (i / KEY_COUNT + 1) * KEY_COUNT);
+            count += 1;
+        }
+        m_runner.Add(m_updateCount, count);
+    }
+
+    void ReaderThread()
+    {
+        LatencyHistogram latency;
+        __int64 count = 0;
+        long errors = 0;
+        for (long i = 0; !m_runner.Done(); i++)
+        {
+            const long key = (i * 13) % KEY_COUNT;
+            long value = 0;
+            bool found;
+            if (i % SAMPLE_INTERVAL == 0)
+            {
+                LARGE_INTEGER start;
+                QueryPerformanceCounter(&start);
+                found = m_index.Lookup(key, value);
+                latency.Add(microsecondsSince(start));
+            }
+            else
+            {
+                found = m_index.Lookup(key, value);
+            }
+            if (!found || value % KEY_COUNT != key)
+            {
+                errors += 1;
+            }
+            count += 1;
+        }
+        m_runner.Add(m_lookupCount, count);
+        m_runner.Add(m_errorCount, errors);
+        m_runner.Merge(m_lookupLatency, latency);
+    }
+
+private:
+    TIndex m_index;
+    ThreadRunner m_runner;
+
+    long m_numReaders;
+    LARGE_INTEGER m_frequency;
+
+    __int64 m_lookupCount;
+    __int64 m_updateCount;
+    long m_errorCount;
+    LatencyHistogram m_lookupLatency;
+};
+
+// Lookups/sec, updates/sec and lookup tail latency of a std::map index behind
+// LeftRight, against the same map behind the zoo's read/write mutexes.
+void TestLeftRight(const long numReaders)
+{
+    printf("\nindex, numReaders = %d, 1 writer\n", numReaders);
+    printf("name                ,         lps,         ups,  p99 us, p999 us,  max us,  errors\n");
+    IndexTest<LeftRightIndex>(numReaders).Execute("LeftRight");
+    IndexTest<LockedIndex<UltraFastReadWriteMutex<> > >(numReaders).Execute("UltraFast");
+    IndexTest<LockedIndex<FairCsReadWriteMutex<> > >(numReaders).Execute("FairCs");
+    IndexTest<LockedIndex<BravoReadWriteMutex<SlimReadWriteLock> > >(numReaders).Execute("Bravo<Slim>");
+    IndexTest<LockedIndex<SlimReadWriteLock> >(numReaders).Execute("SlimReadWriteLock");
+    printf("\n");
+}
+
+// A large graph with a read/write mutex per node: threads keep picking a
+// random node and read it, or one time in WRITE_PERIOD, update it.  Shows what
+// the per-node lock costs in memory, and in throughput once the lock is
+// small enough for many nodes to share a cache line.
+template <class TMutex>
+class GraphLockTest
+{
+private:
+    enum
+    {
+        NODE_COUNT = 100000,
+        WRITE_PERIOD = 10
+    };
+
+    struct Node
+    {
+        TMutex lock;
+        long value;
+    };
+
+public:
+    GraphLockTest(long numThreads)
+    {
+        m_numThreads = numThreads;
+        m_readCount = 0;
+        m_writeCount = 0;
+        m_readSum = 0;
+        m_pNodes = new Node[NODE_COUNT];
+        for (long i = 0; i < NODE_COUNT; i++)
+        {
+            m_pNodes[i].value = 0;
+        }
+    }
+    ~GraphLockTest()
+    {
+        delete[] m_pNodes;
+    }
+
+    static size_t NodeSize()
+    {
+        return sizeof(Node);
+    }
+
+    Stats Execute()
+    {
+        m_runner.Start(m_numThreads, this, &GraphLockTest::Thread);
+
+        Stats stats;
+        stats.durationSeconds = m_runner.Run();
+        stats.readsPerSecond = m_readCount / stats.durationSeconds;
+        stats.writesPerSecond = m_writeCount / stats.durationSeconds;
+        stats.totalPerSecond = stats.readsPerSecond + stats.writesPerSecond;
+        stats.numThreads = m_numThreads;
+        return stats;
+    }
+
+private:
+    void Thread()
+    {
+        // xorshift, seeded per thread
+        unsigned long random = GetCurrentThreadId() * 2654435769UL + 1;
+        __int64 reads = 0;
+        __int64 writes = 0;
+        __int64 sum = 0;
+        for (long i = 0; !m_runner.Done(); i++)
+        {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            Node& node = m_pNodes[random % NODE_COUNT];
+            if (i % WRITE_PERIOD == 0)
+            {
+                TMutex::ScopedWriteLock lk(node.lock);
+                node.value += 1;
+                writes += 1;
+            }
+            else
+            {
+                TMutex::ScopedReadLock lk(node.lock);
+                sum += node.value;
+                reads += 1;
+            }
+        }
+        m_runner.Add(m_readCount, reads);
+        m_runner.Add(m_writeCount, writes);
+        // keep the reads from being optimized away
+        m_runner.Add(m_readSum, sum);
+    }
+
+private:
+    Node* m_pNodes;
+    ThreadRunner m_runner;
+
+    long m_numThreads;
+
+    __int64 m_readCount;
+    __int64 m_writeCount;
+    __int64 m_readSum;
+};
+
+// Bytes per graph node, and operations/sec, with a one-word parking-lot
+// mutex per node against the other locks small enough to embed in every node.
+// (The TLS-based mutexes can't be: each one takes a TLS index.)
+void TestParkingLot(const long numThreads)
+{
+    printf("\nper-node locks, numThreads = %d\n", numThreads);
+    printf("name                ,node bytes,         ops/s\n");
+    printf("%-20s,%10d,%14.1f\n", "ParkingLot", (int)GraphLockTest<ParkingLotReadWriteMutex>::NodeSize(),
+        GraphLockTest<ParkingLotReadWriteMutex>(numThreads).Execute().totalPerSecond);
+    printf("%-20s,%10d,%14.1f\n", "SlimReadWriteLock", (int)GraphLockTest<SlimReadWriteLock>::NodeSize(),
+        GraphLockTest<SlimReadWriteLock>(numThreads).Execute().totalPerSecond);
+    printf("%-20s,%10d,%14.1f\n", "WinFutexRw", (int)GraphLockTest<WinFutexRwC>::NodeSize(),
+        GraphLockTest<WinFutexRwC>(numThreads).Execute().totalPerSecond);
+    printf("%-20s,%10d,%14.1f\n", "CriticalSection", (int)GraphLockTest<CriticalSection>::NodeSize(),
+        GraphLockTest<CriticalSection>(numThreads).Execute().totalPerSecond);
+    printf("\n");
+}
+
+// Pins numReadersPerNode reader threads to each NUMA node.  Readers on the
+// first activeNodeCount nodes keep taking the read lock; the rest register
+// once and then idle.  A writer pinned to node 0 keeps taking the write lock,
+// and the mutex's scan statistics show how much of the registry, and how much
+// of it remote, each write acquisition had to touch.
+class NumaRegistryTest
+{
+public:
+    NumaRegistryTest(long numReadersPerNode, DWORD activeNodeCount)
+    {
+        m_registeredCount = 0;
+        m_writeCount = 0;
+        m_numReadersPerNode = numReadersPerNode;
+        m_activeNodeCount = activeNodeCount;
+    }
+
+    void Execute()
+    {
+        const DWORD nodeCount = m_numa.NodeCount();
+        const long numReaders = (long)nodeCount * m_numReadersPerNode;
+        for (long i = 0; i < numReaders; i++)
+        {
+            m_runner.StartUngated(1, ReaderBody(this, (DWORD)i % nodeCount));
+        }
+        while (m_registeredCount < numReaders)
+        {
+            Sleep(1);
+        }
+        m_runner.StartUngated(1, this, &NumaRegistryTest::WriterThread, 0x20000);
+        const double durationSeconds = m_runner.Run();
+
+        const NumaScanStats stats = m_mutex.GetScanStats();
+        const double writes = stats.writes ? (double)stats.writes : 1.0;
+        printf("nodes = %d, readers/node = %d, active nodes = %d\n", nodeCount, m_numReadersPerNode, m_activeNodeCount);
+        printf("writesPerSecond                   = %13.1f\n", m_writeCount / durationSeconds);
+        printf("nodes scanned per write           = %13.3f\n", stats.nodesScanned / writes);
+        printf("nodes skipped per write           = %13.3f\n", stats.nodesSkipped / writes);
+        printf("remote TlsData read per write     = %13.3f\n", stats.remoteRecordsScanned / writes);
+        printf("  (flat registry would read       = %13d)\n", m_numReadersPerNode * (nodeCount - 1));
+        printf("\n");
+    }
+
+private:
+    // A reader pinned to one node.
+    class ReaderBody
+    {
+        NumaRegistryTest* m_pTest;
+        DWORD m_node;
+
+    public:
+        ReaderBody(NumaRegistryTest* pTest, DWORD node)
+            : m_pTest(pTest)
+            , m_node(node)
+        {
+        }
+        void operator()()
+        {
+            m_pTest->ReaderThread(m_node);
+        }
+    };
+
+    void ReaderThread(DWORD node)
+    {
+        NumaNodeMap::PinCurrentThreadToNode(node);
+        {
+            NumaReadWriteMutex<>::ScopedReadLock lk(m_mutex);
+        }
+        _InterlockedIncrement(&m_registeredCount);
+        m_runner.WaitForRelease();
+
+        if (node < m_activeNodeCount)
+        {
+            while (!m_runner.Done())
+            {
+                NumaReadWriteMutex<>::ScopedReadLock lk(m_mutex);
+            }
+        }
+    }
+
+    void WriterThread()
+    {
+        NumaNodeMap::PinCurrentThreadToNode(0);
+        m_runner.WaitForRelease();
+        while (!m_runner.Done())
+        {
+            NumaReadWriteMutex<>::ScopedWriteLock lk(m_mutex);
+            m_writeCount += 1;
+        }
+    }
+
+private:
+    NumaReadWriteMutex<> m_mutex;
+    NumaNodeMap m_numa;
+    ThreadRunner m_runner;
+
+    volatile long m_registeredCount;
+    long m_writeCount;
+
+    long m_numReadersPerNode;
+    DWORD m_activeNodeCount;
+};
+
+// Writer scan cost of the per-node registry, as readers go from idle on all
+// nodes to active on all nodes.
+void TestNumaRegistry()
+{
+    NumaNodeMap numa;
+    for (DWORD activeNodeCount = 0; activeNodeCount <= numa.NodeCount(); activeNodeCount++)
+    {
+        NumaRegistryTest test(8, activeNodeCount);
+        test.Execute();
+    }
+}
+
+// Reads/sec and writes/sec of UltraFast with each writer lock, as the number of
+// writers grows; this is where the writer arbiter's handoff cost shows.
+void TestWriterArbiter(const long numReaders)
+{
+    std::vector<Stats> cs;
+    std::vector<Stats> mcs;
+    std::vector<Stats> clh;
+    for (long numWriters = 1; numWriters <= 12; numWriters++)
+    {
+        {
+            Test<UltraFastReadWriteMutex<CriticalSection> > test(numReaders, numWriters, "UltraFast<CriticalSection>");
+            cs.push_back(test.Execute());
+        }
+        {
+            Test<UltraFastReadWriteMutex<McsLock> > test(numReaders, numWriters, "UltraFast<McsLock>");
+            mcs.push_back(test.Execute());
+        }
+        {
+            Test<UltraFastReadWriteMutex<ClhLock> > test(numReaders, numWriters, "UltraFast<ClhLock>");
+            clh.push_back(test.Execute());
+        }
+    }
+
+    printf("\nwriter arbiter, numReaders = %d\n", numReaders);
+    printf("numWriters,        CS wps,       MCS wps,       CLH wps,        CS rps,       MCS rps,       CLH rps\n");
+    for (size_t u = 0; u < cs.size(); u++)
+    {
+        printf("%10d,%14.1f,%14.1f,%14.1f,%14.1f,%14.1f,%14.1f\n",
+            cs[u].numThreads - numReaders,
+            cs[u].writesPerSecond,
+            mcs[u].writesPerSecond,
+            clh[u].writesPerSecond,
+            cs[u].readsPerSecond,
+            mcs[u].readsPerSecond,
+            clh[u].readsPerSecond);
+    }
+    printf("\n");
+}
+
+int main()
+{
+    {
+        const char* pName = "warmup";
+        Test<UltraSpinReadWriteMutex<> > test_warmup(1, 0, pName);
+        test_warmup.Execute();
+    }
+
+    //TestUltraSingleReadWriteMutex();
+    //return 0;
+
+    //TestAsymmetricFence(0);
+    //TestAsymmetricFence(1);
+    //return 0;
+
+    //TestWriterLatency();
+    //return 0;
+
+    //TestQtCounting(4);
+    //return 0;
+
+    //TestWaitPolicy(1);
+    //TestWaitPolicy(4);
+    //return 0;
+
+    //TestReaderScaling(0);
+    //TestReaderScaling(1);
+    //return 0;
+
+    //TestReaderCounter(0);
+    //TestReaderCounter(1);
+    //return 0;
+
+    //TestWinFutexRw(0);
+    //TestWinFutexRw(1);
+    //return 0;
+
+    //TestParkingLot(4);
+    //return 0;
+
+    //TestNumaRegistry();
+    //return 0;
+
+    //TestWriterArbiter(0);
+    //TestWriterArbiter(4);
+    //return 0;
+
+    //TestPayloadCopy(1);
+    //TestPayloadCopy(4);
+    //return 0;
+
+    //TestOptimisticRead(4);
+    //return 0;
+
+    //TestUpgrade(4);
+    //return 0;
+
+    //TestNestedRead(4);
+    //return 0;
+
+    //TestFlatCombining(4);
+    //return 0;
+
+    //TestRcu(8);
+    //return 0;
+
+    //TestLeftRight(4);
+    //return 0;
+
+    //TestTimedLock(4);
+    //return 0;
+
+    //TestFutexSemaphore(4);
     //return 0;
 
     const int readerTrials = 12;
@@ -35,6 +35,25 @@ public:
         WriteUnlock();
     }
 
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        // an abandoned mutex is still ours; WAIT_FAILED is not
+        const DWORD result = WaitForSingleObject(m_hMutex, milliseconds);
+        return result == WAIT_OBJECT_0 || result == WAIT_ABANDONED;
+    }
+    bool TryReadLock()
+    {
+        return TryWriteLock();
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        return WriteLockFor(milliseconds);
+    }
+
     typedef ScopedWriteLock<Mutex> ScopedWriteLock;
     typedef ScopedReadLock<Mutex> ScopedReadLock;
 };
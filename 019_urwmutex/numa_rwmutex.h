@@ -0,0 +1,319 @@
+#pragma once
+
+#include <new>
+#include "common.h"
+#include "scoped_locks.h"
+#include "critical_section.h"
+#include "fences.h"
+#include "wait_policy.h"
+#include "processor_topology.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
+
+/// Counters kept by NumaReadWriteMutex's writers; see GetScanStats().
+struct NumaScanStats
+{
+    __int64 writes;
+    __int64 nodesScanned;
+    __int64 nodesSkipped;
+    // TlsData on a different node than the writer, that the writer had to read
+    __int64 remoteRecordsScanned;
+};
+
+/// This is UltraFutexReadWriteMutex with the reader registry split per NUMA node.
+/// - Each node has its own list of TlsData, allocated in memory local to that
+///   node (the node a thread registers on).
+/// - Each node also has an anyReaders summary word.  Readers set it when they
+///   find it clear; the writer clears it when it scans the node.  A writer that
+///   finds a node's summary clear skips that node's threads entirely, so
+///   nodes that have been idle since the previous writer cost it one remote
+///   cache line instead of one per registered thread.
+/// - The summary is "sticky": in a read-mostly phase it stays set, so readers
+///   only ever load it and its line stays shared between the node's cores.
+/// - Unlike UltraFutex, the summary handshake needs store->load fences, which
+///   TFence supplies (see fences.h).  The reader pays the second fence only
+///   when it has to set the summary.
+/// - Waits and wakes go through TWaitPolicy, as in UltraFutexReadWriteMutex.
+template <class TFence = SymmetricFence, class TMutex = CriticalSection, class TWaitPolicy = ParkWait>
+class NumaReadWriteMutex
+{
+private: // types
+    struct Node;
+
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
+    {
+        Node* pNode;
+        volatile long isReading;
+        // nesting depth of this thread's read locks; only touched by the owning thread
+        long readDepth;
+
+        TlsData()
+            : pNode(NULL)
+            , isReading(0)
+            , readDepth(0)
+        {
+        }
+    };
+    typedef std::vector<TlsData*> ThreadStates;
+    typedef TMutex Mutex_t;
+
+    // One per NUMA node, allocated on that node.
+    struct Node
+    {
+        // treated as an atomic bool
+        volatile long anyReaders;
+        volatile char pad0[CACHE_LINE_SIZE - 4];
+        DWORD index;
+        // the threads that registered on this node; spares are recycled by
+        // newly arriving threads on the same node
+        ThreadRegistry<TlsData> registry;
+        // set by the writer while it holds m_cs: whether to scan this node
+        bool scan;
+    };
+
+private: // members
+    // treated as an atomic bool; also the futex that blocked readers sleep on
+    volatile long m_writeRequested;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+
+    DWORD m_tlsIndex;
+    NumaNodeMap m_numa;
+    std::vector<Node*> m_nodes;
+
+    // This critical section enforces the following
+    // - mutual exclusion of writers from each other
+    // - protects the nodes' registries
+    Mutex_t m_cs;
+    // how waiters wait on the futex words
+    TWaitPolicy m_waitPolicy;
+    NumaScanStats m_stats;
+
+private:
+    static Node* newNode(DWORD index)
+    {
+        const SIZE_T size = (sizeof(Node) + 0xFFF) & ~(SIZE_T)0xFFF;
+        void* p = VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, index);
+        if (p == NULL)
+        {
+            // e.g. a node number with no memory behind it
+            p = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        }
+        assert(p != NULL);
+        Node* pNode = new (p) Node();
+        pNode->anyReaders = 0;
+        memset((void*)pNode->pad0, 0, sizeof(pNode->pad0));
+        pNode->index = index;
+        pNode->scan = false;
+        return pNode;
+    }
+
+    static void deleteNode(Node* pNode)
+    {
+        pNode->~Node();
+        VirtualFree(pNode, 0, MEM_RELEASE);
+    }
+
+    TlsData* initTlsData()
+    {
+        DWORD nodeIndex = NumaNodeMap::CurrentNodeIndex();
+        if (nodeIndex >= m_nodes.size())
+        {
+            nodeIndex = 0;
+        }
+        Node* pNode = m_nodes[nodeIndex];
+
+        TlsData* pTlsData = NULL;
+        {
+            typename Mutex_t::ScopedWriteLock lk(m_cs);
+            compactThreadStates();
+            // CacheLineSlab allocates on the calling thread's node
+            pTlsData = pNode->registry.Add();
+            pTlsData->pNode = pNode;
+        }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        pNode->registry.HookThreadExit(pTlsData);
+        return pTlsData;
+    }
+
+    TlsData* getTlsData()
+    {
+        TlsData* pTlsData = (TlsData*)InlineTlsGetValue(m_tlsIndex);
+        if (pTlsData == NULL)
+        {
+            pTlsData = initTlsData();
+        }
+        return pTlsData;
+    }
+
+    // Removes exited threads' TlsData from their node's registry.
+    // Must be called with m_cs held.
+    void compactThreadStates()
+    {
+        for (size_t u = 0; u < m_nodes.size(); u++)
+        {
+            m_nodes[u]->registry.Compact();
+        }
+    }
+
+    void readLock(TlsData* pTlsData)
+    {
+        if (pTlsData->readDepth++ != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return;
+        }
+        Node* pNode = pTlsData->pNode;
+        for (;;)
+        {
+            pTlsData->isReading = 1;
+            TFence::ReaderFence();
+            if (!pNode->anyReaders)
+            {
+                pNode->anyReaders = 1;
+                TFence::ReaderFence();
+            }
+            if (!m_writeRequested)
+            {
+                return;
+            }
+            pTlsData->isReading = 0;
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
+            // wait until writer finishes
+            m_waitPolicy.Wait(&m_writeRequested, 1L);
+        }
+    }
+
+    void readUnlock(TlsData* pTlsData)
+    {
+        assert(pTlsData->readDepth > 0);
+        if (--pTlsData->readDepth != 0)
+        {
+            return;
+        }
+        pTlsData->isReading = 0;
+        if (m_writeRequested)
+        {
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
+        }
+    }
+
+public:
+    NumaReadWriteMutex()
+        : m_writeRequested(0)
+        , m_tlsIndex(TLS_OUT_OF_INDEXES)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+        memset(&m_stats, 0, sizeof(m_stats));
+
+        for (DWORD index = 0; index < m_numa.NodeCount(); index++)
+        {
+            m_nodes.push_back(newNode(index));
+        }
+
+        m_tlsIndex = TlsAlloc();
+        assert(m_tlsIndex != TLS_OUT_OF_INDEXES);
+    }
+    ~NumaReadWriteMutex()
+    {
+        for (typename std::vector<Node*>::iterator iter = m_nodes.begin(),
+                                                    end = m_nodes.end();
+             iter != end;
+             ++iter)
+        {
+            deleteNode(*iter);
+        }
+        TlsFree(m_tlsIndex);
+    }
+
+    void WriteLock()
+    {
+        m_cs.WriteLock();
+        compactThreadStates();
+        m_writeRequested = 1;
+        TFence::WriterFence();
+
+        // Claim every busy node's summary first, so one fence covers them all.
+        // A reader that sets a summary after this will see m_writeRequested.
+        for (size_t u = 0; u < m_nodes.size(); u++)
+        {
+            Node* pNode = m_nodes[u];
+            pNode->scan = (pNode->anyReaders != 0);
+            if (pNode->scan)
+            {
+                pNode->anyReaders = 0;
+            }
+        }
+        TFence::WriterFence();
+
+        const DWORD writerNode = NumaNodeMap::CurrentNodeIndex();
+        for (size_t u = 0; u < m_nodes.size(); u++)
+        {
+            Node* pNode = m_nodes[u];
+            if (!pNode->scan)
+            {
+                m_stats.nodesSkipped += 1;
+                continue;
+            }
+            m_stats.nodesScanned += 1;
+            if (pNode->index != writerNode)
+            {
+                m_stats.remoteRecordsScanned += pNode->registry.Threads().size();
+            }
+            for (typename ThreadStates::const_iterator iter = pNode->registry.Threads().begin(),
+                                                        end = pNode->registry.Threads().end();
+                 iter != end;
+                 ++iter)
+            {
+                TlsData* pTlsData = *iter;
+                while (pTlsData->isReading)
+                {
+                    m_waitPolicy.Wait(&pTlsData->isReading, 1L);
+                }
+            }
+        }
+        m_stats.writes += 1;
+    }
+    void WriteUnlock()
+    {
+        m_writeRequested = 0;
+        m_waitPolicy.WakeAll(&m_writeRequested);
+        m_cs.WriteUnlock();
+    }
+    void ReadLock()
+    {
+        TlsData* pTlsData = getTlsData();
+        readLock(pTlsData);
+    }
+    void ReadUnlock()
+    {
+        TlsData* pTlsData = getTlsData();
+        readUnlock(pTlsData);
+    }
+
+    /// Totals over all write acquisitions so far.
+    NumaScanStats GetScanStats()
+    {
+        typename Mutex_t::ScopedWriteLock lk(m_cs);
+        return m_stats;
+    }
+
+    typedef ScopedWriteLock<NumaReadWriteMutex<TFence, TMutex, TWaitPolicy> > ScopedWriteLock;
+
+    class ScopedReadLock
+    {
+        NumaReadWriteMutex& m_mutex;
+        TlsData* m_pTlsData;
+
+    public:
+        ScopedReadLock(NumaReadWriteMutex& mutex)
+            : m_mutex(mutex)
+        {
+            m_pTlsData = m_mutex.getTlsData();
+            m_mutex.readLock(m_pTlsData);
+        }
+        ~ScopedReadLock()
+        {
+            m_mutex.readUnlock(m_pTlsData);
+        }
+    };
+};
@@ -0,0 +1,283 @@
+#pragma once
+
+#include "common.h"
+#include "futex.h"
+#include "timeout.h"
+
+/// A process-wide parking lot, in the style of WebKit's WTF::ParkingLot: a
+/// fixed hash table of wait queues keyed by address.
+/// - Any lock can park threads on the address of its own word and unpark them
+///   later, so the lock itself needs no kernel object, no TLS index and no
+///   queue; it can be as small as one word.  ParkingLotReadWriteMutex is one.
+/// - A parked thread sleeps on a word in its own stack frame, with
+///   FutexWait(), so parking doesn't need a kernel object either.
+/// - ParkConditionally() checks the caller's condition under the bucket lock
+///   before enqueueing, and UnparkOne() runs the caller's callback under the
+///   same lock, knowing whether threads are still parked on the address.  That
+///   is what lets a lock keep an accurate "has parked threads" bit without a
+///   lost wakeup.
+/// - Queues are FIFO per address.  Addresses that hash to the same bucket
+///   share its lock and its list, but are otherwise independent.
+/// - The table has a fixed BUCKET_COUNT buckets, rather than growing with the
+///   number of parked threads like WebKit's.
+///
+/// It's a template only so that the statics can live in this header.
+template <int TDummy>
+class ParkingLotT
+{
+public: // types
+    struct UnparkResult
+    {
+        bool didUnparkThread;
+        bool mayHaveMoreThreads;
+    };
+
+    /// Called under the bucket lock; returns whether to go ahead and park.
+    typedef bool (*Validate)(void* pContext);
+    /// Called under the bucket lock, after the thread (if any) was dequeued.
+    typedef void (*UnparkCallback)(const UnparkResult& result, void* pContext);
+
+private: // types
+    enum
+    {
+        BUCKET_COUNT = 256,
+        // 32 - log2(BUCKET_COUNT)
+        BUCKET_SHIFT = 24
+    };
+
+    struct ParkedThread
+    {
+        const volatile void* pAddress;
+        ParkedThread* pNext;
+        // set by the unparker, as its last access to this record
+        volatile long unparked;
+    };
+
+    struct Bucket
+    {
+        SRWLOCK lock;
+        ParkedThread* pHead;
+        ParkedThread* pTail;
+        char pad[CACHE_LINE_SIZE - (sizeof(SRWLOCK) + 2 * sizeof(void*)) % CACHE_LINE_SIZE];
+    };
+
+    struct EqualContext
+    {
+        volatile long* pWord;
+        long expected;
+    };
+
+private: // members
+    // zero-initialized, which is SRWLOCK_INIT and empty queues
+    static Bucket s_buckets[BUCKET_COUNT];
+
+private: // methods
+    static Bucket& bucketFor(const volatile void* pAddress)
+    {
+        // Fibonacci hashing; the low bits of an aligned address are all zero
+        const unsigned long hash = (unsigned long)((size_t)pAddress >> 2) * 2654435769UL;
+        return s_buckets[(hash & 0xffffffffUL) >> BUCKET_SHIFT];
+    }
+
+    static void enqueue(Bucket& bucket, ParkedThread* pThread)
+    {
+        if (bucket.pTail)
+        {
+            bucket.pTail->pNext = pThread;
+        }
+        else
+        {
+            bucket.pHead = pThread;
+        }
+        bucket.pTail = pThread;
+    }
+
+    // Unlinks pThread, given its predecessor.
+    static void unlink(Bucket& bucket, ParkedThread* pPrev, ParkedThread* pThread)
+    {
+        if (pPrev)
+        {
+            pPrev->pNext = pThread->pNext;
+        }
+        else
+        {
+            bucket.pHead = pThread->pNext;
+        }
+        if (bucket.pTail == pThread)
+        {
+            bucket.pTail = pPrev;
+        }
+        pThread->pNext = NULL;
+    }
+
+    // Returns whether pThread was still queued.
+    static bool remove(Bucket& bucket, ParkedThread* pThread)
+    {
+        ParkedThread* pPrev = NULL;
+        for (ParkedThread* pCur = bucket.pHead; pCur; pPrev = pCur, pCur = pCur->pNext)
+        {
+            if (pCur == pThread)
+            {
+                unlink(bucket, pPrev, pCur);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void wake(ParkedThread* pThread)
+    {
+        // pThread lives on the parked thread's stack, and may be gone as soon
+        // as unparked is set; waking an address that's been reused is harmless.
+        volatile long* pUnparked = &pThread->unparked;
+        *pUnparked = 1;
+        FutexWakeOne(pUnparked);
+    }
+
+    static bool isEqual(void* pContext)
+    {
+        EqualContext* pEqual = (EqualContext*)pContext;
+        return *pEqual->pWord == pEqual->expected;
+    }
+
+public: // interface
+    /// Parks the calling thread on pAddress if pValidate(pContext) returns
+    /// true, until another thread unparks it or the timeout runs out.
+    /// Returns whether it was unparked; false if validation failed or it
+    /// timed out.
+    static bool ParkConditionally(const volatile void* pAddress, Validate pValidate, void* pContext, DWORD milliseconds = INFINITE)
+    {
+        ParkedThread me;
+        me.pAddress = pAddress;
+        me.pNext = NULL;
+        me.unparked = 0;
+
+        Bucket& bucket = bucketFor(pAddress);
+        AcquireSRWLockExclusive(&bucket.lock);
+        if (!pValidate(pContext))
+        {
+            ReleaseSRWLockExclusive(&bucket.lock);
+            return false;
+        }
+        enqueue(bucket, &me);
+        ReleaseSRWLockExclusive(&bucket.lock);
+
+        Timeout timeout(milliseconds);
+        while (!me.unparked)
+        {
+            if (!FutexWaitFor(&me.unparked, 0L, timeout.Remaining()) && !me.unparked)
+            {
+                AcquireSRWLockExclusive(&bucket.lock);
+                const bool removed = remove(bucket, &me);
+                ReleaseSRWLockExclusive(&bucket.lock);
+                if (removed)
+                {
+                    return false;
+                }
+                // an unparker already dequeued us; wait until it's done with me
+                while (!me.unparked)
+                {
+                    FutexWait(&me.unparked, 0L);
+                }
+            }
+        }
+        return true;
+    }
+
+    /// Parks on pWord while *pWord == expected, like FutexWait().
+    static bool ParkIfEqual(volatile long* pWord, long expected, DWORD milliseconds = INFINITE)
+    {
+        return ParkIfEqual(pWord, pWord, expected, milliseconds);
+    }
+    /// Parks on pAddress while *pWord == expected.  pAddress is only a key; it
+    /// lets one word keep several queues, e.g. at its address and its address + 1.
+    static bool ParkIfEqual(const volatile void* pAddress, volatile long* pWord, long expected, DWORD milliseconds = INFINITE)
+    {
+        EqualContext context;
+        context.pWord = pWord;
+        context.expected = expected;
+        return ParkConditionally(pAddress, &isEqual, &context, milliseconds);
+    }
+
+    /// Unparks the longest-parked thread on pAddress, if any.  pCallback,
+    /// if given, runs under the bucket lock before that thread wakes.
+    static void UnparkOne(const volatile void* pAddress, UnparkCallback pCallback = NULL, void* pContext = NULL)
+    {
+        Bucket& bucket = bucketFor(pAddress);
+        AcquireSRWLockExclusive(&bucket.lock);
+        ParkedThread* pThread = NULL;
+        ParkedThread* pPrev = NULL;
+        for (ParkedThread* pCur = bucket.pHead; pCur; pPrev = pCur, pCur = pCur->pNext)
+        {
+            if (pCur->pAddress == pAddress)
+            {
+                pThread = pCur;
+                break;
+            }
+        }
+        UnparkResult result;
+        result.didUnparkThread = pThread != NULL;
+        result.mayHaveMoreThreads = false;
+        if (pThread)
+        {
+            for (ParkedThread* pCur = pThread->pNext; pCur; pCur = pCur->pNext)
+            {
+                if (pCur->pAddress == pAddress)
+                {
+                    result.mayHaveMoreThreads = true;
+                    break;
+                }
+            }
+            unlink(bucket, pPrev, pThread);
+        }
+        if (pCallback)
+        {
+            pCallback(result, pContext);
+        }
+        ReleaseSRWLockExclusive(&bucket.lock);
+        if (pThread)
+        {
+            wake(pThread);
+        }
+    }
+
+    /// Unparks every thread parked on pAddress.  Returns how many there were.
+    static long UnparkAll(const volatile void* pAddress)
+    {
+        Bucket& bucket = bucketFor(pAddress);
+        ParkedThread* pWoken = NULL;
+        AcquireSRWLockExclusive(&bucket.lock);
+        ParkedThread* pPrev = NULL;
+        for (ParkedThread* pCur = bucket.pHead; pCur; )
+        {
+            ParkedThread* pNext = pCur->pNext;
+            if (pCur->pAddress == pAddress)
+            {
+                unlink(bucket, pPrev, pCur);
+                pCur->pNext = pWoken;
+                pWoken = pCur;
+            }
+            else
+            {
+                pPrev = pCur;
+            }
+            pCur = pNext;
+        }
+        ReleaseSRWLockExclusive(&bucket.lock);
+
+        long count = 0;
+        while (pWoken)
+        {
+            ParkedThread* pNext = pWoken->pNext;
+            wake(pWoken);
+            pWoken = pNext;
+            count += 1;
+        }
+        return count;
+    }
+};
+
+template <int TDummy>
+typename ParkingLotT<TDummy>::Bucket ParkingLotT<TDummy>::s_buckets[ParkingLotT<TDummy>::BUCKET_COUNT];
+
+typedef ParkingLotT<0> ParkingLot;
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "common.h"
+#include "scoped_locks.h"
+#include "parking_lot.h"
+
+/// A read-write mutex that is one 32-bit word, for per-object locks in large
+/// in-memory graphs.  Everything else it needs lives in the ParkingLot.
+/// - m_state holds the reader count, a WRITER bit, and one "may have parked
+///   threads" bit each for readers and writers.  Readers park on &m_state,
+///   and writers on &m_state + 1, which is only used as a key.
+/// - Writers take priority: new readers wait while a writer holds the lock or
+///   has parked, and a writer releasing the lock hands it to a parked writer
+///   before it wakes the parked readers.  So read locks don't nest.
+/// - Both sides spin SPIN_COUNT times before parking, which covers short
+///   holds without a trip through the parking lot.
+/// - UnparkOne()'s callback clears WRITERS_PARKED, under the bucket lock,
+///   when the last parked writer leaves; a writer about to park validates
+///   m_state under the same lock, so it can't miss that.
+class ParkingLotReadWriteMutex
+{
+private: // types
+    enum
+    {
+        WRITER = 1,
+        WRITERS_PARKED = 2,
+        READERS_PARKED = 4,
+        READER = 8,
+        SPIN_COUNT = 40
+    };
+
+    struct WriterUnparkContext
+    {
+        volatile long* pState;
+        bool didUnparkThread;
+    };
+
+private: // members
+    volatile long m_state;
+
+private: // methods
+    static long readerCount(long state)
+    {
+        return state / READER;
+    }
+
+    const volatile void* writerAddress()
+    {
+        return (const volatile char*)&m_state + 1;
+    }
+
+    static void onWriterUnparked(const ParkingLot::UnparkResult& result, void* pContext)
+    {
+        WriterUnparkContext* pUnpark = (WriterUnparkContext*)pContext;
+        pUnpark->didUnparkThread = result.didUnparkThread;
+        if (!result.mayHaveMoreThreads)
+        {
+            _InterlockedAnd(pUnpark->pState, ~(long)WRITERS_PARKED);
+        }
+    }
+
+    // Returns whether a parked writer was woken.
+    bool unparkWriter()
+    {
+        WriterUnparkContext context;
+        context.pState = &m_state;
+        context.didUnparkThread = false;
+        ParkingLot::UnparkOne(writerAddress(), &onWriterUnparked, &context);
+        return context.didUnparkThread;
+    }
+
+    void unparkReaders()
+    {
+        for (;;)
+        {
+            const long state = m_state;
+            if (!(state & READERS_PARKED))
+            {
+                return;
+            }
+            if (_InterlockedCompareExchange(&m_state, state & ~(long)READERS_PARKED, state) == state)
+            {
+                ParkingLot::UnparkAll(&m_state);
+                return;
+            }
+        }
+    }
+
+public:
+    ParkingLotReadWriteMutex()
+        : m_state(0)
+    {
+    }
+
+    void WriteLock()
+    {
+        for (long spin = 0; ; )
+        {
+            const long state = m_state;
+            if (!(state & WRITER) && readerCount(state) == 0)
+            {
+                // keeps WRITERS_PARKED, for whoever else is still parked
+                if (_InterlockedCompareExchange(&m_state, state | WRITER, state) == state)
+                {
+                    return;
+                }
+                continue;
+            }
+            if (spin < SPIN_COUNT)
+            {
+                spin++;
+                YieldProcessor();
+                continue;
+            }
+            if (!(state & WRITERS_PARKED) &&
+                _InterlockedCompareExchange(&m_state, state | WRITERS_PARKED, state) != state)
+            {
+                continue;
+            }
+            ParkingLot::ParkIfEqual(writerAddress(), &m_state, state | WRITERS_PARKED);
+        }
+    }
+    void WriteUnlock()
+    {
+        const long state = _InterlockedExchangeAdd(&m_state, -WRITER);
+        assert(state & WRITER);
+        if ((state & WRITERS_PARKED) && unparkWriter())
+        {
+            return;
+        }
+        unparkReaders();
+    }
+
+    void ReadLock()
+    {
+        for (long spin = 0; ; )
+        {
+            const long state = m_state;
+            if (!(state & (WRITER | WRITERS_PARKED)))
+            {
+                if (_InterlockedCompareExchange(&m_state, state + READER, state) == state)
+                {
+                    return;
+                }
+                continue;
+            }
+            if (spin < SPIN_COUNT)
+            {
+                spin++;
+                YieldProcessor();
+                continue;
+            }
+            if (!(state & READERS_PARKED) &&
+                _InterlockedCompareExchange(&m_state, state | READERS_PARKED, state) != state)
+            {
+                continue;
+            }
+            ParkingLot::ParkIfEqual(&m_state, &m_state, state | READERS_PARKED);
+        }
+    }
+    void ReadUnlock()
+    {
+        const long state = _InterlockedExchangeAdd(&m_state, -READER) - READER;
+        assert(readerCount(state) >= 0);
+        if (readerCount(state) == 0 && (state & WRITERS_PARKED))
+        {
+            // The writer that set WRITERS_PARKED may not have parked yet; if
+            // not, it will fail validation, and the readers parked behind it
+            // must not be left waiting for a writer that isn't there.
+            if (!unparkWriter())
+            {
+                unparkReaders();
+            }
+        }
+    }
+
+    typedef ScopedWriteLock<ParkingLotReadWriteMutex> ScopedWriteLock;
+    typedef ScopedReadLock<ParkingLotReadWriteMutex> ScopedReadLock;
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <intrin.h>
+#include "common.h"
+#include "scoped_locks.h"
+#include "critical_section.h"
+#include "wait_policy.h"
+#include "timeout.h"
+#include "processor_topology.h"
+
+/// A read-write mutex whose reader indicator is an array of per-processor
+/// counters, rather than a per-thread isReading flag.
+/// - Readers increment the counter of the processor they arrive on, and
+///   decrement that same counter when they leave (even if they migrated in
+///   between), so each counter is exactly the number of readers inside that
+///   arrived on its processor.
+/// - The writer waits for a fixed array of ProcessorCount() padded counters to
+///   drain, so its cost is bounded by the machine size instead of by the number
+///   of threads that have ever touched the mutex.  There is no per-thread
+///   registration at all.
+/// - The reader pays one interlocked op on a line that is normally only
+///   touched by its own processor.  (On Linux this could be a plain
+///   increment inside an rseq critical section; Windows has no equivalent
+///   for user code, so the interlocked op is what guarantees correctness if
+///   the thread is preempted or migrated mid-increment.)
+/// - Writers take priority over readers, as in UltraFastReadWriteMutex.
+/// - Read locks nest: the thread's TLS value keeps its nesting depth next to
+///   the counter index, and only the outermost lock and unlock touch a counter.
+/// - Waits and wakes go through TWaitPolicy, as in UltraFutexReadWriteMutex.
+template <class TMutex = CriticalSection, class TWaitPolicy = ParkWait>
+class PerCpuReadWriteMutex
+{
+private: // types
+    struct Counter
+    {
+        volatile long count;
+        volatile char pad[CACHE_LINE_SIZE - 4];
+    };
+    typedef TMutex Mutex_t;
+
+    enum
+    {
+        // the TLS value is (depth << INDEX_BITS) | index
+        INDEX_BITS = 16,
+        DEPTH_UNIT = 1 << INDEX_BITS,
+        INDEX_MASK = DEPTH_UNIT - 1
+    };
+
+private: // members
+    // treated as an atomic bool; also the futex that blocked readers sleep on
+    volatile long m_writeRequested;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+
+    ProcessorIndexMap m_processors;
+    Counter* m_pCounters;
+
+    // Carries the counter index from the outermost read lock to its unlock,
+    // and this thread's read nesting depth; 0 outside a read section.
+    DWORD m_tlsIndex;
+
+    // mutual exclusion of writers from each other
+    Mutex_t m_cs;
+    // how waiters wait on the futex words
+    TWaitPolicy m_waitPolicy;
+
+private: // methods
+    DWORD readLock()
+    {
+        for (;;)
+        {
+            const DWORD index = m_processors.CurrentProcessorIndex();
+            Counter& counter = m_pCounters[index];
+            _InterlockedIncrement(&counter.count);
+            if (!m_writeRequested)
+            {
+                return index;
+            }
+            readUnlock(index);
+            // wait until writer finishes
+            m_waitPolicy.Wait(&m_writeRequested, 1L);
+        }
+    }
+
+    bool readLockFor(DWORD* pIndex, DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        for (;;)
+        {
+            const DWORD index = m_processors.CurrentProcessorIndex();
+            Counter& counter = m_pCounters[index];
+            _InterlockedIncrement(&counter.count);
+            if (!m_writeRequested)
+            {
+                *pIndex = index;
+                return true;
+            }
+            readUnlock(index);
+            // wait until writer finishes, or give up
+            if (!m_waitPolicy.WaitFor(&m_writeRequested, 1L, timeout.Remaining()) && m_writeRequested)
+            {
+                return false;
+            }
+        }
+    }
+
+    void readUnlock(DWORD index)
+    {
+        Counter& counter = m_pCounters[index];
+        const long count = _InterlockedDecrement(&counter.count);
+        if (count == 0 && m_writeRequested)
+        {
+            m_waitPolicy.WakeOne(&counter.count);
+        }
+    }
+
+    // The outermost read lock sets the thread's TLS value; nested ones only
+    // bump the depth in it.
+    void nestedReadLock()
+    {
+        const ULONG_PTR state = (ULONG_PTR)InlineTlsGetValue(m_tlsIndex);
+        if (state != 0)
+        {
+            TlsSetValue(m_tlsIndex, (void*)(state + DEPTH_UNIT));
+            return;
+        }
+        const DWORD index = readLock();
+        TlsSetValue(m_tlsIndex, (void*)(ULONG_PTR)(DEPTH_UNIT | index));
+    }
+
+    bool nestedReadLockFor(DWORD milliseconds)
+    {
+        const ULONG_PTR state = (ULONG_PTR)InlineTlsGetValue(m_tlsIndex);
+        if (state != 0)
+        {
+            TlsSetValue(m_tlsIndex, (void*)(state + DEPTH_UNIT));
+            return true;
+        }
+        DWORD index = 0;
+        if (!readLockFor(&index, milliseconds))
+        {
+            return false;
+        }
+        TlsSetValue(m_tlsIndex, (void*)(ULONG_PTR)(DEPTH_UNIT | index));
+        return true;
+    }
+
+    void nestedReadUnlock()
+    {
+        const ULONG_PTR state = (ULONG_PTR)InlineTlsGetValue(m_tlsIndex);
+        assert(state >= DEPTH_UNIT);
+        if (state >= 2 * DEPTH_UNIT)
+        {
+            TlsSetValue(m_tlsIndex, (void*)(state - DEPTH_UNIT));
+            return;
+        }
+        TlsSetValue(m_tlsIndex, NULL);
+        readUnlock((DWORD)(state & INDEX_MASK));
+    }
+
+    // Waits for all counters to drain; m_cs must already be held.  If the
+    // timeout runs out first, releases the write lock and returns false.
+    bool bootReadersFor(const Timeout& timeout)
+    {
+        m_writeRequested = 1;
+        MemoryBarrier();
+        const DWORD counterCount = m_processors.ProcessorCount();
+        for (DWORD index = 0; index < counterCount; index++)
+        {
+            Counter& counter = m_pCounters[index];
+            for (long count = counter.count; count != 0; count = counter.count)
+            {
+                if (!m_waitPolicy.WaitFor(&counter.count, count, timeout.Remaining()) && counter.count != 0)
+                {
+                    WriteUnlock();
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+public: // interface
+    PerCpuReadWriteMutex()
+        : m_writeRequested(0)
+        , m_pCounters(NULL)
+        , m_tlsIndex(TLS_OUT_OF_INDEXES)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+
+        const DWORD counterCount = m_processors.ProcessorCount();
+        assert(counterCount <= DEPTH_UNIT);
+        m_pCounters = (Counter*)_aligned_malloc(counterCount * sizeof(Counter), CACHE_LINE_SIZE);
+        assert(m_pCounters != NULL);
+        memset(m_pCounters, 0, counterCount * sizeof(Counter));
+
+        m_tlsIndex = TlsAlloc();
+        assert(m_tlsIndex != TLS_OUT_OF_INDEXES);
+    }
+    ~PerCpuReadWriteMutex()
+    {
+        TlsFree(m_tlsIndex);
+        _aligned_free(m_pCounters);
+    }
+
+    void WriteLock()
+    {
+        m_cs.WriteLock();
+        bootReadersFor(Timeout(INFINITE));
+    }
+    void WriteUnlock()
+    {
+        m_writeRequested = 0;
+        m_waitPolicy.WakeAll(&m_writeRequested);
+        m_cs.WriteUnlock();
+    }
+    void ReadLock()
+    {
+        nestedReadLock();
+    }
+    void ReadUnlock()
+    {
+        nestedReadUnlock();
+    }
+
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out lets back in the readers it had blocked.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_cs.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        return bootReadersFor(timeout);
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        return nestedReadLockFor(milliseconds);
+    }
+
+    typedef ScopedWriteLock<PerCpuReadWriteMutex<TMutex, TWaitPolicy> > ScopedWriteLock;
+    // through ReadLock(), so that a nested lock sees the depth in TLS
+    typedef ScopedReadLock<PerCpuReadWriteMutex<TMutex, TWaitPolicy> > ScopedReadLock;
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <intrin.h>
+#include "common.h"
+#include "scoped_locks.h"
+#include "wait_policy.h"
+#include "timeout.h"
+
+/// Phase-fair ticket lock, after Brandenburg & Anderson, "Reader-Writer
+/// Synchronization for Shared-Memory Multiprocessor Real-Time Systems" (PF-T).
+/// - Reader and writer phases alternate: a writer waits for at most one reader
+///   phase, and a reader waits for at most one writer phase.  So worst-case
+///   acquisition is bounded on both sides, unlike reader- or writer-preferring
+///   locks, and readers still run concurrently, unlike a FIFO lock.
+/// - Writers are FIFO among themselves, via the win/wout ticket pair.
+/// - Readers count themselves in and out in the upper bits of rin/rout.
+///   The low bits of rin tell arriving readers whether a writer is present,
+///   and which writer phase it is, so readers that arrived during one writer
+///   phase are all let go when it ends, even if the next writer is already
+///   waiting.
+/// - No TLS; every operation is one or two interlocked ops on shared words,
+///   so readers contend with each other on rin and rout.
+/// - Waiters wait on the word they are watching via TWaitPolicy; by default
+///   they spin briefly, then sleep.
+/// - A timed-out reader backs out of rin, not rout: the present writer waits
+///   for rout to reach the count it saw in rin, which didn't include it.
+///   A timed writer only takes a ticket that would be served at once, since
+///   the writers behind a ticket count on it being served; so it can be
+///   overtaken by untimed writers.
+template <class TWaitPolicy = SpinThenParkWait<> >
+class PhaseFairReadWriteMutex
+{
+private: // types
+    enum
+    {
+        // reader count increment; the low byte holds the writer bits
+        RINC = 0x100,
+        WBITS = 0x3,
+        // a writer is present
+        PRES = 0x2,
+        // phase id of the present writer
+        PHID = 0x1
+    };
+
+private: // members
+    volatile long m_rin;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+    volatile long m_rout;
+    volatile char pad1[CACHE_LINE_SIZE - 4];
+    volatile long m_win;
+    volatile char pad2[CACHE_LINE_SIZE - 4];
+    volatile long m_wout;
+    volatile char pad3[CACHE_LINE_SIZE - 4];
+
+    TWaitPolicy m_waitPolicy;
+
+private: // methods
+    // Waits until (*pWord & mask) != (undesired & mask).
+    void waitWhile(volatile long* pWord, long mask, long undesired)
+    {
+        for (;;)
+        {
+            const long word = *pWord;
+            if ((word & mask) != (undesired & mask))
+            {
+                return;
+            }
+            m_waitPolicy.Wait(pWord, word);
+        }
+    }
+
+    // Waits until *pWord == desired.
+    void waitFor(volatile long* pWord, long desired)
+    {
+        for (;;)
+        {
+            const long word = *pWord;
+            if (word == desired)
+            {
+                return;
+            }
+            m_waitPolicy.Wait(pWord, word);
+        }
+    }
+
+    // Waits until *pWord == desired, or the timeout runs out.
+    bool waitFor(volatile long* pWord, long desired, const Timeout& timeout)
+    {
+        for (;;)
+        {
+            const long word = *pWord;
+            if (word == desired)
+            {
+                return true;
+            }
+            if (!m_waitPolicy.WaitFor(pWord, word, timeout.Remaining()) && *pWord != desired)
+            {
+                return false;
+            }
+        }
+    }
+
+    // Undoes a reader's arrival in rin, unless the writer phase it arrived
+    // in has ended meanwhile, in which case the reader is in after all.
+    // Returns whether it backed out.
+    bool readerBackOut(long writerBits)
+    {
+        for (;;)
+        {
+            const long rin = m_rin;
+            if ((rin & WBITS) != writerBits)
+            {
+                return false;
+            }
+            // While this writer phase lasts, no later writer has read rin,
+            // so no one else counts on this reader's RINC.
+            if (_InterlockedCompareExchange(&m_rin, rin - RINC, rin) == rin)
+            {
+                return true;
+            }
+        }
+    }
+
+public: // interface
+    PhaseFairReadWriteMutex()
+        : m_rin(0)
+        , m_rout(0)
+        , m_win(0)
+        , m_wout(0)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+        memset((void*)pad1, 0, sizeof(pad1));
+        memset((void*)pad2, 0, sizeof(pad2));
+        memset((void*)pad3, 0, sizeof(pad3));
+    }
+
+    void WriteLock()
+    {
+        // wait for the writers ahead of us
+        const long ticket = _InterlockedExchangeAdd(&m_win, 1);
+        waitFor(&m_wout, ticket);
+
+        // block new readers, then wait for the ones already in
+        const long writerBits = PRES | (ticket & PHID);
+        const long readersIn = _InterlockedExchangeAdd(&m_rin, writerBits);
+        waitFor(&m_rout, readersIn);
+    }
+    void WriteUnlock()
+    {
+        // end the writer phase; readers that arrived during it may enter
+        _InterlockedAnd(&m_rin, ~(long)WBITS);
+        m_waitPolicy.WakeAll(&m_rin);
+        _InterlockedExchangeAdd(&m_wout, 1);
+        m_waitPolicy.WakeAll(&m_wout);
+    }
+    void ReadLock()
+    {
+        const long writerBits = _InterlockedExchangeAdd(&m_rin, RINC) & WBITS;
+        if (writerBits != 0)
+        {
+            // wait for this writer phase to end
+            waitWhile(&m_rin, WBITS, writerBits);
+        }
+    }
+    void ReadUnlock()
+    {
+        _InterlockedExchangeAdd(&m_rout, RINC);
+        // A present writer has published PRES before it reads m_rout, and the
+        // interlocked add above is a full barrier, so it can't miss this wake.
+        if (m_rin & PRES)
+        {
+            m_waitPolicy.WakeOne(&m_rout);
+        }
+    }
+
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out waiting for readers ends its writer phase,
+    /// as WriteUnlock() does.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        long ticket;
+        for (;;)
+        {
+            // take a ticket only when no writer holds or waits for the lock
+            ticket = m_wout;
+            if (m_win == ticket && _InterlockedCompareExchange(&m_win, ticket + 1, ticket) == ticket)
+            {
+                break;
+            }
+            if (timeout.Expired())
+            {
+                return false;
+            }
+            m_waitPolicy.WaitFor(&m_wout, ticket, timeout.Remaining());
+        }
+
+        const long writerBits = PRES | (ticket & PHID);
+        const long readersIn = _InterlockedExchangeAdd(&m_rin, writerBits);
+        if (!waitFor(&m_rout, readersIn, timeout))
+        {
+            WriteUnlock();
+            return false;
+        }
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        const long writerBits = _InterlockedExchangeAdd(&m_rin, RINC) & WBITS;
+        if (writerBits == 0)
+        {
+            return true;
+        }
+        Timeout timeout(milliseconds);
+        for (;;)
+        {
+            const long rin = m_rin;
+            if ((rin & WBITS) != writerBits)
+            {
+                return true;
+            }
+            if (timeout.Expired() || !m_waitPolicy.WaitFor(&m_rin, rin, timeout.Remaining()))
+            {
+                return !readerBackOut(writerBits);
+            }
+        }
+    }
+
+    typedef ScopedWriteLock<PhaseFairReadWriteMutex<TWaitPolicy> > ScopedWriteLock;
+    typedef ScopedReadLock<PhaseFairReadWriteMutex<TWaitPolicy> > ScopedReadLock;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "common.h"
+
+/// Maps the (processor group, number) pair of the calling thread's current
+/// processor onto a dense index in [0, ProcessorCount()).
+/// Machines with more than 64 logical processors have several processor groups,
+/// and groups are not necessarily full, so group * 64 + number is not dense.
+class ProcessorIndexMap
+{
+    std::vector<DWORD> m_groupOffsets;
+    DWORD m_processorCount;
+
+public:
+    ProcessorIndexMap()
+        : m_processorCount(0)
+    {
+        const WORD groupCount = GetActiveProcessorGroupCount();
+        for (WORD group = 0; group < groupCount; group++)
+        {
+            m_groupOffsets.push_back(m_processorCount);
+            m_processorCount += GetActiveProcessorCount(group);
+        }
+    }
+
+    DWORD ProcessorCount() const
+    {
+        return m_processorCount;
+    }
+
+    /// The answer is stale as soon as it is returned, since the thread may migrate.
+    DWORD CurrentProcessorIndex() const
+    {
+        PROCESSOR_NUMBER pn;
+        GetCurrentProcessorNumberEx(&pn);
+        return m_groupOffsets[pn.Group] + pn.Number;
+    }
+};
+
+/// NUMA node lookups for the calling thread.
+/// Node numbers come straight from the OS, so they can be sparse (a node with
+/// no processors still counts); NodeCount() is one past the highest of them.
+class NumaNodeMap
+{
+    DWORD m_nodeCount;
+
+public:
+    NumaNodeMap()
+        : m_nodeCount(1)
+    {
+        ULONG highestNode = 0;
+        if (GetNumaHighestNodeNumber(&highestNode))
+        {
+            m_nodeCount = highestNode + 1;
+        }
+    }
+
+    DWORD NodeCount() const
+    {
+        return m_nodeCount;
+    }
+
+    /// The answer is stale as soon as it is returned, since the thread may migrate.
+    static DWORD CurrentNodeIndex()
+    {
+        PROCESSOR_NUMBER pn;
+        GetCurrentProcessorNumberEx(&pn);
+        USHORT node = 0;
+        GetNumaProcessorNodeEx(&pn, &node);
+        return node;
+    }
+
+    /// Restricts the calling thread to the processors of the given node.
+    /// Returns false if the node has no processors.
+    static bool PinCurrentThreadToNode(DWORD node)
+    {
+        GROUP_AFFINITY affinity;
+        memset(&affinity, 0, sizeof(affinity));
+        if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) || affinity.Mask == 0)
+        {
+            return false;
+        }
+        return SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL) != FALSE;
+    }
+};
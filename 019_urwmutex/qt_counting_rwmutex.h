@@ -0,0 +1,196 @@
+#pragma once
+
+#include "common.h"
+#include "scoped_locks.h"
+#include "timeout.h"
+#include "wait_policy.h"
+
+/// QtReadWriteMutex's bounded-readers semantics, with an O(1) write lock.
+/// - m_count is the number of reader slots still free, TMaxConcurrentReaders
+///   when the lock is idle.  A reader takes a slot with one CAS, and waits
+///   while there is none, so at most TMaxConcurrentReaders readers are ever
+///   in, which is what makes the lock usable for admission control.
+/// - A writer takes every slot at once, by subtracting TMaxConcurrentReaders
+///   from m_count.  That leaves m_count at minus the number of readers still
+///   in; they give their slots back on the way out, and the one that brings
+///   m_count to zero wakes the writer.  So the writer waits once, instead of
+///   doing TMaxConcurrentReaders P()s.
+/// - m_count only goes negative while a writer holds or drains the lock, so
+///   new readers stop coming in as soon as a writer has subtracted.
+/// - The writer sleeps on m_drainCount, not m_count, so the wake meant for it
+///   can't go to a blocked reader instead.  m_drainCount only ever increases;
+///   the writer re-checks m_count after every wake, so a wake left over from
+///   an earlier writer that gave up is harmless.
+/// - Writers exclude each other with m_mutex, as in QtReadWriteMutex.
+template <class TMutex, long TMaxConcurrentReaders, class TWaitPolicy = ParkWait>
+class QtCountingReadWriteMutex
+{
+private:
+    volatile long m_count;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+    // readers that are, or are about to be, asleep on m_count
+    volatile long m_readerWaiters;
+    volatile char pad1[CACHE_LINE_SIZE - 4];
+    // bumped by the reader that lets a draining writer in
+    volatile long m_drainCount;
+    volatile char pad2[CACHE_LINE_SIZE - 4];
+
+    TMutex m_mutex;
+    // how waiters wait on the futex words
+    TWaitPolicy m_waitPolicy;
+
+private:
+    bool tryReadLock()
+    {
+        for (;;)
+        {
+            const long count = m_count;
+            if (count <= 0)
+            {
+                return false;
+            }
+            if (_InterlockedCompareExchange(&m_count, count - 1, count) == count)
+            {
+                return true;
+            }
+        }
+    }
+
+    // Gives every slot back, and wakes the readers that were kept out.
+    void releaseSlots()
+    {
+        _InterlockedExchangeAdd(&m_count, TMaxConcurrentReaders);
+        // the interlocked op orders the m_count update before this load
+        if (m_readerWaiters)
+        {
+            m_waitPolicy.WakeAll(&m_count);
+        }
+    }
+
+    // Waits for the readers still in to leave; m_mutex must already be held,
+    // and the slots taken.  If the timeout runs out first, gives the slots and
+    // m_mutex back and returns false.
+    bool drainReadersFor(const Timeout& timeout)
+    {
+        for (;;)
+        {
+            // load the sequence before the count, so a drain in between shows
+            const long drainCount = m_drainCount;
+            if (m_count == 0)
+            {
+                return true;
+            }
+            if (!m_waitPolicy.WaitFor(&m_drainCount, drainCount, timeout.Remaining()) && m_count != 0)
+            {
+                releaseSlots();
+                m_mutex.WriteUnlock();
+                return false;
+            }
+        }
+    }
+
+public:
+    QtCountingReadWriteMutex()
+        : m_count(TMaxConcurrentReaders)
+        , m_readerWaiters(0)
+        , m_drainCount(0)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+        memset((void*)pad1, 0, sizeof(pad1));
+        memset((void*)pad2, 0, sizeof(pad2));
+    }
+
+    void WriteLock()
+    {
+        m_mutex.WriteLock();
+        // take every slot; what's missing is held by readers still in
+        if (_InterlockedExchangeAdd(&m_count, -TMaxConcurrentReaders) != TMaxConcurrentReaders)
+        {
+            drainReadersFor(Timeout(INFINITE));
+        }
+    }
+    void WriteUnlock()
+    {
+        assert(m_count == 0);
+        releaseSlots();
+        m_mutex.WriteUnlock();
+    }
+
+    void ReadLock()
+    {
+        ReadLockFor(INFINITE);
+    }
+    void ReadUnlock()
+    {
+        const long count = _InterlockedIncrement(&m_count);
+        if (count == 0)
+        {
+            // the last reader a writer was draining
+            _InterlockedIncrement(&m_drainCount);
+            m_waitPolicy.WakeOne(&m_drainCount);
+        }
+        else if (count > 0 && m_readerWaiters)
+        {
+            // a slot came free for a reader that ran into the cap
+            m_waitPolicy.WakeOne(&m_count);
+        }
+    }
+
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out gives back the reader slots it had taken.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_mutex.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        if (_InterlockedExchangeAdd(&m_count, -TMaxConcurrentReaders) == TMaxConcurrentReaders)
+        {
+            return true;
+        }
+        return drainReadersFor(timeout);
+    }
+    bool TryReadLock()
+    {
+        return tryReadLock();
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        if (tryReadLock())
+        {
+            return true;
+        }
+
+        Timeout timeout(milliseconds);
+        // the interlocked op orders our registration before the m_count loads
+        _InterlockedIncrement(&m_readerWaiters);
+        bool acquired = true;
+        for (;;)
+        {
+            const long count = m_count;
+            if (count > 0)
+            {
+                if (_InterlockedCompareExchange(&m_count, count - 1, count) == count)
+                {
+                    break;
+                }
+                continue;
+            }
+            if (!m_waitPolicy.WaitFor(&m_count, count, timeout.Remaining()))
+            {
+                // timed out, unless a slot came free just now
+                acquired = tryReadLock();
+                break;
+            }
+        }
+        _InterlockedDecrement(&m_readerWaiters);
+        return acquired;
+    }
+
+    typedef ScopedWriteLock<QtCountingReadWriteMutex<TMutex, TMaxConcurrentReaders, TWaitPolicy> > ScopedWriteLock;
+    typedef ScopedReadLock<QtCountingReadWriteMutex<TMutex, TMaxConcurrentReaders, TWaitPolicy> > ScopedReadLock;
+};
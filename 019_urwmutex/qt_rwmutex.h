@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "scoped_locks.h"
+#include "timeout.h"
 
 // based on http://doc.trolltech.com/qq/qq11-mutex.html
 
@@ -41,38 +42,42 @@ public:
         m_sema.V();
     }
 
-    typedef ScopedWriteLock<QtReadWriteMutex<TMutex, TSemaphore, TMaxConcurrentReaders> > ScopedWriteLock;
-    typedef ScopedReadLock<QtReadWriteMutex<TMutex, TSemaphore, TMaxConcurrentReaders> > ScopedReadLock;
-
-    class ScopedWriteLock
+    bool TryWriteLock()
     {
-    public:
-        ScopedWriteLock(QtReadWriteMutex* pMutex) : m_pMutex(pMutex)
-        {
-            m_pMutex->WriteLock();
-        }
-        ~ScopedWriteLock()
-        {
-            m_pMutex->WriteUnlock();
-        }
-
-    private:
-        QtReadWriteMutex* m_pMutex;
-    };
-
-    class ScopedReadLock
+        return WriteLockFor(0);
+    }
+    /// A writer that times out gives back the reader slots it had collected.
+    bool WriteLockFor(DWORD milliseconds)
     {
-    public:
-        ScopedReadLock(QtReadWriteMutex* pMutex) : m_pMutex(pMutex)
+        Timeout timeout(milliseconds);
+        if (!m_mutex.WriteLockFor(timeout.Remaining()))
         {
-            m_pMutex->ReadLock();
+            return false;
         }
-        ~ScopedReadLock()
+        for (long i = 0; i < TMaxConcurrentReaders; i++)
         {
-            m_pMutex->ReadUnlock();
+            if (!m_sema.PFor(timeout.Remaining()))
+            {
+                if (i > 0)
+                {
+                    m_sema.V(i);
+                }
+                m_mutex.WriteUnlock();
+                return false;
+            }
         }
+        m_mutex.WriteUnlock();
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return m_sema.TryP();
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        return m_sema.PFor(milliseconds);
+    }
 
-    private:
-        QtReadWriteMutex* m_pMutex;
-    };
+    typedef ScopedWriteLock<QtReadWriteMutex<TMutex, TSemaphore, TMaxConcurrentReaders> > ScopedWriteLock;
+    typedef ScopedReadLock<QtReadWriteMutex<TMutex, TSemaphore, TMaxConcurrentReaders> > ScopedReadLock;
 };
@@ -0,0 +1,401 @@
+#pragma once
+
+#include "common.h"
+#include "scoped_locks.h"
+#include "futex.h"
+#include "wait_policy.h"
+#include "timeout.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
+
+/// A queue-lock waiter record.  Each one lives on its own cache line
+/// (see CacheLineAllocated), so a waiter spins on a line that nobody else
+/// touches until its predecessor hands over the lock.
+struct QueueLockNode : public CacheLineAllocated
+{
+    // McsLock only: the waiter queued behind this one
+    QueueLockNode* volatile pNext;
+    // 0 = lock handed over, 1 = waiter spinning, 2 = waiter asleep on this word
+    volatile long locked;
+};
+
+/// Per-thread cache of QueueLockNodes, so acquiring a queue lock doesn't
+/// allocate.  A thread needs one node per queue lock it holds or waits on,
+/// plus (for ClhLock) whichever node its predecessor left behind.
+/// The cache is freed by a ThreadExitHook when the thread exits.
+///
+/// It's a template only so that the statics can live in this header.
+template <int TDummy>
+class QueueLockNodePoolT
+{
+private:
+    struct Pool : public ThreadExitHook
+    {
+        QueueLockNode* pFree;
+    };
+
+    static DWORD volatile s_tlsIndex;
+
+private:
+    static void onThreadExit(ThreadExitHook* pHook)
+    {
+        // Nodes that are still queued (there shouldn't be any) belong to their
+        // locks, not to this cache, so only the free ones are deleted.
+        Pool* pPool = static_cast<Pool*>(pHook);
+        while (pPool->pFree)
+        {
+            QueueLockNode* pNode = pPool->pFree;
+            pPool->pFree = pNode->pNext;
+            delete pNode;
+        }
+        delete pPool;
+        TlsSetValue(s_tlsIndex, NULL);
+    }
+
+    static Pool* getPool()
+    {
+        if (s_tlsIndex == TLS_OUT_OF_INDEXES)
+        {
+            DWORD tlsIndex = TlsAlloc();
+            assert(tlsIndex != TLS_OUT_OF_INDEXES);
+            DWORD old = (DWORD)_InterlockedCompareExchange((volatile long*)&s_tlsIndex, (long)tlsIndex, (long)TLS_OUT_OF_INDEXES);
+            if (old != TLS_OUT_OF_INDEXES)
+            {
+                // we lost the race
+                TlsFree(tlsIndex);
+            }
+        }
+        Pool* pPool = (Pool*)InlineTlsGetValue(s_tlsIndex);
+        if (pPool == NULL)
+        {
+            pPool = new Pool();
+            pPool->pFree = NULL;
+            TlsSetValue(s_tlsIndex, pPool);
+            ThreadExitHooks::Register(pPool, &onThreadExit);
+        }
+        return pPool;
+    }
+
+public:
+    static QueueLockNode* Allocate()
+    {
+        Pool* pPool = getPool();
+        QueueLockNode* pNode = pPool->pFree;
+        if (pNode)
+        {
+            pPool->pFree = pNode->pNext;
+        }
+        else
+        {
+            pNode = new QueueLockNode();
+        }
+        return pNode;
+    }
+
+    static void Free(QueueLockNode* pNode)
+    {
+        Pool* pPool = getPool();
+        pNode->pNext = pPool->pFree;
+        pPool->pFree = pNode;
+    }
+};
+
+template <int TDummy>
+DWORD volatile QueueLockNodePoolT<TDummy>::s_tlsIndex = TLS_OUT_OF_INDEXES;
+
+typedef QueueLockNodePoolT<0> QueueLockNodePool;
+
+/// Spin-then-sleep handshake on QueueLockNode::locked.  How long a waiter
+/// spins is up to the lock's TWaitPolicy; the sleep itself stays here, since
+/// the handoff only wakes waiters that announced it.
+struct QueueLockWait
+{
+    /// Waits until the predecessor sets *pLocked to 0.
+    template <class TWaitPolicy>
+    static void WaitForHandoff(volatile long* pLocked, TWaitPolicy& waitPolicy)
+    {
+        if (waitPolicy.Spin(pLocked, 1L, INFINITE))
+        {
+            return;
+        }
+        for (;;)
+        {
+            const long state = *pLocked;
+            if (state == 0)
+            {
+                return;
+            }
+            // announce that we're going to sleep, so the handoff wakes us
+            if (state == 1 && _InterlockedCompareExchange(pLocked, 2, 1) != 1)
+            {
+                continue;
+            }
+            FutexWait(pLocked, 2);
+        }
+    }
+
+    /// Hands over the lock; only enters the kernel if the waiter went to sleep.
+    /// The node may be recycled as soon as locked is 0, so the wake can land on
+    /// a node that has moved on; that is just a spurious wakeup, and the memory
+    /// itself is never unmapped (see CacheLineSlab).
+    static void Handoff(volatile long* pLocked)
+    {
+        if (_InterlockedExchange(pLocked, 0) == 2)
+        {
+            FutexWakeOne(pLocked);
+        }
+    }
+};
+
+/// Mellor-Crummey & Scott queue lock, with the zoo's mutex interface.
+/// - Waiters form a linked queue, and each waits on its own node, so a handoff
+///   is one cache-line transfer from the releasing thread to the next waiter,
+///   rather than every waiter re-reading (and re-contending) one lock word.
+/// - Strict FIFO.
+/// - Waiters spin for as long as TWaitPolicy's Spin() says (100 spins by
+///   default), then sleep on their own node; only then does a handoff need a
+///   kernel call.
+/// - Must be released by the thread that acquired it, and is not recursive:
+///   a thread that takes it again queues behind itself and deadlocks, which
+///   WriteLock() asserts against.  So unlike CriticalSection, it can only be
+///   the TMutex of a mutex that never takes that lock while already holding it.
+/// - TryWriteLock() only succeeds on an empty queue, so it never leaves a node
+///   that others would wait behind; WriteLockFor() polls it, as CohortLock's does.
+template <class TWaitPolicy = SpinThenParkWait<100> >
+class McsLockT
+{
+private:
+    QueueLockNode* volatile m_pTail;
+    volatile char pad0[CACHE_LINE_SIZE - sizeof(void*)];
+    // only accessed by the lock holder
+    QueueLockNode* m_pOwner;
+    // only written by the lock holder; 0 while the lock is free
+    DWORD volatile m_ownerThreadId;
+    // how long waiters spin before they sleep on their nodes
+    TWaitPolicy m_waitPolicy;
+
+public:
+    McsLockT()
+        : m_pTail(NULL)
+        , m_pOwner(NULL)
+        , m_ownerThreadId(0)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+    }
+    ~McsLockT()
+    {
+        assert(m_pTail == NULL);
+    }
+
+    void WriteLock()
+    {
+        assert(m_ownerThreadId != GetCurrentThreadId());
+        QueueLockNode* pNode = QueueLockNodePool::Allocate();
+        pNode->pNext = NULL;
+        pNode->locked = 1;
+        QueueLockNode* pPred = (QueueLockNode*)InterlockedExchangePointer((PVOID volatile*)&m_pTail, pNode);
+        if (pPred)
+        {
+            pPred->pNext = pNode;
+            QueueLockWait::WaitForHandoff(&pNode->locked, m_waitPolicy);
+        }
+        m_pOwner = pNode;
+        m_ownerThreadId = GetCurrentThreadId();
+    }
+    void WriteUnlock()
+    {
+        assert(m_ownerThreadId == GetCurrentThreadId());
+        m_ownerThreadId = 0;
+        QueueLockNode* pNode = m_pOwner;
+        if (pNode->pNext == NULL)
+        {
+            if (InterlockedCompareExchangePointer((PVOID volatile*)&m_pTail, NULL, pNode) == pNode)
+            {
+                QueueLockNodePool::Free(pNode);
+                return;
+            }
+            // a waiter has swapped itself in, but not linked itself yet
+            while (pNode->pNext == NULL)
+            {
+                YieldProcessor();
+            }
+        }
+        QueueLockWait::Handoff(&pNode->pNext->locked);
+        QueueLockNodePool::Free(pNode);
+    }
+    void ReadLock()
+    {
+        WriteLock();
+    }
+    void ReadUnlock()
+    {
+        WriteUnlock();
+    }
+
+    bool TryWriteLock()
+    {
+        QueueLockNode* pNode = QueueLockNodePool::Allocate();
+        pNode->pNext = NULL;
+        pNode->locked = 1;
+        if (InterlockedCompareExchangePointer((PVOID volatile*)&m_pTail, pNode, NULL) != NULL)
+        {
+            QueueLockNodePool::Free(pNode);
+            return false;
+        }
+        m_pOwner = pNode;
+        m_ownerThreadId = GetCurrentThreadId();
+        return true;
+    }
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        for (long attempt = 0; !TryWriteLock(); attempt++)
+        {
+            if (timeout.Expired())
+            {
+                return false;
+            }
+            Sleep(attempt < 16 ? 0 : 1);
+        }
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return TryWriteLock();
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        return WriteLockFor(milliseconds);
+    }
+
+    typedef ScopedWriteLock<McsLockT<TWaitPolicy> > ScopedWriteLock;
+    typedef ScopedReadLock<McsLockT<TWaitPolicy> > ScopedReadLock;
+};
+
+typedef McsLockT<> McsLock;
+
+/// Craig / Landin & Hagersten queue lock, with the zoo's mutex interface.
+/// - Like McsLock, but each waiter waits on its predecessor's node instead of
+///   its own, so the queue is implicit and release never has to wait for a
+///   successor to link itself in.
+/// - On release, the thread gives its own node to its successor and keeps its
+///   predecessor's node, so nodes migrate between threads' pools.
+/// - Strict FIFO; must be released by the thread that acquired it, and is not
+///   recursive, with the same assert and the same restriction as McsLock.
+///   Waiters spin per TWaitPolicy, as in McsLock.
+/// - TryWriteLock() only joins a queue whose tail node is released, and
+///   WriteLockFor() polls it.  The tail can be released, recycled and queued
+///   again between the check and the swap; in that rare case the thread that
+///   tried waits its turn like WriteLock().
+template <class TWaitPolicy = SpinThenParkWait<100> >
+class ClhLockT
+{
+private:
+    QueueLockNode* volatile m_pTail;
+    volatile char pad0[CACHE_LINE_SIZE - sizeof(void*)];
+    // only accessed by the lock holder
+    QueueLockNode* m_pOwner;
+    QueueLockNode* m_pOwnerPred;
+    // only written by the lock holder; 0 while the lock is free
+    DWORD volatile m_ownerThreadId;
+    // how long waiters spin before they sleep on their predecessors' nodes
+    TWaitPolicy m_waitPolicy;
+
+public:
+    ClhLockT()
+        : m_pTail(NULL)
+        , m_pOwner(NULL)
+        , m_pOwnerPred(NULL)
+        , m_ownerThreadId(0)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+
+        // the queue always ends in a released node
+        QueueLockNode* pNode = new QueueLockNode();
+        pNode->pNext = NULL;
+        pNode->locked = 0;
+        m_pTail = pNode;
+    }
+    ~ClhLockT()
+    {
+        delete m_pTail;
+    }
+
+    void WriteLock()
+    {
+        assert(m_ownerThreadId != GetCurrentThreadId());
+        QueueLockNode* pNode = QueueLockNodePool::Allocate();
+        pNode->locked = 1;
+        QueueLockNode* pPred = (QueueLockNode*)InterlockedExchangePointer((PVOID volatile*)&m_pTail, pNode);
+        QueueLockWait::WaitForHandoff(&pPred->locked, m_waitPolicy);
+        m_pOwner = pNode;
+        m_pOwnerPred = pPred;
+        m_ownerThreadId = GetCurrentThreadId();
+    }
+    void WriteUnlock()
+    {
+        assert(m_ownerThreadId == GetCurrentThreadId());
+        m_ownerThreadId = 0;
+        QueueLockNode* pNode = m_pOwner;
+        QueueLockNode* pPred = m_pOwnerPred;
+        QueueLockWait::Handoff(&pNode->locked);
+        // nobody else can reach pPred any more
+        QueueLockNodePool::Free(pPred);
+    }
+    void ReadLock()
+    {
+        WriteLock();
+    }
+    void ReadUnlock()
+    {
+        WriteUnlock();
+    }
+
+    bool TryWriteLock()
+    {
+        QueueLockNode* pPred = m_pTail;
+        if (pPred->locked != 0)
+        {
+            return false;
+        }
+        QueueLockNode* pNode = QueueLockNodePool::Allocate();
+        pNode->locked = 1;
+        if (InterlockedCompareExchangePointer((PVOID volatile*)&m_pTail, pNode, pPred) != pPred)
+        {
+            QueueLockNodePool::Free(pNode);
+            return false;
+        }
+        // pPred may have been recycled into a waiter's node since we checked it
+        QueueLockWait::WaitForHandoff(&pPred->locked, m_waitPolicy);
+        m_pOwner = pNode;
+        m_pOwnerPred = pPred;
+        m_ownerThreadId = GetCurrentThreadId();
+        return true;
+    }
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        for (long attempt = 0; !TryWriteLock(); attempt++)
+        {
+            if (timeout.Expired())
+            {
+                return false;
+            }
+            Sleep(attempt < 16 ? 0 : 1);
+        }
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return TryWriteLock();
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        return WriteLockFor(milliseconds);
+    }
+
+    typedef ScopedWriteLock<ClhLockT<TWaitPolicy> > ScopedWriteLock;
+    typedef ScopedReadLock<ClhLockT<TWaitPolicy> > ScopedReadLock;
+};
+
+typedef ClhLockT<> ClhLock;
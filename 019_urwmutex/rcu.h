@@ -0,0 +1,342 @@
+#pragma once
+
+#include <vector>
+#include "common.h"
+#include "critical_section.h"
+#include "fences.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
+
+/// Read-copy-update, built on the same per-thread reader registry as
+/// UltraSpinFencedReadWriteMutex.
+/// - Readers never wait, and never exclude writers.  RcuReadLock() just
+///   publishes, in the thread's own TlsData, the grace-period epoch it started
+///   in; RcuReadUnlock() clears it.  Read sections nest.
+/// - Writers don't exclude readers either.  A writer builds a new version of
+///   the object, publishes it with AssignPointer(), and must then wait for a
+///   grace period before freeing the old version: Synchronize() bumps the
+///   global epoch and waits until every thread that was in a read section
+///   started in an older epoch has left it.  Readers that started after the
+///   bump can only have seen the new version, so they're not waited for, and
+///   a steady stream of readers can't starve Synchronize().
+/// - CallRcu() is the asynchronous form: it queues fn(pContext) to run after a
+///   grace period, and returns at once.  A reclaimer thread, started on the
+///   first CallRcu(), runs one Synchronize() per batch of callbacks, either
+///   every RECLAIM_INTERVAL_MS or as soon as BATCH_SIZE callbacks are queued.
+///   Barrier() waits until all callbacks queued so far have run.
+/// - The reader's epoch store must be visible before it loads the pointer,
+///   which is the same store->load handshake as UltraSpinFenced; TFence
+///   supplies it, and AsymmetricFence keeps it off the read side.
+/// - Writers must still be serialized among themselves, by the caller.
+/// - New readers register under m_registryCs, not m_cs, so a thread's first
+///   read section never waits for a grace period in progress.  Synchronize()
+///   only holds m_registryCs to compact the registry and copy it, and then
+///   waits on the copy.
+/// - Synchronize() and Barrier() must not be called from inside a read section.
+///
+/// Usage:
+///     // reader
+///     {
+///         Rcu<>::ScopedReadLock lk(rcu);
+///         Table* pTable = Rcu<>::Dereference(&g_pTable);
+///         ... lookup in *pTable ...
+///     }
+///     // writer
+///     Table* pOld = g_pTable;
+///     Table* pNew = new Table(*pOld);
+///     ... modify *pNew ...
+///     Rcu<>::AssignPointer(&g_pTable, pNew);
+///     rcu.Synchronize();
+///     delete pOld;
+template <class TFence = AsymmetricFence, class TMutex = CriticalSection>
+class Rcu
+{
+public: // types
+    typedef void (*Callback)(void* pContext);
+
+private: // types
+    enum
+    {
+        SPIN_COUNT = 100,
+        BATCH_SIZE = 64,
+        RECLAIM_INTERVAL_MS = 10
+    };
+
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
+    {
+        // epoch the outermost read section started in; 0 outside one
+        volatile long epoch;
+        // only touched by the owning thread
+        long nesting;
+
+        TlsData()
+            : epoch(0)
+            , nesting(0)
+        {
+        }
+    };
+    typedef std::vector<TlsData*> ThreadStates;
+    typedef TMutex Mutex_t;
+
+    struct PendingCallback
+    {
+        Callback fn;
+        void* pContext;
+    };
+    typedef std::vector<PendingCallback> PendingCallbacks;
+
+private: // members
+    // current grace-period epoch; only written by Synchronize()
+    volatile long m_epoch;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+
+    DWORD m_tlsIndex;
+
+    // mutual exclusion of grace periods from each other; also protects m_snapshot
+    Mutex_t m_cs;
+    // protects m_registry; never held across a wait
+    CriticalSection m_registryCs;
+    ThreadRegistry<TlsData> m_registry;
+    // the readers the current grace period waits for.  Records in it can't be
+    // recycled mid-wait, since only Synchronize() compacts the registry.
+    ThreadStates m_snapshot;
+
+    // protects m_pendingCallbacks and the reclaimer thread's startup
+    CriticalSection m_callbackCs;
+    PendingCallbacks m_pendingCallbacks;
+    // held while a batch of callbacks waits for its grace period and runs
+    CriticalSection m_batchCs;
+    HANDLE m_hReclaimThread;
+    // auto-reset; set when a batch is full, or to stop the reclaimer
+    HANDLE m_hReclaimEvent;
+    volatile long m_stopReclaim;
+
+private: // methods
+    TlsData* initTlsData()
+    {
+        TlsData* pTlsData = NULL;
+        {
+            CriticalSection::ScopedWriteLock lk(m_registryCs);
+            pTlsData = m_registry.Add();
+        }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
+        return pTlsData;
+    }
+
+    TlsData* getTlsData()
+    {
+        TlsData* pTlsData = (TlsData*)InlineTlsGetValue(m_tlsIndex);
+        if (pTlsData == NULL)
+        {
+            pTlsData = initTlsData();
+        }
+        return pTlsData;
+    }
+
+    void readLock(TlsData* pTlsData)
+    {
+        if (pTlsData->nesting++ == 0)
+        {
+            pTlsData->epoch = m_epoch;
+            TFence::ReaderFence();
+        }
+    }
+
+    void readUnlock(TlsData* pTlsData)
+    {
+        assert(pTlsData->nesting > 0);
+        if (--pTlsData->nesting == 0)
+        {
+            // x86 doesn't move stores above earlier loads; keep the compiler
+            // from doing so either
+            _ReadWriteBarrier();
+            pTlsData->epoch = 0;
+        }
+    }
+
+    // Runs the callbacks queued so far, after a grace period.
+    void reclaimBatch()
+    {
+        CriticalSection::ScopedWriteLock batchLk(m_batchCs);
+        PendingCallbacks batch;
+        {
+            CriticalSection::ScopedWriteLock lk(m_callbackCs);
+            batch.swap(m_pendingCallbacks);
+        }
+        if (batch.empty())
+        {
+            return;
+        }
+        Synchronize();
+        for (size_t u = 0; u < batch.size(); u++)
+        {
+            batch[u].fn(batch[u].pContext);
+        }
+    }
+
+    void ReclaimThread()
+    {
+        while (!m_stopReclaim)
+        {
+            WaitForSingleObject(m_hReclaimEvent, RECLAIM_INTERVAL_MS);
+            reclaimBatch();
+        }
+    }
+    static DWORD WINAPI ReclaimThreadProc(void* p)
+    {
+        Rcu* pRcu = (Rcu*)p;
+        pRcu->ReclaimThread();
+        return 0;
+    }
+
+public: // interface
+    Rcu()
+        : m_epoch(1)
+        , m_tlsIndex(TLS_OUT_OF_INDEXES)
+        , m_hReclaimThread(NULL)
+        , m_hReclaimEvent(NULL)
+        , m_stopReclaim(0)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+
+        m_tlsIndex = TlsAlloc();
+        assert(m_tlsIndex != TLS_OUT_OF_INDEXES);
+        m_hReclaimEvent = CreateEventA(NULL, /* bManualReset */ FALSE, /* bInitialState */ FALSE, NULL);
+        assert(m_hReclaimEvent != NULL);
+    }
+    ~Rcu()
+    {
+        if (m_hReclaimThread)
+        {
+            m_stopReclaim = 1;
+            SetEvent(m_hReclaimEvent);
+            WaitForSingleObject(m_hReclaimThread, INFINITE);
+            CloseHandle(m_hReclaimThread);
+        }
+        // whatever was queued after the reclaimer's last batch
+        reclaimBatch();
+        CloseHandle(m_hReclaimEvent);
+
+        TlsFree(m_tlsIndex);
+    }
+
+    void RcuReadLock()
+    {
+        TlsData* pTlsData = getTlsData();
+        readLock(pTlsData);
+    }
+    void RcuReadUnlock()
+    {
+        TlsData* pTlsData = getTlsData();
+        readUnlock(pTlsData);
+    }
+
+    /// Waits for a grace period: returns once every read section that was
+    /// in progress when it was called has ended.
+    void Synchronize()
+    {
+        typename Mutex_t::ScopedWriteLock lk(m_cs);
+        const long epoch = m_epoch + 1;
+        m_epoch = epoch;
+        TFence::WriterFence();
+        {
+            // A reader that registers after this copy reads m_epoch after it,
+            // so it starts in the new epoch and needn't be waited for.
+            CriticalSection::ScopedWriteLock registryLk(m_registryCs);
+            m_registry.Compact();
+            m_snapshot = m_registry.Threads();
+        }
+        for (typename ThreadStates::const_iterator iter = m_snapshot.begin(),
+                                                    end = m_snapshot.end();
+             iter != end;
+             ++iter)
+        {
+            TlsData* pTlsData = *iter;
+            for (long spin = 0; ; spin++)
+            {
+                const long readerEpoch = pTlsData->epoch;
+                // a reader in the new epoch can't have seen the old version
+                if (readerEpoch == 0 || readerEpoch - epoch >= 0)
+                {
+                    break;
+                }
+                if (spin < SPIN_COUNT)
+                {
+                    YieldProcessor();
+                }
+                else
+                {
+                    Sleep(spin < 2 * SPIN_COUNT ? 0 : 1);
+                }
+            }
+        }
+    }
+
+    /// Queues fn(pContext) to run on the reclaimer thread after a grace
+    /// period, and returns without waiting.
+    void CallRcu(Callback fn, void* pContext)
+    {
+        PendingCallback callback;
+        callback.fn = fn;
+        callback.pContext = pContext;
+        bool batchFull = false;
+        {
+            CriticalSection::ScopedWriteLock lk(m_callbackCs);
+            m_pendingCallbacks.push_back(callback);
+            batchFull = m_pendingCallbacks.size() >= BATCH_SIZE;
+            if (m_hReclaimThread == NULL)
+            {
+                m_hReclaimThread = CreateThread(NULL, 0x10000, &ReclaimThreadProc, this, 0, NULL);
+                assert(m_hReclaimThread != NULL);
+            }
+        }
+        if (batchFull)
+        {
+            SetEvent(m_hReclaimEvent);
+        }
+    }
+
+    /// Waits until every callback queued by CallRcu() so far has run.
+    void Barrier()
+    {
+        reclaimBatch();
+    }
+
+    /// Publishes a new version: everything written to *p beforehand is
+    /// visible to a reader that loads the pointer.
+    template <class T>
+    static void AssignPointer(T* volatile* ppShared, T* p)
+    {
+        // x86 doesn't reorder stores with other stores
+        _WriteBarrier();
+        *ppShared = p;
+    }
+
+    /// Loads a pointer published by AssignPointer(), inside a read section.
+    template <class T>
+    static T* Dereference(T* volatile const* ppShared)
+    {
+        T* p = *ppShared;
+        _ReadBarrier();
+        return p;
+    }
+
+    class ScopedReadLock
+    {
+        Rcu& m_rcu;
+        TlsData* m_pTlsData;
+
+    public:
+        ScopedReadLock(Rcu& rcu)
+            : m_rcu(rcu)
+        {
+            m_pTlsData = m_rcu.getTlsData();
+            m_rcu.readLock(m_pTlsData);
+        }
+        ~ScopedReadLock()
+        {
+            m_rcu.readUnlock(m_pTlsData);
+        }
+    };
+};
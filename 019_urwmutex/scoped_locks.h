@@ -33,3 +33,38 @@ public:
         m_mutex.ReadUnlock();
     }
 };
+
+/// Holds the upgrade lock of a mutex that supports UpgradeLock(): it coexists
+/// with readers but excludes writers and other upgraders, so what was read
+/// under it stays valid across Upgrade() to the write lock.
+template <typename TMutex>
+class ScopedUpgradeLock
+{
+    TMutex& m_mutex;
+    bool m_upgraded;
+
+public:
+    ScopedUpgradeLock(TMutex& mutex) : m_mutex(mutex), m_upgraded(false)
+    {
+        m_mutex.UpgradeLock();
+    }
+    ~ScopedUpgradeLock()
+    {
+        if (m_upgraded)
+        {
+            m_mutex.Downgrade();
+        }
+        m_mutex.UpgradeUnlock();
+    }
+
+    void Upgrade()
+    {
+        m_mutex.Upgrade();
+        m_upgraded = true;
+    }
+    void Downgrade()
+    {
+        m_mutex.Downgrade();
+        m_upgraded = false;
+    }
+};
@@ -31,6 +31,23 @@ public:
         WriteUnlock();
     }
 
+    bool TryWriteLock()
+    {
+        return m_sema.TryP();
+    }
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        return m_sema.PFor(milliseconds);
+    }
+    bool TryReadLock()
+    {
+        return TryWriteLock();
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        return WriteLockFor(milliseconds);
+    }
+
     typedef ScopedWriteLock<SemaMutex<TSema> > ScopedWriteLock;
     typedef ScopedReadLock<SemaMutex<TSema> > ScopedReadLock;
 };
@@ -24,6 +24,16 @@ public:
         WaitForSingleObject(m_hSemaphore, INFINITE);
     }
 
+    bool TryP()
+    {
+        return PFor(0);
+    }
+
+    bool PFor(DWORD milliseconds)
+    {
+        return WaitForSingleObject(m_hSemaphore, milliseconds) == WAIT_OBJECT_0;
+    }
+
     long V(long count)
     {
         long prevCount;
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <intrin.h>
+#include "common.h"
+#include "scoped_locks.h"
+#include "critical_section.h"
+
+/// Sequence lock: optimistic readers that never write shared memory.
+/// - A writer makes m_sequence odd, modifies the data, and makes it even again.
+/// - An optimistic reader reads m_sequence (ReadBegin), copies what it needs,
+///   then checks that m_sequence hasn't changed (ReadValidate).  If it has,
+///   the copy may be torn, and the reader must discard it and retry.
+/// - So readers don't dirty any cache line, not even their own, and
+///   concurrent readers scale perfectly; but a reader can be starved by a
+///   steady stream of writers, and it must tolerate seeing inconsistent data
+///   until it validates (no following pointers out of it, etc.).
+///   Best for small, read-mostly records that are cheap to copy.
+/// - Writers are mutually excluded by TMutex.
+/// - ReadLock()/ReadUnlock() are pessimistic readers, for the zoo interface:
+///   they just take TMutex, which keeps writers out.
+///
+/// Usage:
+///     SeqReadWriteMutex<>::ScopedOptimisticRead read(mutex);
+///     do
+///     {
+///         copy = shared;
+///     } while (read.Retry());
+template <class TMutex = CriticalSection>
+class SeqReadWriteMutex
+{
+private: // types
+    typedef TMutex Mutex_t;
+
+private: // members
+    // odd while a writer is active
+    volatile long m_sequence;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+
+    // This critical section enforces the following
+    // - mutual exclusion of writers from each other
+    // - mutual exclusion of pessimistic readers from writers
+    Mutex_t m_cs;
+
+public: // interface
+    SeqReadWriteMutex()
+        : m_sequence(0)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+    }
+
+    void WriteLock()
+    {
+        m_cs.WriteLock();
+        // the interlocked op keeps the data writes from moving above it
+        _InterlockedIncrement(&m_sequence);
+    }
+    void WriteUnlock()
+    {
+        // the interlocked op keeps the data writes from moving below it
+        _InterlockedIncrement(&m_sequence);
+        m_cs.WriteUnlock();
+    }
+    void ReadLock()
+    {
+        m_cs.WriteLock();
+    }
+    void ReadUnlock()
+    {
+        m_cs.WriteUnlock();
+    }
+
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        if (!m_cs.WriteLockFor(milliseconds))
+        {
+            return false;
+        }
+        _InterlockedIncrement(&m_sequence);
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return m_cs.TryWriteLock();
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        return m_cs.WriteLockFor(milliseconds);
+    }
+
+    /// Starts an optimistic read; returns the sequence to pass to ReadValidate().
+    /// If a writer is active, waits for it by briefly taking the writer lock,
+    /// rather than spinning against it.
+    long ReadBegin()
+    {
+        for (;;)
+        {
+            const long sequence = m_sequence;
+            if ((sequence & 1) == 0)
+            {
+                // x86 doesn't reorder loads with other loads, so keeping the
+                // compiler from doing so is enough.
+                _ReadBarrier();
+                return sequence;
+            }
+            m_cs.WriteLock();
+            m_cs.WriteUnlock();
+        }
+    }
+
+    /// Returns whether the data read since ReadBegin() returned sequence is
+    /// consistent.  If not, it must be discarded.
+    bool ReadValidate(long sequence)
+    {
+        _ReadBarrier();
+        return m_sequence == sequence;
+    }
+
+    typedef ScopedWriteLock<SeqReadWriteMutex<TMutex> > ScopedWriteLock;
+    typedef ScopedReadLock<SeqReadWriteMutex<TMutex> > ScopedReadLock;
+
+    /// Retry helper for optimistic reads; see the usage example above.
+    class ScopedOptimisticRead
+    {
+        SeqReadWriteMutex& m_mutex;
+        long m_sequence;
+        long m_retryCount;
+
+    public:
+        ScopedOptimisticRead(SeqReadWriteMutex& mutex)
+            : m_mutex(mutex)
+            , m_retryCount(0)
+        {
+            m_sequence = m_mutex.ReadBegin();
+        }
+
+        /// Returns false if the data read so far is consistent; otherwise
+        /// starts over and returns true.
+        bool Retry()
+        {
+            if (m_mutex.ReadValidate(m_sequence))
+            {
+                return false;
+            }
+            m_retryCount += 1;
+            m_sequence = m_mutex.ReadBegin();
+            return true;
+        }
+
+        long RetryCount() const
+        {
+            return m_retryCount;
+        }
+    };
+};
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "scoped_locks.h"
+#include "timeout.h"
 
 class SlimReadWriteLock
 {
@@ -33,6 +34,43 @@ public:
         ReleaseSRWLockShared(&m_mutex);
     }
 
+    bool TryWriteLock()
+    {
+        return TryAcquireSRWLockExclusive(&m_mutex) != 0;
+    }
+    /// SRWLOCK has no timed acquire, so this polls.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        for (long attempt = 0; !TryWriteLock(); attempt++)
+        {
+            if (timeout.Expired())
+            {
+                return false;
+            }
+            Sleep(attempt < 16 ? 0 : 1);
+        }
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return TryAcquireSRWLockShared(&m_mutex) != 0;
+    }
+    /// SRWLOCK has no timed acquire, so this polls.
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        for (long attempt = 0; !TryReadLock(); attempt++)
+        {
+            if (timeout.Expired())
+            {
+                return false;
+            }
+            Sleep(attempt < 16 ? 0 : 1);
+        }
+        return true;
+    }
+
     typedef ScopedWriteLock<SlimReadWriteLock> ScopedWriteLock;
     typedef ScopedReadLock<SlimReadWriteLock> ScopedReadLock;
 };
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "common.h"
+#include "scoped_locks.h"
+#include "critical_section.h"
+#include "timeout.h"
+#include "wait_policy.h"
+
+/// UltraFutex's handshake, with the reader count kept in a scalable non-zero
+/// indicator (SNZI) tree instead of per-thread flags, after Ellen, Lev,
+/// Luchangco & Moir, "SNZI: Scalable NonZero Indicators" (PODC 2007).
+/// - The tree is a root, FAN_OUT inner nodes and FAN_OUT^2 leaves, each count
+///   on its own cache line.  A reader arrives at, and later departs from, the
+///   leaf picked by its thread id, so there's no TLS registration, and readers
+///   on different leaves don't share a line.
+/// - A node only arrives at its parent on its own 0->1 transition, and only
+///   departs on 1->0, so the root only sees the first arrival and last
+///   departure below it, and a node is non-zero whenever any node below it is.
+///   Writers just watch the root.
+/// - A node that goes 0->1 arrives at its parent first, then CASes itself
+///   from 0.  If another arrival beat it to the CAS, it departs from the
+///   parent again.  That can make the root flicker through an extra
+///   transition, which at worst wakes the writer spuriously; it never lets the
+///   root read zero while a reader is in.
+/// - Writers set m_writeRequested and sleep on the root until it reaches zero.
+///   Readers that find m_writeRequested set depart again and queue up on m_cs
+///   behind the writer, as in UltraLightReadWriteMutex, then arrive while they
+///   hold it.  So blocked readers compete with the next writer for m_cs instead
+///   of waiting until no writer is left, and with a FIFO TMutex (McsLock,
+///   ClhLock) readers and writers get in in arrival order.  The price is that
+///   blocked readers pass through m_cs one at a time; readers that find no
+///   writer never touch it.
+/// - Every futex wait and wake goes through TWaitPolicy (see wait_policy.h).
+template <class TMutex = CriticalSection, class TWaitPolicy = ParkWait>
+class SnziReadWriteMutex
+{
+private: // types
+    enum
+    {
+        FAN_OUT = 8,
+        LEAF_COUNT = FAN_OUT * FAN_OUT,
+        FIRST_LEAF = 1 + FAN_OUT,
+        NODE_COUNT = FIRST_LEAF + LEAF_COUNT
+    };
+
+    struct Node
+    {
+        volatile long count;
+        volatile char pad[CACHE_LINE_SIZE - 4];
+    };
+    typedef TMutex Mutex_t;
+
+private: // members
+    // treated as an atomic bool
+    volatile long m_writeRequested;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+
+    // m_nodes[0] is the root; the children of node i are FAN_OUT * i + 1 and up
+    Node m_nodes[NODE_COUNT];
+
+    // This critical section enforces the following
+    // - mutual exclusion of writers from each other
+    // - mutual exclusion and fair ordering of readers that arrive after previous writers
+    Mutex_t m_cs;
+    // how writers wait on the root
+    TWaitPolicy m_waitPolicy;
+
+private: // methods
+    static long leafIndex()
+    {
+        // Win32 thread ids are multiples of 4
+        return FIRST_LEAF + (long)((GetCurrentThreadId() >> 2) % LEAF_COUNT);
+    }
+
+    void arrive(long nodeIndex)
+    {
+        volatile long* pCount = &m_nodes[nodeIndex].count;
+        if (nodeIndex == 0)
+        {
+            _InterlockedIncrement(pCount);
+            return;
+        }
+        const long parentIndex = (nodeIndex - 1) / FAN_OUT;
+        for (;;)
+        {
+            const long count = *pCount;
+            if (count > 0)
+            {
+                // already counted in the parent
+                if (_InterlockedCompareExchange(pCount, count + 1, count) == count)
+                {
+                    return;
+                }
+            }
+            else
+            {
+                arrive(parentIndex);
+                if (_InterlockedCompareExchange(pCount, 1, 0) == 0)
+                {
+                    return;
+                }
+                // another arrival made the 0->1 transition first
+                depart(parentIndex);
+            }
+        }
+    }
+
+    void depart(long nodeIndex)
+    {
+        volatile long* pCount = &m_nodes[nodeIndex].count;
+        const long count = _InterlockedDecrement(pCount);
+        assert(count >= 0);
+        if (count != 0)
+        {
+            return;
+        }
+        if (nodeIndex != 0)
+        {
+            depart((nodeIndex - 1) / FAN_OUT);
+        }
+        else if (m_writeRequested)
+        {
+            m_waitPolicy.WakeOne(pCount);
+        }
+    }
+
+    void readLock(long leaf)
+    {
+        // arrive()'s interlocked ops order the arrival before the load below
+        arrive(leaf);
+        while (m_writeRequested)
+        {
+            depart(leaf);
+            // wait until writer finishes
+            {
+                typename Mutex_t::ScopedWriteLock lk(m_cs);
+                arrive(leaf);
+            }
+        }
+    }
+
+    bool readLockFor(long leaf, DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        arrive(leaf);
+        while (m_writeRequested)
+        {
+            depart(leaf);
+            // wait until writer finishes, or give up
+            if (!m_cs.WriteLockFor(timeout.Remaining()))
+            {
+                return false;
+            }
+            arrive(leaf);
+            m_cs.WriteUnlock();
+        }
+        return true;
+    }
+
+    void readUnlock(long leaf)
+    {
+        depart(leaf);
+    }
+
+    // Waits for the root to reach zero; m_cs must already be held.  If the
+    // timeout runs out first, releases the write lock and returns false.
+    bool bootReadersFor(const Timeout& timeout)
+    {
+        m_writeRequested = 1;
+        // nothing else separates the store above from the root loads below
+        MemoryBarrier();
+        volatile long* pRoot = &m_nodes[0].count;
+        for (long root = *pRoot; root != 0; root = *pRoot)
+        {
+            if (!m_waitPolicy.WaitFor(pRoot, root, timeout.Remaining()) && *pRoot != 0)
+            {
+                // let the readers we blocked back in
+                WriteUnlock();
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    SnziReadWriteMutex()
+        : m_writeRequested(0)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+        memset((void*)m_nodes, 0, sizeof(m_nodes));
+    }
+
+    void WriteLock()
+    {
+        m_cs.WriteLock();
+        bootReadersFor(Timeout(INFINITE));
+    }
+    void WriteUnlock()
+    {
+        m_writeRequested = 0;
+        m_cs.WriteUnlock();
+    }
+    void ReadLock()
+    {
+        readLock(leafIndex());
+    }
+    void ReadUnlock()
+    {
+        readUnlock(leafIndex());
+    }
+
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out lets in the readers it had blocked.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_cs.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        return bootReadersFor(timeout);
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        return readLockFor(leafIndex(), milliseconds);
+    }
+
+    typedef ScopedWriteLock<SnziReadWriteMutex<TMutex, TWaitPolicy> > ScopedWriteLock;
+
+    class ScopedReadLock
+    {
+        SnziReadWriteMutex& m_mutex;
+        long m_leaf;
+
+    public:
+        ScopedReadLock(SnziReadWriteMutex& mutex)
+            : m_mutex(mutex)
+            , m_leaf(leafIndex())
+        {
+            m_mutex.readLock(m_leaf);
+        }
+        ~ScopedReadLock()
+        {
+            m_mutex.readUnlock(m_leaf);
+        }
+    };
+};
@@ -0,0 +1,279 @@
+#pragma once
+
+#include "common.h"
+
+/// An intrusive node in a per-thread list of callbacks that run when the
+/// thread exits.  Derive per-thread records from it (e.g. a mutex's TlsData).
+struct ThreadExitHook
+{
+    typedef void (*Callback)(ThreadExitHook* pHook);
+
+    Callback pfnOnThreadExit;
+    ThreadExitHook* pPrev;
+    ThreadExitHook* pNext;
+
+    ThreadExitHook()
+        : pfnOnThreadExit(NULL)
+        , pPrev(NULL)
+        , pNext(NULL)
+    {
+    }
+};
+
+/// Process-wide thread-exit notification, built on a single FLS slot.
+/// Unlike TLS, an FLS slot has a destructor callback that the OS runs on
+/// thread exit; that callback walks the exiting thread's list of hooks.
+///
+/// All lists are protected by one process-wide lock, which is also held while
+/// the callbacks run.  That is what lets an owner unregister hooks that
+/// belong to other (still running) threads, e.g. from a mutex destructor,
+/// without racing against those threads' exit.
+/// Because of that, callbacks must never block: a callback that waited on a
+/// mutex would deadlock against any thread that holds that mutex while
+/// registering a hook on another one.  The zoo's mutexes just push the
+/// record onto a lock-free list, and clean it up later under their own lock.
+///
+/// It's a template only so that the statics can live in this header.
+template <int TDummy>
+class ThreadExitHooksT
+{
+private:
+    static DWORD volatile s_flsIndex;
+    static SRWLOCK s_lock;
+
+private:
+    static void NTAPI onFlsDestroyed(PVOID pValue)
+    {
+        ThreadExitHook* pHead = (ThreadExitHook*)pValue;
+        AcquireSRWLockExclusive(&s_lock);
+        while (pHead->pNext != pHead)
+        {
+            ThreadExitHook* pHook = pHead->pNext;
+            unlink(pHook);
+            pHook->pfnOnThreadExit(pHook);
+        }
+        ReleaseSRWLockExclusive(&s_lock);
+        delete pHead;
+    }
+
+    static DWORD getFlsIndex()
+    {
+        if (s_flsIndex == FLS_OUT_OF_INDEXES)
+        {
+            DWORD flsIndex = FlsAlloc(&onFlsDestroyed);
+            assert(flsIndex != FLS_OUT_OF_INDEXES);
+            DWORD old = (DWORD)_InterlockedCompareExchange((volatile long*)&s_flsIndex, (long)flsIndex, (long)FLS_OUT_OF_INDEXES);
+            if (old != FLS_OUT_OF_INDEXES)
+            {
+                // we lost the race
+                FlsFree(flsIndex);
+            }
+        }
+        return s_flsIndex;
+    }
+
+    static void unlink(ThreadExitHook* pHook)
+    {
+        pHook->pPrev->pNext = pHook->pNext;
+        pHook->pNext->pPrev = pHook->pPrev;
+        pHook->pPrev = NULL;
+        pHook->pNext = NULL;
+    }
+
+public:
+    /// Arranges for pfnOnThreadExit(pHook) to be called when the calling thread exits.
+    static void Register(ThreadExitHook* pHook, ThreadExitHook::Callback pfnOnThreadExit)
+    {
+        const DWORD flsIndex = getFlsIndex();
+        ThreadExitHook* pHead = (ThreadExitHook*)FlsGetValue(flsIndex);
+        if (pHead == NULL)
+        {
+            pHead = new ThreadExitHook();
+            pHead->pPrev = pHead;
+            pHead->pNext = pHead;
+            FlsSetValue(flsIndex, pHead);
+        }
+
+        AcquireSRWLockExclusive(&s_lock);
+        pHook->pfnOnThreadExit = pfnOnThreadExit;
+        pHook->pPrev = pHead;
+        pHook->pNext = pHead->pNext;
+        pHead->pNext->pPrev = pHook;
+        pHead->pNext = pHook;
+        ReleaseSRWLockExclusive(&s_lock);
+    }
+
+    /// Unregisters every hook in a container of hook pointers (e.g. a
+    /// ThreadRegistry's records).  May be called from any thread.
+    /// The container is only read once the lock is held, so an exit callback that
+    /// was already running and modifying it has finished by then; and once this
+    /// returns, no callback for these hooks can ever run.
+    template <class THookContainer>
+    static void UnregisterAll(THookContainer const& hooks)
+    {
+        AcquireSRWLockExclusive(&s_lock);
+        for (typename THookContainer::const_iterator iter = hooks.begin(),
+                                                      end = hooks.end();
+             iter != end;
+             ++iter)
+        {
+            ThreadExitHook* pHook = *iter;
+            if (pHook->pNext)
+            {
+                unlink(pHook);
+            }
+        }
+        ReleaseSRWLockExclusive(&s_lock);
+    }
+};
+
+template <int TDummy>
+DWORD volatile ThreadExitHooksT<TDummy>::s_flsIndex = FLS_OUT_OF_INDEXES;
+template <int TDummy>
+SRWLOCK ThreadExitHooksT<TDummy>::s_lock = SRWLOCK_INIT;
+
+typedef ThreadExitHooksT<0> ThreadExitHooks;
+
+/// Base of the per-thread records kept in a ThreadRegistry.
+struct ThreadRegistryEntry : public ThreadExitHook
+{
+    // the owning registry's lock-free list of exited threads' records
+    ThreadRegistryEntry* volatile* ppExited;
+    ThreadRegistryEntry* pNextExited;
+    // position in the owning registry's Threads()
+    size_t registryIndex;
+
+    ThreadRegistryEntry()
+        : ppExited(NULL)
+        , pNextExited(NULL)
+        , registryIndex(0)
+    {
+    }
+};
+
+/// The reader registry of the TLS-based mutexes: one record (TlsData) per
+/// thread that has ever read-locked the mutex, for writers to scan.
+/// - TTlsData must derive from ThreadRegistryEntry and be default-constructible.
+///   The mutex keeps only its own fields in it.
+/// - When a thread exits, its record is handed back through ThreadExitHooks.
+///   The exit callback must not block, so it just pushes the record onto a
+///   lock-free list, and Compact() removes it from Threads() later.  That
+///   keeps Threads() dense, so that writers only ever scan live threads.
+/// - Removed records are kept as spares for Add() to recycle, but only as many
+///   as there are live threads, so that a shrinking thread pool doesn't pin
+///   its high-water mark forever.
+/// - The registry has no lock of its own.  The owner serializes Add(),
+///   Compact() and walks of Threads(), usually with its writer mutex.
+template <class TTlsData>
+class ThreadRegistry
+{
+public: // types
+    typedef std::vector<TTlsData*> ThreadStates;
+
+private: // members
+    ThreadStates m_threadStates;
+    ThreadStates m_freeTlsData;
+    ThreadRegistryEntry* volatile m_pExitedTlsData;
+
+private: // methods
+    static void onThreadExit(ThreadExitHook* pHook)
+    {
+        // Runs on the exiting thread under the ThreadExitHooks lock, so it
+        // must not block; just hand the record over to the next Compact().
+        ThreadRegistryEntry* pEntry = static_cast<ThreadRegistryEntry*>(pHook);
+        for (;;)
+        {
+            ThreadRegistryEntry* pHead = *pEntry->ppExited;
+            pEntry->pNextExited = pHead;
+            if (InterlockedCompareExchangePointer((PVOID volatile*)pEntry->ppExited, pEntry, pHead) == pHead)
+            {
+                break;
+            }
+        }
+    }
+
+    static void deleteAll(ThreadStates const& tlsDatas)
+    {
+        for (typename ThreadStates::const_iterator iter = tlsDatas.begin(),
+                                                    end = tlsDatas.end();
+             iter != end;
+             ++iter)
+        {
+            delete *iter;
+        }
+    }
+
+public: // interface
+    ThreadRegistry()
+        : m_pExitedTlsData(NULL)
+    {
+    }
+    ~ThreadRegistry()
+    {
+        ThreadExitHooks::UnregisterAll(m_threadStates);
+        deleteAll(m_threadStates);
+        deleteAll(m_freeTlsData);
+    }
+
+    /// Appends a spare or new record to Threads(), for the calling thread.
+    /// Call HookThreadExit() on it afterwards, with or without the lock.
+    TTlsData* Add()
+    {
+        TTlsData* pTlsData = NULL;
+        if (!m_freeTlsData.empty())
+        {
+            pTlsData = m_freeTlsData.back();
+            m_freeTlsData.pop_back();
+        }
+        else
+        {
+            pTlsData = new TTlsData();
+            pTlsData->ppExited = &m_pExitedTlsData;
+        }
+        pTlsData->registryIndex = m_threadStates.size();
+        m_threadStates.push_back(pTlsData);
+        return pTlsData;
+    }
+
+    /// Arranges for the calling thread's record to be removed when it exits.
+    void HookThreadExit(TTlsData* pTlsData)
+    {
+        ThreadExitHooks::Register(pTlsData, &onThreadExit);
+    }
+
+    /// Removes exited threads' records from Threads().
+    void Compact()
+    {
+        if (m_pExitedTlsData == NULL)
+        {
+            return;
+        }
+        ThreadRegistryEntry* pEntry = (ThreadRegistryEntry*)InterlockedExchangePointer((PVOID volatile*)&m_pExitedTlsData, NULL);
+        while (pEntry)
+        {
+            ThreadRegistryEntry* pNext = pEntry->pNextExited;
+            TTlsData* pTlsData = static_cast<TTlsData*>(pEntry);
+
+            TTlsData* pLast = m_threadStates.back();
+            m_threadStates[pTlsData->registryIndex] = pLast;
+            pLast->registryIndex = pTlsData->registryIndex;
+            m_threadStates.pop_back();
+
+            if (m_freeTlsData.size() < m_threadStates.size())
+            {
+                m_freeTlsData.push_back(pTlsData);
+            }
+            else
+            {
+                delete pTlsData;
+            }
+            pEntry = pNext;
+        }
+    }
+
+    /// The records of the live threads (and of exited ones not yet compacted).
+    ThreadStates const& Threads() const
+    {
+        return m_threadStates;
+    }
+};
@@ -4,20 +4,30 @@
 #include "common.h"
 #include "scoped_locks.h"
 #include "critical_section.h"
+#include "wait_policy.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
 
 /// This mutex is OK in terms of reader speed, but writer speed is still lacking.
+/// Before waiting on an event, the writer and the first locked reader spin on
+/// the word the event stands for, as TWaitPolicy's Spin() decides; the default
+/// goes straight to the event.
+template <class TMutex = CriticalSection, class TWaitPolicy = ParkWait>
 class TicketedReadWriteMutex
 {
 private: // types
-    struct TlsData
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
     {
         volatile DWORD isReading;
+        // nesting depth of this thread's read locks; only touched by the owning thread
+        long readDepth;
         HANDLE readerDoneEvent;
         bool isLockedReader;
         bool isFirstReader;
 
         TlsData()
             : isReading(false)
+            , readDepth(0)
             , readerDoneEvent(NULL)
             , isLockedReader(false)
             , isFirstReader(false)
@@ -31,7 +41,7 @@ private: // types
         }
     };
     typedef std::vector<TlsData*> ThreadStates;
-    typedef CriticalSection Mutex_t;
+    typedef TMutex Mutex_t;
 
 private: // members
     volatile long m_ticket;
@@ -48,26 +58,28 @@ private: // members
     // Queue mutex, to enforce fair ordering between readers and writers.
     Mutex_t m_csQueue;
     // Writer mutex, to mutually exclude writers from each other and from all-consecutive-readers.
-    // Also protects m_threadStates when new readers arrive.
+    // Also protects m_registry when new readers arrive.
     Mutex_t m_csWriter;
-    ThreadStates m_threadStates;
+    ThreadRegistry<TlsData> m_registry;
 
     // This gets signaled when the last locked reader exits the mutex,
     // so that the first locked reader may release m_csWriter.
     HANDLE m_lastLockedReaderEvent;
+    // how long waiters spin before they wait on the events
+    TWaitPolicy m_waitPolicy;
 
 private: // methods
     TlsData* initTlsData()
     {
-        TlsData* pTlsData = new TlsData();
-        TlsSetValue(m_tlsIndex, (void*)pTlsData);
-        DWORD threadId = GetCurrentThreadId();
-
+        TlsData* pTlsData = NULL;
         {
-            Mutex_t::ScopedWriteLock queueLk(m_csQueue);
-            Mutex_t::ScopedWriteLock lk(m_csWriter);
-            m_threadStates.push_back(pTlsData);
+            typename Mutex_t::ScopedWriteLock queueLk(m_csQueue);
+            typename Mutex_t::ScopedWriteLock lk(m_csWriter);
+            m_registry.Compact();
+            pTlsData = m_registry.Add();
         }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
         return pTlsData;
     }
 
@@ -83,6 +95,11 @@ private: // methods
 
     void readLock(TlsData* pTlsData)
     {
+        if (pTlsData->readDepth++ != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return;
+        }
         pTlsData->isReading = true;
         const long lastReaderTicket = m_lastReaderTicket;
         const long ticket = m_ticket;
@@ -115,8 +132,26 @@ private: // methods
         }
     }
 
+    // Called by the first locked reader when it leaves before the others:
+    // spins while they finish, as TWaitPolicy's Spin() decides, then collects
+    // the signal that the last of them leaves on m_lastLockedReaderEvent.
+    void waitForLastLockedReader()
+    {
+        for (long readerCount = m_readerCount;
+             readerCount != 0 && m_waitPolicy.Spin(&m_readerCount, readerCount, INFINITE);
+             readerCount = m_readerCount)
+        {
+        }
+        WaitForSingleObject(m_lastLockedReaderEvent, INFINITE);
+    }
+
     void readUnlock(TlsData* pTlsData)
     {
+        assert(pTlsData->readDepth > 0);
+        if (--pTlsData->readDepth != 0)
+        {
+            return;
+        }
         pTlsData->isReading = false;
         if (pTlsData->isLockedReader)
         {
@@ -138,7 +173,7 @@ private: // methods
             {
                 if (pTlsData->isFirstReader)
                 {
-                    WaitForSingleObject(m_lastLockedReaderEvent, INFINITE);
+                    waitForLastLockedReader();
                     pTlsData->isFirstReader = false;
                     m_csWriter.WriteUnlock();
                 }
@@ -167,14 +202,6 @@ public: // interface
     ~TicketedReadWriteMutex()
     {
         CloseHandle(m_lastLockedReaderEvent);
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            delete pTlsData;
-        }
         TlsFree(m_tlsIndex);
     }
 
@@ -183,17 +210,21 @@ public: // interface
         m_csQueue.WriteLock();
         _InterlockedExchangeAdd(&m_ticket, 2);
         m_csWriter.WriteLock();
+        m_registry.Compact();
         m_writeRequested = true;
         m_csQueue.WriteUnlock();
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
+        for (typename ThreadStates::const_iterator iter = m_registry.Threads().begin(),
+                                                    end = m_registry.Threads().end();
              iter != end;
              ++iter)
         {
             TlsData* pTlsData = *iter;
             while (pTlsData->isReading)
             {
-                WaitForSingleObject(pTlsData->readerDoneEvent, INFINITE);
+                if (!m_waitPolicy.Spin(&pTlsData->isReading, (DWORD)true, INFINITE))
+                {
+                    WaitForSingleObject(pTlsData->readerDoneEvent, INFINITE);
+                }
             }
         }
     }
@@ -213,7 +244,7 @@ public: // interface
         readUnlock(pTlsData);
     }
 
-    typedef ScopedWriteLock<TicketedReadWriteMutex> ScopedWriteLock;
+    typedef ScopedWriteLock<TicketedReadWriteMutex<TMutex, TWaitPolicy> > ScopedWriteLock;
 
     class ScopedReadLock
     {
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "common.h"
+
+/// What's left of a millisecond timeout, across however many waits it takes
+/// to acquire a lock.  INFINITE never runs out.
+/// Uses QueryPerformanceCounter rather than GetTickCount, whose 10-16ms
+/// resolution would swamp the short timeouts that load shedding uses.
+class Timeout
+{
+    DWORD m_milliseconds;
+    LONGLONG m_frequency;
+    LONGLONG m_deadline;
+
+public:
+    explicit Timeout(DWORD milliseconds)
+        : m_milliseconds(milliseconds)
+        , m_frequency(0)
+        , m_deadline(0)
+    {
+        if (m_milliseconds != INFINITE)
+        {
+            LARGE_INTEGER frequency, now;
+            QueryPerformanceFrequency(&frequency);
+            QueryPerformanceCounter(&now);
+            m_frequency = frequency.QuadPart;
+            m_deadline = now.QuadPart + m_milliseconds * m_frequency / 1000;
+        }
+    }
+
+    /// Milliseconds left, for passing to a wait function; 0 once expired.
+    DWORD Remaining() const
+    {
+        if (m_milliseconds == INFINITE)
+        {
+            return INFINITE;
+        }
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        if (now.QuadPart >= m_deadline)
+        {
+            return 0;
+        }
+        // round up, so that a wait doesn't end just short of the deadline
+        return (DWORD)(((m_deadline - now.QuadPart) * 1000 + m_frequency - 1) / m_frequency);
+    }
+
+    bool Expired() const
+    {
+        return Remaining() == 0;
+    }
+};
@@ -1,8 +1,13 @@
 #pragma once
 
+#include <intrin.h>
 #include "common.h"
 #include "scoped_locks.h"
 #include "critical_section.h"
+#include "timeout.h"
+#include "wait_policy.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
 
 /// A fully synchronized read-write mutex with the following properties.
 /// - Heavily biased towards high performance of large numbers of concurrent
@@ -12,21 +17,40 @@
 /// - When no writers are contending for a lock, readers only incur
 ///   1 volatile write + 1 volatile read on enter, and
 ///   1 volatile write + 1 volatile read on exit.
+/// - Short lookups can skip even that: TryOptimisticRead() returns a stamp,
+///   and Validate(stamp) tells whether a writer got in since.  Optimistic
+///   readers write nothing at all, but must tolerate torn data until they
+///   validate; when validation fails they can fall back to ReadLock().
+/// - UpgradeLock() is a read lock that can be upgraded to the write lock
+///   without releasing it.  Since it is just m_cs, it admits readers but
+///   excludes writers and other upgraders.  Threads that have never read-locked
+///   this mutex can't register as readers while it's held.  The upgrader
+///   registers itself before taking m_cs, so that its own read locks don't
+///   take m_cs again, which a non-recursive TMutex such as McsLock can't do.
+/// - Read locks nest: a thread that already holds the read lock only bumps
+///   its TlsData's readDepth, and only the outermost unlock clears isReading.
+/// - Before waiting on an event, a waiter spins on the word the event stands
+///   for, as TWaitPolicy's Spin() decides; the default goes straight to the
+///   event.
 /// - Use cases include:
 ///   - For API interception, normal API calls get read-locked; then a background
 ///     thread can acquire a write-lock to "boot everyone out of the API".
 ///   - Garbage Collector where normal threads read-lock the heap, and the
 ///     collection routine write-locks the heap.
+template <class TMutex = CriticalSection, class TWaitPolicy = ParkWait>
 class UltraFastReadWriteMutex
 {
 private: // types
-    struct TlsData
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
     {
         volatile DWORD isReading;
+        // nesting depth of this thread's read locks; only touched by the owning thread
+        long readDepth;
         HANDLE readerDoneEvent;
 
         TlsData()
             : isReading(false)
+            , readDepth(0)
             , readerDoneEvent(NULL)
         {
             readerDoneEvent = CreateEvent(NULL, /* bManualReset */ FALSE, /* bInitialState */ FALSE, NULL);
@@ -38,12 +62,16 @@ private: // types
         }
     };
     typedef std::vector<TlsData*> ThreadStates;
-    typedef CriticalSection Mutex_t;
+    typedef TMutex Mutex_t;
 
 private: // members
     // treated as an atomic bool
     volatile DWORD m_writeRequested;
-    volatile char pad0[CACHE_LINE_SIZE - 4];
+    // Odd while a writer holds (or is acquiring) the lock.  Starts at 2,
+    // since TryOptimisticRead() uses 0 for "failed".  Shares a cache line with
+    // m_writeRequested, since writers are the only ones to write either.
+    volatile long m_stamp;
+    volatile char pad0[CACHE_LINE_SIZE - 8];
 
     DWORD m_tlsIndex;
 
@@ -54,19 +82,21 @@ private: // members
     // - mutual exclusion of writers from each other
     // - mutual exclusion of new readers from existing writers
     Mutex_t m_cs;
-    ThreadStates m_threadStates;
+    // how long waiters spin before they wait on the events
+    TWaitPolicy m_waitPolicy;
+    ThreadRegistry<TlsData> m_registry;
 
 private:
     TlsData* initTlsData()
     {
-        TlsData* pTlsData = new TlsData();
-        TlsSetValue(m_tlsIndex, (void*)pTlsData);
-        DWORD threadId = GetCurrentThreadId();
-
+        TlsData* pTlsData = NULL;
         {
-            Mutex_t::ScopedWriteLock lk(m_cs);
-            m_threadStates.push_back(pTlsData);
+            typename Mutex_t::ScopedWriteLock lk(m_cs);
+            m_registry.Compact();
+            pTlsData = m_registry.Add();
         }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
         return pTlsData;
     }
 
@@ -82,19 +112,59 @@ private:
 
     void readLock(TlsData* pTlsData)
     {
+        if (pTlsData->readDepth++ != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return;
+        }
         pTlsData->isReading = true;
         while (m_writeRequested)
         {
             pTlsData->isReading = false;
             SetEvent(pTlsData->readerDoneEvent);
             // wait until writer finishes
-            WaitForSingleObject(m_writerDoneEvent, INFINITE);
+            if (!m_waitPolicy.Spin(&m_writeRequested, (DWORD)true, INFINITE))
+            {
+                WaitForSingleObject(m_writerDoneEvent, INFINITE);
+            }
+            pTlsData->isReading = true;
+        }
+    }
+
+    bool readLockFor(TlsData* pTlsData, DWORD milliseconds)
+    {
+        if (pTlsData->readDepth != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            pTlsData->readDepth++;
+            return true;
+        }
+        Timeout timeout(milliseconds);
+        pTlsData->isReading = true;
+        while (m_writeRequested)
+        {
+            pTlsData->isReading = false;
+            SetEvent(pTlsData->readerDoneEvent);
+            // wait until writer finishes, or give up
+            if (!m_waitPolicy.Spin(&m_writeRequested, (DWORD)true, timeout.Remaining()) &&
+                WaitForSingleObject(m_writerDoneEvent, timeout.Remaining()) == WAIT_TIMEOUT &&
+                m_writeRequested)
+            {
+                return false;
+            }
             pTlsData->isReading = true;
         }
+        pTlsData->readDepth = 1;
+        return true;
     }
 
     void readUnlock(TlsData* pTlsData)
     {
+        assert(pTlsData->readDepth > 0);
+        if (--pTlsData->readDepth != 0)
+        {
+            return;
+        }
         pTlsData->isReading = false;
         if (m_writeRequested)
         {
@@ -102,10 +172,56 @@ private:
         }
     }
 
+    // Turns m_cs into the write lock, by booting all readers out.
+    void bootReaders()
+    {
+        bootReadersFor(Timeout(INFINITE));
+    }
+
+    // Like bootReaders(), but if the timeout runs out first, lets the readers
+    // back in and returns false.
+    bool bootReadersFor(const Timeout& timeout)
+    {
+        m_registry.Compact();
+        ResetEvent(m_writerDoneEvent);
+        // Invalidate optimistic readers before anything is modified; the
+        // interlocked op keeps the caller's writes from moving above it.
+        _InterlockedIncrement(&m_stamp);
+        m_writeRequested = true;
+        for (typename ThreadStates::const_iterator iter = m_registry.Threads().begin(),
+                                                    end = m_registry.Threads().end();
+             iter != end;
+             ++iter)
+        {
+            TlsData* pTlsData = *iter;
+            while (pTlsData->isReading)
+            {
+                if (!m_waitPolicy.Spin(&pTlsData->isReading, (DWORD)true, timeout.Remaining()) &&
+                    WaitForSingleObject(pTlsData->readerDoneEvent, timeout.Remaining()) == WAIT_TIMEOUT &&
+                    pTlsData->isReading)
+                {
+                    admitReaders();
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Turns the write lock back into just m_cs.
+    void admitReaders()
+    {
+        // the interlocked op keeps the caller's writes from moving below it
+        _InterlockedIncrement(&m_stamp);
+        m_writeRequested = false;
+        SetEvent(m_writerDoneEvent);
+    }
+
 public:
     UltraFastReadWriteMutex()
         : m_tlsIndex(TLS_OUT_OF_INDEXES)
         , m_writeRequested(false)
+        , m_stamp(2)
         , m_writerDoneEvent(NULL)
     {
         m_tlsIndex = TlsAlloc();
@@ -116,37 +232,17 @@ public:
     ~UltraFastReadWriteMutex()
     {
         CloseHandle(m_writerDoneEvent);
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end; ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            delete pTlsData;
-        }
         TlsFree(m_tlsIndex);
     }
 
     void WriteLock()
     {
         m_cs.WriteLock();
-        ResetEvent(m_writerDoneEvent);
-        m_writeRequested = true;
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            while (pTlsData->isReading)
-            {
-                WaitForSingleObject(pTlsData->readerDoneEvent, INFINITE);
-            }
-        }
+        bootReaders();
     }
     void WriteUnlock()
     {
-        m_writeRequested = false;
-        SetEvent(m_writerDoneEvent);
+        admitReaders();
         m_cs.WriteUnlock();
     }
     void ReadLock()
@@ -160,7 +256,103 @@ public:
         readUnlock(pTlsData);
     }
 
-    typedef ScopedWriteLock<UltraFastReadWriteMutex> ScopedWriteLock;
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out lets back in the readers it had blocked.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_cs.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        if (!bootReadersFor(timeout))
+        {
+            m_cs.WriteUnlock();
+            return false;
+        }
+        return true;
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        TlsData* pTlsData = getTlsData();
+        return readLockFor(pTlsData, milliseconds);
+    }
+
+    /// Takes the upgrade lock, which admits readers but excludes writers and
+    /// other upgraders.
+    void UpgradeLock()
+    {
+        getTlsData();
+        m_cs.WriteLock();
+    }
+    void UpgradeUnlock()
+    {
+        m_cs.WriteUnlock();
+    }
+    /// Turns the upgrade lock into the write lock, waiting for readers to leave.
+    void Upgrade()
+    {
+        bootReaders();
+    }
+    /// Turns the write lock back into the upgrade lock.
+    void Downgrade()
+    {
+        admitReaders();
+    }
+
+    /// Starts an optimistic read.  Returns 0 if a writer is active, in which
+    /// case the caller should use ReadLock() instead.  (It may also return 0
+    /// spuriously, once every 2^31 writes.)
+    long TryOptimisticRead()
+    {
+        const long stamp = m_stamp;
+        if (stamp & 1)
+        {
+            return 0;
+        }
+        // x86 doesn't reorder loads with other loads, so keeping the
+        // compiler from doing so is enough.
+        _ReadBarrier();
+        return stamp;
+    }
+
+    /// Returns whether no writer has acquired the lock since
+    /// TryOptimisticRead() returned stamp, i.e. whether what was read since
+    /// is consistent.
+    bool Validate(long stamp)
+    {
+        _ReadBarrier();
+        return stamp != 0 && m_stamp == stamp;
+    }
+
+    /// Turns an optimistic read into a full read lock, if stamp is still valid.
+    /// On success the caller holds the read lock (release it with ReadUnlock()),
+    /// and what it read optimistically is still consistent.
+    bool TryConvertToReadLock(long stamp)
+    {
+        if (stamp == 0)
+        {
+            return false;
+        }
+        TlsData* pTlsData = getTlsData();
+        readLock(pTlsData);
+        if (m_stamp == stamp)
+        {
+            return true;
+        }
+        readUnlock(pTlsData);
+        return false;
+    }
+
+    typedef ScopedWriteLock<UltraFastReadWriteMutex<TMutex, TWaitPolicy> > ScopedWriteLock;
+    typedef ScopedUpgradeLock<UltraFastReadWriteMutex<TMutex, TWaitPolicy> > ScopedUpgradeLock;
 
     class ScopedReadLock
     {
@@ -0,0 +1,248 @@
+#pragma once
+
+#include "common.h"
+#include "scoped_locks.h"
+#include "critical_section.h"
+#include "timeout.h"
+#include "wait_policy.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
+
+/// This is the same algorithm as UltraFastReadWriteMutex, but the reader/writer
+/// handshakes are done with futexes instead of events.
+/// - The writer sleeps directly on each reader's isReading word, so there is
+///   no readerDoneEvent (and no kernel object at all) per thread.
+/// - Readers that find a writer present sleep on m_writeRequested itself,
+///   instead of on a manual-reset event that the writer has to reset/set.
+/// - When no writers are contending for a lock, readers still only incur
+///   1 volatile write + 1 volatile read on enter, and
+///   1 volatile write + 1 volatile read on exit.
+/// - Every futex wait and wake goes through TWaitPolicy (see wait_policy.h);
+///   the default parks right away.
+template <class TMutex = CriticalSection, class TWaitPolicy = ParkWait>
+class UltraFutexReadWriteMutex
+{
+private: // types
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
+    {
+        volatile long isReading;
+        // nesting depth of this thread's read locks; only touched by the owning thread
+        long readDepth;
+
+        TlsData()
+            : isReading(0)
+            , readDepth(0)
+        {
+        }
+    };
+    typedef std::vector<TlsData*> ThreadStates;
+    typedef TMutex Mutex_t;
+
+private: // members
+    // treated as an atomic bool; also the futex that blocked readers sleep on
+    volatile long m_writeRequested;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+
+    DWORD m_tlsIndex;
+
+    // This critical section enforces the following
+    // - mutual exclusion of writers from each other
+    // - protects m_registry
+    Mutex_t m_cs;
+    // how waiters wait on the futex words
+    TWaitPolicy m_waitPolicy;
+    ThreadRegistry<TlsData> m_registry;
+
+private:
+    TlsData* initTlsData()
+    {
+        TlsData* pTlsData = NULL;
+        {
+            typename Mutex_t::ScopedWriteLock lk(m_cs);
+            m_registry.Compact();
+            pTlsData = m_registry.Add();
+        }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
+        return pTlsData;
+    }
+
+    TlsData* getTlsData()
+    {
+        TlsData* pTlsData = (TlsData*)InlineTlsGetValue(m_tlsIndex);
+        if (pTlsData == NULL)
+        {
+            pTlsData = initTlsData();
+        }
+        return pTlsData;
+    }
+
+    void readLock(TlsData* pTlsData)
+    {
+        if (pTlsData->readDepth++ != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return;
+        }
+        pTlsData->isReading = 1;
+        while (m_writeRequested)
+        {
+            pTlsData->isReading = 0;
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
+            // wait until writer finishes
+            m_waitPolicy.Wait(&m_writeRequested, 1L);
+            pTlsData->isReading = 1;
+        }
+    }
+
+    bool readLockFor(TlsData* pTlsData, DWORD milliseconds)
+    {
+        if (pTlsData->readDepth != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            pTlsData->readDepth++;
+            return true;
+        }
+        Timeout timeout(milliseconds);
+        pTlsData->isReading = 1;
+        while (m_writeRequested)
+        {
+            pTlsData->isReading = 0;
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
+            // wait until writer finishes, or give up
+            if (!m_waitPolicy.WaitFor(&m_writeRequested, 1L, timeout.Remaining()) && m_writeRequested)
+            {
+                return false;
+            }
+            pTlsData->isReading = 1;
+        }
+        pTlsData->readDepth = 1;
+        return true;
+    }
+
+    void readUnlock(TlsData* pTlsData)
+    {
+        assert(pTlsData->readDepth > 0);
+        if (--pTlsData->readDepth != 0)
+        {
+            return;
+        }
+        pTlsData->isReading = 0;
+        if (m_writeRequested)
+        {
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
+        }
+    }
+
+    // Waits for all readers to leave; m_cs must already be held.  If the
+    // timeout runs out first, releases the write lock and returns false.
+    bool bootReadersFor(const Timeout& timeout)
+    {
+        m_registry.Compact();
+        m_writeRequested = 1;
+        // Keeps the store above ahead of the isReading loads below.  This only
+        // fences the writer's side: a reader's isReading store and its
+        // m_writeRequested load stay unfenced, exactly as in UltraFast, to keep
+        // the uncontended read path at one store and one load (see
+        // UltraSpinFencedReadWriteMutex for the fenced alternatives).
+        MemoryBarrier();
+        for (typename ThreadStates::const_iterator iter = m_registry.Threads().begin(),
+                                                    end = m_registry.Threads().end();
+             iter != end;
+             ++iter)
+        {
+            TlsData* pTlsData = *iter;
+            while (pTlsData->isReading)
+            {
+                if (!m_waitPolicy.WaitFor(&pTlsData->isReading, 1L, timeout.Remaining()) && pTlsData->isReading)
+                {
+                    // let the readers we blocked back in
+                    WriteUnlock();
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+public:
+    UltraFutexReadWriteMutex()
+        : m_tlsIndex(TLS_OUT_OF_INDEXES)
+        , m_writeRequested(0)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+
+        m_tlsIndex = TlsAlloc();
+        assert(m_tlsIndex != TLS_OUT_OF_INDEXES);
+    }
+    ~UltraFutexReadWriteMutex()
+    {
+        TlsFree(m_tlsIndex);
+    }
+
+    void WriteLock()
+    {
+        m_cs.WriteLock();
+        bootReadersFor(Timeout(INFINITE));
+    }
+    void WriteUnlock()
+    {
+        m_writeRequested = 0;
+        m_waitPolicy.WakeAll(&m_writeRequested);
+        m_cs.WriteUnlock();
+    }
+    void ReadLock()
+    {
+        TlsData* pTlsData = getTlsData();
+        readLock(pTlsData);
+    }
+    void ReadUnlock()
+    {
+        TlsData* pTlsData = getTlsData();
+        readUnlock(pTlsData);
+    }
+
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out wakes the readers it had blocked.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_cs.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        return bootReadersFor(timeout);
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        TlsData* pTlsData = getTlsData();
+        return readLockFor(pTlsData, milliseconds);
+    }
+
+    typedef ScopedWriteLock<UltraFutexReadWriteMutex<TMutex, TWaitPolicy> > ScopedWriteLock;
+
+    class ScopedReadLock
+    {
+        UltraFutexReadWriteMutex& m_mutex;
+        TlsData* m_pTlsData;
+
+    public:
+        ScopedReadLock(UltraFutexReadWriteMutex& mutex)
+            : m_mutex(mutex)
+        {
+            m_pTlsData = m_mutex.getTlsData();
+            m_mutex.readLock(m_pTlsData);
+        }
+        ~ScopedReadLock()
+        {
+            m_mutex.readUnlock(m_pTlsData);
+        }
+    };
+};
@@ -3,22 +3,33 @@
 #include "common.h"
 #include "scoped_locks.h"
 #include "critical_section.h"
+#include "timeout.h"
+#include "wait_policy.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
 
 /// This class is similar to UltraFastReadWriteMutex -- fully synchronized,
 /// writers take precedence over readers.  This version is lighter since
 /// it uses a single CriticalSection whenever readers and writers need
 /// to be arbitrated, but there's a performance cost since readers get
 /// temporarily serialized through it when a writer owns the lock.
+/// The writer spins on each reader's isReading, as TWaitPolicy's Spin()
+/// decides, before it waits on that reader's event; the default goes straight
+/// to the event.  Blocked readers wait on m_cs.
+template <class TMutex = CriticalSection, class TWaitPolicy = ParkWait>
 class UltraLightReadWriteMutex
 {
 private: // types
-    struct TlsData
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
     {
         volatile DWORD isReading;
+        // nesting depth of this thread's read locks; only touched by the owning thread
+        long readDepth;
         HANDLE readerDoneEvent;
 
         TlsData()
             : isReading(false)
+            , readDepth(0)
             , readerDoneEvent(NULL)
         {
             readerDoneEvent = CreateEvent(NULL, /* bManualReset */ FALSE, /* bInitialState */ FALSE, NULL);
@@ -30,7 +41,7 @@ private: // types
         }
     };
     typedef std::vector<TlsData*> ThreadStates;
-    typedef CriticalSection Mutex_t;
+    typedef TMutex Mutex_t;
 
 private: // members
     // treated as an atomic bool
@@ -43,21 +54,23 @@ private: // members
     // - mutual exclusion of writers from each other
     // - mutual exclusion of new readers from existing writers
     // - mutual exclusion and fair ordering of readers that arrive after previous writers
-    // - protects the m_threadStates vector
+    // - protects m_registry
     Mutex_t m_cs;
-    ThreadStates m_threadStates;
+    // how long the writer spins before it waits on a reader's event
+    TWaitPolicy m_waitPolicy;
+    ThreadRegistry<TlsData> m_registry;
 
 private: // methods
     TlsData* initTlsData()
     {
-        TlsData* pTlsData = new TlsData();
-        TlsSetValue(m_tlsIndex, (void*)pTlsData);
-        DWORD threadId = GetCurrentThreadId();
-
+        TlsData* pTlsData = NULL;
         {
-            Mutex_t::ScopedWriteLock lk(m_cs);
-            m_threadStates.push_back(pTlsData);
+            typename Mutex_t::ScopedWriteLock lk(m_cs);
+            m_registry.Compact();
+            pTlsData = m_registry.Add();
         }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
         return pTlsData;
     }
 
@@ -73,6 +86,11 @@ private: // methods
 
     void readLock(TlsData* pTlsData)
     {
+        if (pTlsData->readDepth++ != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return;
+        }
         pTlsData->isReading = true;
         while (m_writeRequested)
         {
@@ -80,14 +98,44 @@ private: // methods
             SetEvent(pTlsData->readerDoneEvent);
             // wait until writer finishes
             {
-                Mutex_t::ScopedWriteLock lk(m_cs);
+                typename Mutex_t::ScopedWriteLock lk(m_cs);
                 pTlsData->isReading = true;
             }
         }
     }
 
+    bool readLockFor(TlsData* pTlsData, DWORD milliseconds)
+    {
+        if (pTlsData->readDepth != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            pTlsData->readDepth++;
+            return true;
+        }
+        Timeout timeout(milliseconds);
+        pTlsData->isReading = true;
+        while (m_writeRequested)
+        {
+            pTlsData->isReading = false;
+            SetEvent(pTlsData->readerDoneEvent);
+            // wait until writer finishes, or give up
+            if (!m_cs.WriteLockFor(timeout.Remaining()))
+            {
+                return false;
+            }
+            pTlsData->isReading = true;
+            m_cs.WriteUnlock();
+        }
+        pTlsData->readDepth = 1;
+        return true;
+    }
     void readUnlock(TlsData* pTlsData)
     {
+        assert(pTlsData->readDepth > 0);
+        if (--pTlsData->readDepth != 0)
+        {
+            return;
+        }
         pTlsData->isReading = false;
         if (m_writeRequested)
         {
@@ -95,6 +143,33 @@ private: // methods
         }
     }
 
+    // Waits for all readers to leave; m_cs must already be held.  If the
+    // timeout runs out first, releases the write lock and returns false.
+    bool bootReadersFor(const Timeout& timeout)
+    {
+        m_registry.Compact();
+        m_writeRequested = true;
+        for (typename ThreadStates::const_iterator iter = m_registry.Threads().begin(),
+                                                    end = m_registry.Threads().end();
+             iter != end;
+             ++iter)
+        {
+            TlsData* pTlsData = *iter;
+            while (pTlsData->isReading)
+            {
+                if (!m_waitPolicy.Spin(&pTlsData->isReading, (DWORD)true, timeout.Remaining()) &&
+                    WaitForSingleObject(pTlsData->readerDoneEvent, timeout.Remaining()) == WAIT_TIMEOUT &&
+                    pTlsData->isReading)
+                {
+                    // the readers we blocked are waiting on m_cs
+                    WriteUnlock();
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
 public: // interface
     UltraLightReadWriteMutex()
         : m_tlsIndex(TLS_OUT_OF_INDEXES)
@@ -105,32 +180,13 @@ public: // interface
     }
     ~UltraLightReadWriteMutex()
     {
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            delete pTlsData;
-        }
         TlsFree(m_tlsIndex);
     }
 
     void WriteLock()
     {
         m_cs.WriteLock();
-        m_writeRequested = true;
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            while (pTlsData->isReading)
-            {
-                WaitForSingleObject(pTlsData->readerDoneEvent, INFINITE);
-            }
-        }
+        bootReadersFor(Timeout(INFINITE));
     }
     void WriteUnlock()
     {
@@ -148,7 +204,31 @@ public: // interface
         readUnlock(pTlsData);
     }
 
-    typedef ScopedWriteLock<UltraLightReadWriteMutex> ScopedWriteLock;
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out lets back in the readers it had blocked.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_cs.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        return bootReadersFor(timeout);
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        TlsData* pTlsData = getTlsData();
+        return readLockFor(pTlsData, milliseconds);
+    }
+
+    typedef ScopedWriteLock<UltraLightReadWriteMutex<TMutex, TWaitPolicy> > ScopedWriteLock;
 
     class ScopedReadLock
     {
@@ -0,0 +1,257 @@
+#pragma once
+
+#include "common.h"
+#include "scoped_locks.h"
+#include "critical_section.h"
+#include "timeout.h"
+#include "fences.h"
+#include "wait_policy.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
+
+/// This is UltraSpinReadWriteMutex with the store->load fence that the
+/// isReading/m_writeRequested handshake actually needs, supplied by TFence.
+/// - UltraSpinFencedReadWriteMutex<SymmetricFence> puts a full fence in every
+///   readLock(); this is the "textbook correct" version.
+/// - UltraSpinFencedReadWriteMutex<AsymmetricFence> leaves readers with only a
+///   compiler barrier, and has the writer flush every processor's store buffer
+///   after raising m_writeRequested and before it scans m_registry.
+///   Either a reader's isReading store is visible to the scan, or the reader's
+///   m_writeRequested load happens after the flush and sees the writer.
+/// - Waits go through TWaitPolicy, as in UltraSpinReadWriteMutex; the default
+///   has the writer poll each reader with Sleep(1).
+template <class TFence, class TMutex = CriticalSection, class TWaitPolicy = SleepWait<1> >
+class UltraSpinFencedReadWriteMutex
+{
+private: // types
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
+    {
+        volatile long isReading;
+        // nesting depth of this thread's read locks; only touched by the owning thread
+        long readDepth;
+
+        TlsData()
+            : isReading(0)
+            , readDepth(0)
+        {
+        }
+    };
+    typedef std::vector<TlsData*> ThreadStates;
+    typedef TMutex Mutex_t;
+
+private: // members
+    // treated as an atomic bool
+    volatile DWORD m_writeRequested;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+
+    DWORD m_tlsIndex;
+    HANDLE m_writerDoneEvent;
+
+    // This critical section enforces the following
+    // - mutual exclusion of writers from each other
+    // - protects m_registry
+    Mutex_t m_cs;
+    // how the writer waits for readers, and readers for the writer
+    TWaitPolicy m_waitPolicy;
+    ThreadRegistry<TlsData> m_registry;
+
+private:
+    TlsData* initTlsData()
+    {
+        TlsData* pTlsData = NULL;
+        {
+            typename Mutex_t::ScopedWriteLock lk(m_cs);
+            m_registry.Compact();
+            pTlsData = m_registry.Add();
+        }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
+        return pTlsData;
+    }
+
+    TlsData* getTlsData()
+    {
+        TlsData* pTlsData = (TlsData*)InlineTlsGetValue(m_tlsIndex);
+        if (pTlsData == NULL)
+        {
+            pTlsData = initTlsData();
+        }
+        return pTlsData;
+    }
+
+    void readLock(TlsData* pTlsData)
+    {
+        if (pTlsData->readDepth++ != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return;
+        }
+        pTlsData->isReading = 1;
+        TFence::ReaderFence();
+        while (m_writeRequested)
+        {
+            pTlsData->isReading = 0;
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
+            // wait until writer finishes
+            if (!m_waitPolicy.Spin(&m_writeRequested, (DWORD)true, INFINITE))
+            {
+                WaitForSingleObject(m_writerDoneEvent, INFINITE);
+            }
+            pTlsData->isReading = 1;
+            TFence::ReaderFence();
+        }
+    }
+    bool readLockFor(TlsData* pTlsData, DWORD milliseconds)
+    {
+        if (pTlsData->readDepth != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            pTlsData->readDepth++;
+            return true;
+        }
+        Timeout timeout(milliseconds);
+        pTlsData->isReading = 1;
+        TFence::ReaderFence();
+        while (m_writeRequested)
+        {
+            pTlsData->isReading = 0;
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
+            // wait until writer finishes, or give up
+            if (!m_waitPolicy.Spin(&m_writeRequested, (DWORD)true, timeout.Remaining()) &&
+                WaitForSingleObject(m_writerDoneEvent, timeout.Remaining()) == WAIT_TIMEOUT &&
+                m_writeRequested)
+            {
+                return false;
+            }
+            pTlsData->isReading = 1;
+            TFence::ReaderFence();
+        }
+        pTlsData->readDepth = 1;
+        return true;
+    }
+    void readUnlock(TlsData* pTlsData)
+    {
+        assert(pTlsData->readDepth > 0);
+        if (--pTlsData->readDepth != 0)
+        {
+            return;
+        }
+        pTlsData->isReading = 0;
+        if (m_writeRequested)
+        {
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
+        }
+    }
+
+    // Waits for all readers to leave; m_cs must already be held.  If the
+    // timeout runs out first, releases the write lock and returns false.
+    bool bootReadersFor(const Timeout& timeout)
+    {
+        m_registry.Compact();
+        ResetEvent(m_writerDoneEvent);
+        m_writeRequested = true;
+        TFence::WriterFence();
+        for (typename ThreadStates::const_iterator iter = m_registry.Threads().begin(),
+                                                    end = m_registry.Threads().end();
+             iter != end;
+             ++iter)
+        {
+            TlsData* pTlsData = *iter;
+            while (pTlsData->isReading)
+            {
+                if (!m_waitPolicy.WaitFor(&pTlsData->isReading, 1L, timeout.Remaining()) && pTlsData->isReading)
+                {
+                    // let the readers we blocked back in
+                    WriteUnlock();
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+public:
+    UltraSpinFencedReadWriteMutex()
+        : m_tlsIndex(TLS_OUT_OF_INDEXES)
+        , m_writeRequested(false)
+        , m_writerDoneEvent(NULL)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+
+        m_tlsIndex = TlsAlloc();
+        assert(m_tlsIndex != TLS_OUT_OF_INDEXES);
+        m_writerDoneEvent = CreateEvent(NULL, /* bManualReset */ TRUE, /* bInitialState */ TRUE, NULL);
+        assert(m_writerDoneEvent != NULL);
+    }
+    ~UltraSpinFencedReadWriteMutex()
+    {
+        CloseHandle(m_writerDoneEvent);
+        TlsFree(m_tlsIndex);
+    }
+
+    void WriteLock()
+    {
+        m_cs.WriteLock();
+        bootReadersFor(Timeout(INFINITE));
+    }
+    void WriteUnlock()
+    {
+        m_writeRequested = false;
+        SetEvent(m_writerDoneEvent);
+        m_cs.WriteUnlock();
+    }
+    void ReadLock()
+    {
+        TlsData* pTlsData = getTlsData();
+        readLock(pTlsData);
+    }
+    void ReadUnlock()
+    {
+        TlsData* pTlsData = getTlsData();
+        readUnlock(pTlsData);
+    }
+
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out lets back in the readers it had blocked.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_cs.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        return bootReadersFor(timeout);
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        TlsData* pTlsData = getTlsData();
+        return readLockFor(pTlsData, milliseconds);
+    }
+
+    typedef ScopedWriteLock<UltraSpinFencedReadWriteMutex<TFence, TMutex, TWaitPolicy> > ScopedWriteLock;
+
+    class ScopedReadLock
+    {
+        UltraSpinFencedReadWriteMutex& m_mutex;
+        TlsData* m_pTlsData;
+
+    public:
+        ScopedReadLock(UltraSpinFencedReadWriteMutex& mutex)
+            : m_mutex(mutex)
+        {
+            m_pTlsData = m_mutex.getTlsData();
+            m_mutex.readLock(m_pTlsData);
+        }
+        ~ScopedReadLock()
+        {
+            m_mutex.readUnlock(m_pTlsData);
+        }
+    };
+};
@@ -3,6 +3,10 @@
 #include "common.h"
 #include "scoped_locks.h"
 #include "critical_section.h"
+#include "timeout.h"
+#include "wait_policy.h"
+#include "thread_exit.h"
+#include "cacheline_slab.h"
 
 /// This class implements a read-write mutex that is
 /// heavily in favor of readers.
@@ -16,21 +20,29 @@
 /// allow the client to control that policy (allowing the mutex
 /// to use, say, a portion of some already-setup TLS system that
 /// the client has available).
-/// Note also that when a thread exits, its TLS data must be removed.
-/// That issue is not accounted for in this code either.
+/// When a thread exits, its TLS data is handed back through ThreadExitHooks,
+/// and removed from m_registry by the next writer (or new reader thread).
+/// The writer waits for each reader through TWaitPolicy; the default polls
+/// with Sleep(1).  Blocked readers spin per the policy, then wait on
+/// m_writerDoneEvent.
+template <class TMutex = CriticalSection, class TWaitPolicy = SleepWait<1> >
 class UltraSpinReadWriteMutex
 {
 private: // types
-    struct TlsData
+    struct TlsData : public ThreadRegistryEntry, public CacheLineAllocated
     {
-        volatile DWORD isReading;
+        volatile long isReading;
+        // nesting depth of this thread's read locks; only touched by the owning thread
+        long readDepth;
 
-        TlsData() : isReading(false)
+        TlsData()
+            : isReading(0)
+            , readDepth(0)
         {
         }
     };
     typedef std::vector<TlsData*> ThreadStates;
-    typedef CriticalSection Mutex_t;
+    typedef TMutex Mutex_t;
 
 private: // members
     // treated as an atomic bool
@@ -44,19 +56,21 @@ private: // members
     // - mutual exclusion of writers from each other
     // - mutual exclusion of new readers from existing writers
     Mutex_t m_cs;
-    ThreadStates m_threadStates;
+    // how the writer waits for readers, and readers for the writer
+    TWaitPolicy m_waitPolicy;
+    ThreadRegistry<TlsData> m_registry;
 
 private:
     TlsData* initTlsData()
     {
-        TlsData* pTlsData = new TlsData();
-        TlsSetValue(m_tlsIndex, (void*)pTlsData);
-        DWORD threadId = GetCurrentThreadId();
-
+        TlsData* pTlsData = NULL;
         {
-            Mutex_t::ScopedWriteLock lk(m_cs);
-            m_threadStates.push_back(pTlsData);
+            typename Mutex_t::ScopedWriteLock lk(m_cs);
+            m_registry.Compact();
+            pTlsData = m_registry.Add();
         }
+        TlsSetValue(m_tlsIndex, (void*)pTlsData);
+        m_registry.HookThreadExit(pTlsData);
         return pTlsData;
     }
 
@@ -72,18 +86,88 @@ private:
 
     void readLock(TlsData* pTlsData)
     {
-        pTlsData->isReading = true;
+        if (pTlsData->readDepth++ != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            return;
+        }
+        pTlsData->isReading = 1;
         while (m_writeRequested)
         {
-            pTlsData->isReading = false;
+            pTlsData->isReading = 0;
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
             // wait until writer finishes
-            WaitForSingleObject(m_writerDoneEvent, INFINITE);
-            pTlsData->isReading = true;
+            if (!m_waitPolicy.Spin(&m_writeRequested, (DWORD)true, INFINITE))
+            {
+                WaitForSingleObject(m_writerDoneEvent, INFINITE);
+            }
+            pTlsData->isReading = 1;
+        }
+    }
+    bool readLockFor(TlsData* pTlsData, DWORD milliseconds)
+    {
+        if (pTlsData->readDepth != 0)
+        {
+            // nested; the outermost read lock already holds the handshake
+            pTlsData->readDepth++;
+            return true;
+        }
+        Timeout timeout(milliseconds);
+        pTlsData->isReading = 1;
+        while (m_writeRequested)
+        {
+            pTlsData->isReading = 0;
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
+            // wait until writer finishes, or give up
+            if (!m_waitPolicy.Spin(&m_writeRequested, (DWORD)true, timeout.Remaining()) &&
+                WaitForSingleObject(m_writerDoneEvent, timeout.Remaining()) == WAIT_TIMEOUT &&
+                m_writeRequested)
+            {
+                return false;
+            }
+            pTlsData->isReading = 1;
         }
+        pTlsData->readDepth = 1;
+        return true;
     }
     void readUnlock(TlsData* pTlsData)
     {
-        pTlsData->isReading = false;
+        assert(pTlsData->readDepth > 0);
+        if (--pTlsData->readDepth != 0)
+        {
+            return;
+        }
+        pTlsData->isReading = 0;
+        if (m_writeRequested)
+        {
+            m_waitPolicy.WakeOne(&pTlsData->isReading);
+        }
+    }
+
+    // Waits for all readers to leave; m_cs must already be held.  If the
+    // timeout runs out first, releases the write lock and returns false.
+    bool bootReadersFor(const Timeout& timeout)
+    {
+        m_registry.Compact();
+        ResetEvent(m_writerDoneEvent);
+        m_writeRequested = true;
+        for (typename ThreadStates::const_iterator iter = m_registry.Threads().begin(),
+                                                    end = m_registry.Threads().end();
+             iter != end;
+             ++iter)
+        {
+            TlsData* pTlsData = *iter;
+            while (pTlsData->isReading)
+            {
+                if (!m_waitPolicy.WaitFor(&pTlsData->isReading, 1L, timeout.Remaining()) && pTlsData->isReading)
+                {
+                    // let the readers we blocked back in
+                    WriteUnlock();
+                    return false;
+                }
+            }
+        }
+        return true;
     }
 
 public:
@@ -100,33 +184,13 @@ public:
     ~UltraSpinReadWriteMutex()
     {
         CloseHandle(m_writerDoneEvent);
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            delete pTlsData;
-        }
         TlsFree(m_tlsIndex);
     }
 
     void WriteLock()
     {
         m_cs.WriteLock();
-        ResetEvent(m_writerDoneEvent);
-        m_writeRequested = true;
-        for (ThreadStates::iterator iter = m_threadStates.begin(),
-                                     end = m_threadStates.end();
-             iter != end;
-             ++iter)
-        {
-            TlsData* pTlsData = *iter;
-            while (pTlsData->isReading)
-            {
-                Sleep(1);
-            }
-        }
+        bootReadersFor(Timeout(INFINITE));
     }
     void WriteUnlock()
     {
@@ -145,7 +209,31 @@ public:
         readUnlock(pTlsData);
     }
 
-    typedef ScopedWriteLock<UltraSpinReadWriteMutex> ScopedWriteLock;
+    bool TryWriteLock()
+    {
+        return WriteLockFor(0);
+    }
+    /// A writer that times out lets back in the readers it had blocked.
+    bool WriteLockFor(DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        if (!m_cs.WriteLockFor(timeout.Remaining()))
+        {
+            return false;
+        }
+        return bootReadersFor(timeout);
+    }
+    bool TryReadLock()
+    {
+        return ReadLockFor(0);
+    }
+    bool ReadLockFor(DWORD milliseconds)
+    {
+        TlsData* pTlsData = getTlsData();
+        return readLockFor(pTlsData, milliseconds);
+    }
+
+    typedef ScopedWriteLock<UltraSpinReadWriteMutex<TMutex, TWaitPolicy> > ScopedWriteLock;
 
     class ScopedReadLock
     {
@@ -39,6 +39,26 @@ public:
         }
     }
 
+    bool TryP()
+    {
+        return PFor(0);
+    }
+
+    /// A timed-out waiter hasn't consumed the event, so there's nothing to undo.
+    bool PFor(DWORD milliseconds)
+    {
+        if (WaitForSingleObject(m_event, milliseconds) == WAIT_TIMEOUT)
+        {
+            return false;
+        }
+        const long oldSignalCount = _InterlockedExchangeAdd(&m_signalCount, -1);
+        if (oldSignalCount != 0)
+        {
+            SetEvent(m_event);
+        }
+        return true;
+    }
+
     void V(long delta)
     {
         assert(delta);
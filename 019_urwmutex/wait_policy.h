@@ -0,0 +1,348 @@
+#pragma once
+
+#include "common.h"
+#include "futex.h"
+#include "timeout.h"
+
+/// Wait policies: how a thread waits for a word to change.
+/// The mutexes take one as the TWaitPolicy template parameter and route their
+/// waits and wakes through it, so the same algorithm can be tuned
+/// for dedicated cores (spin, never pay for a kernel transition) or for
+/// oversubscribed machines (park, never burn a time slice the lock holder
+/// could use).
+///
+/// Each policy provides
+///     void Wait(volatile T* pWord, T undesired);
+///         Returns once *pWord != undesired.  May return spuriously; callers
+///         must re-check, just as with FutexWait().
+///     bool WaitFor(volatile T* pWord, T undesired, DWORD milliseconds);
+///         Like Wait(), but returns false if the timeout ran out.
+///     void WakeOne(volatile T* pWord);
+///     void WakeAll(volatile T* pWord);
+///         Called after changing *pWord.  No-ops for the policies that never
+///         park, which saves the wake side a call into the OS.
+///     bool Spin(volatile T* pWord, T undesired, DWORD milliseconds);
+///         Just the part of WaitFor() before it would park, for the mutexes
+///         that park on an event rather than on the word: returns true once
+///         *pWord != undesired, false when the caller should wait on its event.
+///         The policies that never park spin for the whole timeout.
+/// A mutex owns one instance of its policy, so a policy can keep per-mutex state.
+
+/// Sleeps on the word right away (the zoo's original futex behavior).
+class ParkWait
+{
+public:
+    template <class T>
+    void Wait(volatile T* pWord, T undesired)
+    {
+        FutexWait(pWord, undesired);
+    }
+    template <class T>
+    bool WaitFor(volatile T* pWord, T undesired, DWORD milliseconds)
+    {
+        return FutexWaitFor(pWord, undesired, milliseconds);
+    }
+    template <class T>
+    void WakeOne(volatile T* pWord)
+    {
+        FutexWakeOne(pWord);
+    }
+    template <class T>
+    void WakeAll(volatile T* pWord)
+    {
+        FutexWakeAll(pWord);
+    }
+    template <class T>
+    bool Spin(volatile T* pWord, T undesired, DWORD)
+    {
+        return *pWord != undesired;
+    }
+};
+
+/// Spins with `pause` until the word changes.  Only sensible when every
+/// waiter has a core of its own.
+class SpinWait
+{
+private: // types
+    enum
+    {
+        // how many spins between timeout checks, which cost a QPC call
+        CHECK_INTERVAL = 64
+    };
+
+public:
+    template <class T>
+    void Wait(volatile T* pWord, T undesired)
+    {
+        while (*pWord == undesired)
+        {
+            YieldProcessor();
+        }
+    }
+    template <class T>
+    bool WaitFor(volatile T* pWord, T undesired, DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        for (long spin = 0; *pWord == undesired; spin++)
+        {
+            if (spin % CHECK_INTERVAL == 0 && timeout.Expired())
+            {
+                return false;
+            }
+            YieldProcessor();
+        }
+        return true;
+    }
+    template <class T>
+    void WakeOne(volatile T*)
+    {
+    }
+    template <class T>
+    void WakeAll(volatile T*)
+    {
+    }
+    template <class T>
+    bool Spin(volatile T* pWord, T undesired, DWORD milliseconds)
+    {
+        return WaitFor(pWord, undesired, milliseconds);
+    }
+};
+
+/// Spins with exponentially growing runs of `pause` between checks, up to
+/// MAX_BACKOFF, so that many waiters polling one line don't keep stealing it
+/// from the thread that's about to write it.  Never parks.
+class BackoffWait
+{
+private: // types
+    enum
+    {
+        MAX_BACKOFF = 1024
+    };
+
+public:
+    template <class T>
+    void Wait(volatile T* pWord, T undesired)
+    {
+        for (long backoff = 1; *pWord == undesired; )
+        {
+            for (long i = 0; i < backoff; i++)
+            {
+                YieldProcessor();
+            }
+            if (backoff < MAX_BACKOFF)
+            {
+                backoff *= 2;
+            }
+        }
+    }
+    template <class T>
+    bool WaitFor(volatile T* pWord, T undesired, DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        for (long backoff = 1; *pWord == undesired; )
+        {
+            if (timeout.Expired())
+            {
+                return false;
+            }
+            for (long i = 0; i < backoff; i++)
+            {
+                YieldProcessor();
+            }
+            if (backoff < MAX_BACKOFF)
+            {
+                backoff *= 2;
+            }
+        }
+        return true;
+    }
+    template <class T>
+    void WakeOne(volatile T*)
+    {
+    }
+    template <class T>
+    void WakeAll(volatile T*)
+    {
+    }
+    template <class T>
+    bool Spin(volatile T* pWord, T undesired, DWORD milliseconds)
+    {
+        return WaitFor(pWord, undesired, milliseconds);
+    }
+};
+
+/// Spins TSpinCount times, then sleeps on the word.  Covers short holds
+/// without a kernel transition, and long ones without burning the CPU.
+template <long TSpinCount = 100>
+class SpinThenParkWait : public ParkWait
+{
+public:
+    template <class T>
+    void Wait(volatile T* pWord, T undesired)
+    {
+        for (long spin = 0; spin < TSpinCount; spin++)
+        {
+            if (*pWord != undesired)
+            {
+                return;
+            }
+            YieldProcessor();
+        }
+        FutexWait(pWord, undesired);
+    }
+    template <class T>
+    bool WaitFor(volatile T* pWord, T undesired, DWORD milliseconds)
+    {
+        for (long spin = 0; spin < TSpinCount; spin++)
+        {
+            if (*pWord != undesired)
+            {
+                return true;
+            }
+            YieldProcessor();
+        }
+        return FutexWaitFor(pWord, undesired, milliseconds);
+    }
+    template <class T>
+    bool Spin(volatile T* pWord, T undesired, DWORD)
+    {
+        for (long spin = 0; spin < TSpinCount; spin++)
+        {
+            if (*pWord != undesired)
+            {
+                return true;
+            }
+            YieldProcessor();
+        }
+        return false;
+    }
+};
+
+/// Spin-then-park with a spin budget learned from this mutex's recent waits,
+/// in the spirit of glibc's PTHREAD_MUTEX_ADAPTIVE_NP.
+/// - A wait that ends while spinning took about as long as the rest of the
+///   hold, so the budget moves 1/8 of the way towards twice that many spins.
+/// - A wait that outlasts the budget means the spinning was wasted, so the
+///   budget shrinks by 1/8.  On an oversubscribed machine, where the holder is
+///   often descheduled, the budget thus decays towards MIN_SPIN_COUNT;
+///   with dedicated cores and short holds it settles just above the hold time.
+/// - MIN_SPIN_COUNT keeps a few spins going, so that short holds can still be
+///   observed and the budget can grow back.
+/// - The budget is updated without synchronization; a lost update only makes
+///   the estimate a little staler.
+class AdaptiveWait : public ParkWait
+{
+private: // types
+    enum
+    {
+        MIN_SPIN_COUNT = 16,
+        MAX_SPIN_COUNT = 4000,
+        INITIAL_SPIN_COUNT = 100
+    };
+
+private: // members
+    volatile long m_spinCount;
+    volatile char pad0[CACHE_LINE_SIZE - 4];
+
+private: // methods
+    // Returns whether *pWord changed within the spin budget.
+    template <class T>
+    bool trySpin(volatile T* pWord, T undesired)
+    {
+        const long spinCount = m_spinCount;
+        for (long spin = 0; spin < spinCount; spin++)
+        {
+            if (*pWord != undesired)
+            {
+                const long next = spinCount + (2 * spin - spinCount) / 8;
+                m_spinCount = next < MIN_SPIN_COUNT ? MIN_SPIN_COUNT : (next > MAX_SPIN_COUNT ? MAX_SPIN_COUNT : next);
+                return true;
+            }
+            YieldProcessor();
+        }
+        const long next = spinCount - spinCount / 8;
+        m_spinCount = next < MIN_SPIN_COUNT ? MIN_SPIN_COUNT : next;
+        return false;
+    }
+
+public:
+    AdaptiveWait()
+        : m_spinCount(INITIAL_SPIN_COUNT)
+    {
+        memset((void*)pad0, 0, sizeof(pad0));
+    }
+
+    long SpinCount() const
+    {
+        return m_spinCount;
+    }
+
+    template <class T>
+    void Wait(volatile T* pWord, T undesired)
+    {
+        if (!trySpin(pWord, undesired))
+        {
+            FutexWait(pWord, undesired);
+        }
+    }
+    template <class T>
+    bool WaitFor(volatile T* pWord, T undesired, DWORD milliseconds)
+    {
+        if (trySpin(pWord, undesired))
+        {
+            return true;
+        }
+        return FutexWaitFor(pWord, undesired, milliseconds);
+    }
+    template <class T>
+    bool Spin(volatile T* pWord, T undesired, DWORD)
+    {
+        return trySpin(pWord, undesired);
+    }
+};
+
+/// Polls the word, giving up the time slice between checks: Sleep(0) only
+/// to threads that are ready at the same priority, Sleep(1) to anything.
+/// That's how UltraSpin's writer and WinFutexRecEv's unlocker waited before
+/// they took a policy.  Never parks.
+template <DWORD TSleepMilliseconds = 0>
+class SleepWait
+{
+public:
+    template <class T>
+    void Wait(volatile T* pWord, T undesired)
+    {
+        while (*pWord == undesired)
+        {
+            Sleep(TSleepMilliseconds);
+        }
+    }
+    template <class T>
+    bool WaitFor(volatile T* pWord, T undesired, DWORD milliseconds)
+    {
+        Timeout timeout(milliseconds);
+        while (*pWord == undesired)
+        {
+            if (timeout.Expired())
+            {
+                return false;
+            }
+            Sleep(TSleepMilliseconds);
+        }
+        return true;
+    }
+    template <class T>
+    void WakeOne(volatile T*)
+    {
+    }
+    template <class T>
+    void WakeAll(volatile T*)
+    {
+    }
+    template <class T>
+    bool Spin(volatile T* pWord, T undesired, DWORD)
+    {
+        // sleeping is all this policy does; leave that to the event
+        return *pWord != undesired;
+    }
+};
@@ -2,20 +2,27 @@
 
 #include "common.h"
 #include "scoped_locks.h"
+#include "wait_policy.h"
 
 struct WinFutexRecEvData
 {
     long volatile threadCount;
     DWORD volatile threadId;
     long recursionCount;
-    HANDLE hEvent;
+    HANDLE volatile hEvent;
 };
 
 #define WIN_FUTEX_REC_EV_DATA_INITIALIZER {0}
 
-class WinFutexRecEv
+/// An unlocker that finds a waiter, but no event yet, waits for the waiter to
+/// create it through TWaitPolicy; the default polls with Sleep(0).
+/// It's a template only so that the wait policy can be chosen;
+/// WinFutexRecEv is the default instantiation.
+template <class TWaitPolicy = SleepWait<0> >
+class WinFutexRecEvT
 {
     WinFutexRecEvData& m_data;
+    TWaitPolicy m_waitPolicy;
 
 private:
     void LazyInitEvent()
@@ -35,6 +42,10 @@ private:
                 // we lost the race
                 CloseHandle(hEvent);
             }
+            else
+            {
+                m_waitPolicy.WakeAll(&m_data.hEvent);
+            }
         }
     }
 
@@ -42,7 +53,7 @@ private:
     {
         while (!m_data.hEvent)
         {
-            Sleep(0);
+            m_waitPolicy.Wait(&m_data.hEvent, (HANDLE)NULL);
         }
     }
 
@@ -71,13 +82,14 @@ private:
     }
 
 public:
-    // Since this constructor only assigns a single pointer, it is threadsafe
-    // if called concurrently from multiple threads on the same instance.  This
-    // allows it to be used as a function-static variable.
-    WinFutexRecEv(WinFutexRecEvData& data) : m_data(data)
+    // Since this constructor only assigns a single pointer (and the wait
+    // policies that keep no state), it is threadsafe if called concurrently
+    // from multiple threads on the same instance.  This allows it to be used
+    // as a function-static variable.
+    WinFutexRecEvT(WinFutexRecEvData& data) : m_data(data)
     {
     }
-    ~WinFutexRecEv()
+    ~WinFutexRecEvT()
     {
         //CloseHandle(m_data.hEvent);
     }
@@ -140,18 +152,21 @@ public:
         WriteUnlock();
     }
 
-    typedef ScopedWriteLock<WinFutexRecEv> ScopedWriteLock;
-    typedef ScopedReadLock<WinFutexRecEv> ScopedReadLock;
+    typedef ScopedWriteLock<WinFutexRecEvT<TWaitPolicy> > ScopedWriteLock;
+    typedef ScopedReadLock<WinFutexRecEvT<TWaitPolicy> > ScopedReadLock;
 };
 
-// This class adapts WinFutexRecEv to the interface required by the tests.
-class WinFutexRecEvC
+typedef WinFutexRecEvT<> WinFutexRecEv;
+
+// This class adapts WinFutexRecEvT to the interface required by the tests.
+template <class TWaitPolicy = SleepWait<0> >
+class WinFutexRecEvCT
 {
-    WinFutexRecEv m_mutex;
+    WinFutexRecEvT<TWaitPolicy> m_mutex;
     WinFutexRecEvData m_data;
 
 public:
-    WinFutexRecEvC() : m_mutex(m_data)
+    WinFutexRecEvCT() : m_mutex(m_data)
     {
         memset(&m_data, 0, sizeof(m_data));
     }
@@ -174,6 +189,8 @@ public:
         m_mutex.ReadUnlock();
     }
 
-    typedef ScopedWriteLock<WinFutexRecEvC> ScopedWriteLock;
-    typedef ScopedReadLock<WinFutexRecEvC> ScopedReadLock;
+    typedef ScopedWriteLock<WinFutexRecEvCT<TWaitPolicy> > ScopedWriteLock;
+    typedef ScopedReadLock<WinFutexRecEvCT<TWaitPolicy> > ScopedReadLock;
 };
+
+typedef WinFutexRecEvCT<> WinFutexRecEvC;
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "common.h"
+#include "scoped_locks.h"
+#include "futex.h"
+
+/// Shared-mode sibling of WinFutexRecEv: the same one-struct,
+/// zero-initializable recursive lock, but readers run concurrently.
+/// - Reader count and writer ownership live in one word, m_data.state, and
+///   waiters sleep on that word with FutexWait(), so there's no lazily created
+///   event, no TLS slot, and nothing to initialize or destroy.  That is what
+///   makes it affordable as thousands of function-static locks.
+/// - A waiter sets WAITING before it sleeps; whoever clears it on unlock wakes
+///   everybody, and the writers among them race to re-set it.
+/// - The write lock is recursive, and its owner may also take the read lock,
+///   which then just nests the write lock.
+/// - Read locks nest too, without any per-thread state: readers only wait for a
+///   writer that holds the lock, never for one that's waiting.  So a reader
+///   that re-enters can't deadlock behind a queued writer, but a steady stream
+///   of readers can starve writers.
+/// - A reader can't upgrade: WriteLock() under ReadLock() deadlocks.
+struct WinFutexRwData
+{
+    long volatile state;
+    DWORD volatile threadId;
+    long recursionCount;
+};
+
+#define WIN_FUTEX_RW_DATA_INITIALIZER {0}
+
+class WinFutexRw
+{
+    enum
+    {
+        READER_MASK = 0x1fffffff,
+        WAITING = 0x20000000,
+        WRITER = 0x40000000
+    };
+
+    WinFutexRwData& m_data;
+
+private:
+    // Marks the word as having a waiter, and sleeps until it changes.
+    void Wait(long state)
+    {
+        if (!(state & WAITING))
+        {
+            if (_InterlockedCompareExchange(&m_data.state, state | WAITING, state) != state)
+            {
+                return;
+            }
+        }
+        FutexWait(&m_data.state, state | WAITING);
+    }
+
+public:
+    // Since this constructor only assigns a single pointer, it is threadsafe
+    // if called concurrently from multiple threads on the same instance.  This
+    // allows it to be used as a function-static variable.
+    WinFutexRw(WinFutexRwData& data) : m_data(data)
+    {
+    }
+
+    void WriteLock()
+    {
+        // test if this is a recursive lock
+        if (m_data.threadId == GetCurrentThreadId())
+        {
+            m_data.recursionCount += 1;
+            _ReadWriteBarrier();
+            return;
+        }
+
+        for (;;)
+        {
+            long const state = m_data.state;
+            if ((state & (WRITER | READER_MASK)) == 0)
+            {
+                // keep WAITING, for whoever else is still asleep
+                if (_InterlockedCompareExchange(&m_data.state, state | WRITER, state) == state)
+                {
+                    break;
+                }
+                continue;
+            }
+            Wait(state);
+        }
+        m_data.recursionCount = 1;
+        m_data.threadId = GetCurrentThreadId();
+        _ReadWriteBarrier();
+    }
+    void WriteUnlock()
+    {
+        _ReadWriteBarrier();
+        m_data.recursionCount -= 1;
+        if (m_data.recursionCount == 0)
+        {
+            // give up the thread's lock; no reader can have counted itself in
+            m_data.threadId = 0;
+            long const oldState = _InterlockedExchange(&m_data.state, 0);
+            if (oldState & WAITING)
+            {
+                FutexWakeAll(&m_data.state);
+            }
+        }
+    }
+
+    void ReadLock()
+    {
+        // the writer reading its own data
+        if (m_data.threadId == GetCurrentThreadId())
+        {
+            WriteLock();
+            return;
+        }
+
+        for (;;)
+        {
+            long const state = m_data.state;
+            if (!(state & WRITER))
+            {
+                assert((state & READER_MASK) != READER_MASK);
+                if (_InterlockedCompareExchange(&m_data.state, state + 1, state) == state)
+                {
+                    _ReadWriteBarrier();
+                    return;
+                }
+                continue;
+            }
+            Wait(state);
+        }
+    }
+    void ReadUnlock()
+    {
+        if (m_data.threadId == GetCurrentThreadId())
+        {
+            WriteUnlock();
+            return;
+        }
+
+        _ReadWriteBarrier();
+        for (;;)
+        {
+            long const state = m_data.state;
+            long newState = state - 1;
+            if ((newState & READER_MASK) == 0)
+            {
+                // the last reader out wakes the writers waiting for it
+                newState &= ~WAITING;
+            }
+            if (_InterlockedCompareExchange(&m_data.state, newState, state) == state)
+            {
+                if ((state & WAITING) && !(newState & WAITING))
+                {
+                    FutexWakeAll(&m_data.state);
+                }
+                return;
+            }
+        }
+    }
+
+    typedef ScopedWriteLock<WinFutexRw> ScopedWriteLock;
+    typedef ScopedReadLock<WinFutexRw> ScopedReadLock;
+};
+
+// This class adapts WinFutexRw to the interface required by the tests.
+class WinFutexRwC
+{
+    WinFutexRw m_mutex;
+    WinFutexRwData m_data;
+
+public:
+    WinFutexRwC() : m_mutex(m_data)
+    {
+        memset(&m_data, 0, sizeof(m_data));
+    }
+
+    void WriteLock()
+    {
+        m_mutex.WriteLock();
+    }
+    void WriteUnlock()
+    {
+        m_mutex.WriteUnlock();
+    }
+
+    void ReadLock()
+    {
+        m_mutex.ReadLock();
+    }
+    void ReadUnlock()
+    {
+        m_mutex.ReadUnlock();
+    }
+
+    typedef ScopedWriteLock<WinFutexRwC> ScopedWriteLock;
+    typedef ScopedReadLock<WinFutexRwC> ScopedReadLock;
+};